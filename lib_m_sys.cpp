@@ -1,4 +1,16 @@
 #include <iostream>
+// Row images in the change feed come from the pre-update hook, which
+// sqlite3.h only declares on request: build with
+// -DLIBRARY_WITH_PREUPDATE_HOOK against an SQLite compiled with
+// SQLITE_ENABLE_PREUPDATE_HOOK (as most distributions ship it).
+// -DLIBRARY_WITH_SESSION also enables the session extension, which
+// replication needs and which needs the pre-update hook.
+#if defined(LIBRARY_WITH_SESSION) && !defined(SQLITE_ENABLE_SESSION)
+#define SQLITE_ENABLE_SESSION 1
+#endif
+#if (defined(LIBRARY_WITH_PREUPDATE_HOOK) || defined(LIBRARY_WITH_SESSION)) && !defined(SQLITE_ENABLE_PREUPDATE_HOOK)
+#define SQLITE_ENABLE_PREUPDATE_HOOK 1
+#endif
 #include <sqlite3.h>
 #include <string>
 #include <vector>
@@ -7,207 +19,8342 @@
 #include <queue>
 #include <fstream>
 #include <sstream>
+#include <unordered_map>
+#include <mutex>
+#include <list>
+#include <atomic>
+#include <functional>
+#include <string_view>
+#include <cstdint>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <condition_variable>
+#include <deque>
+#include <random>
+#include <cmath>
+#include <memory>
+#include <future>
+#include <optional>
+#include <utility>
+#include <ctime>
+#include <unordered_set>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define LIBRARY_HAVE_AVX2 1
+#endif
+
+#if defined(__cpp_impl_coroutine) && defined(__has_include)
+#if __has_include(<coroutine>)
+#include <coroutine>
+#define LIBRARY_HAVE_COROUTINES 1
+#endif
+#endif
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <csignal>
+#include <cerrno>
+#define LIBRARY_HAVE_EPOLL 1
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#define LIBRARY_HAVE_MMAP 1
+#endif
+
+#ifdef SQLITE_ENABLE_PREUPDATE_HOOK
+#define LIBRARY_HAVE_PREUPDATE_HOOK 1
+#endif
+
+#ifdef SQLITE_ENABLE_SESSION
+#include <csignal>
+#include <filesystem>
+#define LIBRARY_HAVE_SESSION 1
+#endif
+
+// Optional gzip for streaming exports: build with -DLIBRARY_WITH_ZLIB -lz.
+#if defined(LIBRARY_WITH_ZLIB)
+#include <zlib.h>
+#define LIBRARY_HAVE_ZLIB 1
+#endif
 
 using namespace std;
 
+// ================================
+// Metrics
+// ================================
+// Process-wide registry of counters, gauges and latency histograms,
+// exported in Prometheus text format. Counters and histograms are split
+// into cache-line-sized shards and each thread updates its own shard with
+// relaxed atomics, so hot paths never take a lock or bounce a shared line;
+// reads sum the shards. Instruments are registered once (usually into a
+// function-local static) and then updated through the returned reference.
+static constexpr size_t kMetricShards = 16;
+
+static size_t metricShard() {
+    static atomic<size_t> nextShard{0};
+    static thread_local size_t shard = nextShard++ % kMetricShards;
+    return shard;
+}
+
+class Counter {
+public:
+    void inc(uint64_t n = 1) { shards[metricShard()].value.fetch_add(n, memory_order_relaxed); }
+    uint64_t value() const {
+        uint64_t total = 0;
+        for (const Shard& s : shards) total += s.value.load(memory_order_relaxed);
+        return total;
+    }
+
+private:
+    struct alignas(64) Shard {
+        atomic<uint64_t> value{0};
+    };
+    Shard shards[kMetricShards];
+};
+
+class Gauge {
+public:
+    void set(int64_t v) { current.store(v, memory_order_relaxed); }
+    void add(int64_t delta) { current.fetch_add(delta, memory_order_relaxed); }
+    int64_t value() const { return current.load(memory_order_relaxed); }
+
+private:
+    atomic<int64_t> current{0};
+};
+
+class Histogram {
+public:
+    // Bucket upper bounds, in nanoseconds, from 10us to 10s.
+    static constexpr uint64_t kBounds[] = {
+        10000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000, 25000000,
+        50000000, 100000000, 250000000, 500000000, 1000000000, 2500000000, 5000000000, 10000000000};
+    static constexpr size_t kBucketCount = sizeof(kBounds) / sizeof(kBounds[0]) + 1; // + Inf
+
+    void observe(uint64_t nanos) {
+        size_t bucket = static_cast<size_t>(lower_bound(begin(kBounds), end(kBounds), nanos) - begin(kBounds));
+        Shard& s = shards[metricShard()];
+        s.buckets[bucket].fetch_add(1, memory_order_relaxed);
+        s.sumNanos.fetch_add(nanos, memory_order_relaxed);
+    }
+    // Per-bucket (non-cumulative) counts and the sum of observations.
+    void collect(uint64_t (&counts)[kBucketCount], uint64_t& sumNanos) const;
+
+private:
+    struct alignas(64) Shard {
+        atomic<uint64_t> buckets[kBucketCount] = {};
+        atomic<uint64_t> sumNanos{0};
+    };
+    Shard shards[kMetricShards];
+};
+
+constexpr uint64_t Histogram::kBounds[];
+
+void Histogram::collect(uint64_t (&counts)[kBucketCount], uint64_t& sumNanos) const {
+    fill(begin(counts), end(counts), 0);
+    sumNanos = 0;
+    for (const Shard& s : shards) {
+        for (size_t b = 0; b < kBucketCount; ++b) counts[b] += s.buckets[b].load(memory_order_relaxed);
+        sumNanos += s.sumNanos.load(memory_order_relaxed);
+    }
+}
+
+class MetricsRegistry {
+public:
+    // name is the metric family; labels is the Prometheus label list
+    // without braces, e.g. op="borrowBook",result="ok".
+    Counter& counter(const string& name, const string& help, const string& labels = "");
+    Gauge& gauge(const string& name, const string& help, const string& labels = "");
+    Histogram& histogram(const string& name, const string& help, const string& labels = "");
+
+    string prometheusText() const;
+    // Written to a temporary file and renamed, so scrapers never see a
+    // partial file.
+    bool writePrometheusFile(const string& path) const;
+
+private:
+    enum class Kind { Counter, Gauge, Histogram };
+    struct Family {
+        Kind kind;
+        string help;
+        map<string, unique_ptr<Counter>> counters;
+        map<string, unique_ptr<Gauge>> gauges;
+        map<string, unique_ptr<Histogram>> histograms;
+    };
+
+    Family& family(const string& name, const string& help, Kind kind);
+
+    mutable mutex lock;
+    map<string, Family> families;
+};
+
+MetricsRegistry& metrics() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+MetricsRegistry::Family& MetricsRegistry::family(const string& name, const string& help, Kind kind) {
+    auto it = families.find(name);
+    if (it == families.end()) {
+        it = families.emplace(name, Family{kind, help, {}, {}, {}}).first;
+    }
+    return it->second;
+}
+
+Counter& MetricsRegistry::counter(const string& name, const string& help, const string& labels) {
+    lock_guard<mutex> guard(lock);
+    auto& slot = family(name, help, Kind::Counter).counters[labels];
+    if (!slot) slot.reset(new Counter());
+    return *slot;
+}
+
+Gauge& MetricsRegistry::gauge(const string& name, const string& help, const string& labels) {
+    lock_guard<mutex> guard(lock);
+    auto& slot = family(name, help, Kind::Gauge).gauges[labels];
+    if (!slot) slot.reset(new Gauge());
+    return *slot;
+}
+
+Histogram& MetricsRegistry::histogram(const string& name, const string& help, const string& labels) {
+    lock_guard<mutex> guard(lock);
+    auto& slot = family(name, help, Kind::Histogram).histograms[labels];
+    if (!slot) slot.reset(new Histogram());
+    return *slot;
+}
+
+string MetricsRegistry::prometheusText() const {
+    lock_guard<mutex> guard(lock);
+    ostringstream out;
+    auto braces = [](const string& labels) { return labels.empty() ? string() : "{" + labels + "}"; };
+
+    for (const auto& entry : families) {
+        const string& name = entry.first;
+        const Family& f = entry.second;
+        const char* type = f.kind == Kind::Counter ? "counter" : f.kind == Kind::Gauge ? "gauge" : "histogram";
+        out << "# HELP " << name << " " << f.help << "\n# TYPE " << name << " " << type << "\n";
+
+        for (const auto& c : f.counters) out << name << braces(c.first) << " " << c.second->value() << "\n";
+        for (const auto& g : f.gauges) out << name << braces(g.first) << " " << g.second->value() << "\n";
+        for (const auto& h : f.histograms) {
+            uint64_t counts[Histogram::kBucketCount];
+            uint64_t sumNanos;
+            h.second->collect(counts, sumNanos);
+            string prefix = h.first.empty() ? "" : h.first + ",";
+            uint64_t cumulative = 0;
+            for (size_t b = 0; b < Histogram::kBucketCount; ++b) {
+                cumulative += counts[b];
+                out << name << "_bucket{" << prefix << "le=\"";
+                if (b + 1 < Histogram::kBucketCount) {
+                    out << Histogram::kBounds[b] / 1e9;
+                } else {
+                    out << "+Inf";
+                }
+                out << "\"} " << cumulative << "\n";
+            }
+            out << name << "_sum" << braces(h.first) << " " << sumNanos / 1e9 << "\n";
+            out << name << "_count" << braces(h.first) << " " << cumulative << "\n";
+        }
+    }
+    return out.str();
+}
+
+bool MetricsRegistry::writePrometheusFile(const string& path) const {
+    const string tmpPath = path + ".tmp";
+    {
+        ofstream file(tmpPath, ios::trunc);
+        if (!file.is_open()) {
+            cerr << "Error: Could not write metrics to " << tmpPath << endl;
+            return false;
+        }
+        file << prometheusText();
+    }
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        cerr << "Error: Could not move metrics file into place at " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+// Counters and a latency histogram for one Library operation, labelled
+// op="<name>" and result="ok" | "rejected" (a normal refusal such as a
+// duplicate ISBN or no copies left) | "error".
+struct OperationMetrics {
+    explicit OperationMetrics(const string& op)
+        : duration(metrics().histogram("library_operation_duration_seconds", "Latency of Library operations.",
+                                       "op=\"" + op + "\"")),
+          ok(metrics().counter("library_operations_total", "Library operations by outcome.",
+                               "op=\"" + op + "\",result=\"ok\"")),
+          rejected(metrics().counter("library_operations_total", "Library operations by outcome.",
+                                     "op=\"" + op + "\",result=\"rejected\"")),
+          failed(metrics().counter("library_operations_total", "Library operations by outcome.",
+                                   "op=\"" + op + "\",result=\"error\"")) {}
+
+    Histogram& duration;
+    Counter& ok;
+    Counter& rejected;
+    Counter& failed;
+};
+
+// Times an operation and counts its outcome when it goes out of scope.
+// The outcome stays "error" unless markOk() or markRejected() is called.
+class OperationScope {
+public:
+    explicit OperationScope(OperationMetrics& instruments)
+        : instruments(instruments), start(chrono::steady_clock::now()) {}
+    ~OperationScope() {
+        instruments.duration.observe(static_cast<uint64_t>(
+            chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count()));
+        (outcome == Ok ? instruments.ok : outcome == Rejected ? instruments.rejected : instruments.failed).inc();
+    }
+    void markOk() { outcome = Ok; }
+    void markRejected() { outcome = Rejected; }
+
+private:
+    enum Outcome { Ok, Rejected, Failed };
+    OperationMetrics& instruments;
+    chrono::steady_clock::time_point start;
+    Outcome outcome = Failed;
+};
+
+// ================================
+// Tracing
+// ================================
+// Scoped spans recorded into per-thread ring buffers and dumped as Chrome
+// trace-event JSON (open in chrome://tracing or Perfetto). While tracing
+// is off a span costs one relaxed load; while on, it takes two clock reads
+// and an uncontended lock on its own thread's buffer. Span names must be
+// string literals, since only the pointer is stored.
+class Tracer {
+public:
+    struct Event {
+        const char* name;
+        uint64_t startNanos;
+        uint64_t durationNanos;
+    };
+
+    void enable(bool on) { enabled.store(on, memory_order_relaxed); }
+    bool isEnabled() const { return enabled.load(memory_order_relaxed); }
+    uint64_t now() const {
+        return static_cast<uint64_t>(
+            chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - epoch).count());
+    }
+    void record(const char* name, uint64_t startNanos, uint64_t endNanos);
+
+    string chromeTraceJson() const;
+    bool writeChromeTrace(const string& path) const;
+
+private:
+    static constexpr size_t kRingCapacity = 1 << 16; // events kept per thread
+
+    struct Ring {
+        mutex lock;
+        vector<Event> events;
+        uint64_t written = 0;
+        uint32_t threadId = 0;
+    };
+
+    Ring& localRing();
+
+    atomic<bool> enabled{false};
+    chrono::steady_clock::time_point epoch = chrono::steady_clock::now();
+    mutable mutex ringsLock;
+    vector<shared_ptr<Ring>> rings; // outlive their threads so dumps see them
+};
+
+Tracer& tracer() {
+    static Tracer instance;
+    return instance;
+}
+
+Tracer::Ring& Tracer::localRing() {
+    static thread_local shared_ptr<Ring> ring;
+    if (!ring) {
+        ring = make_shared<Ring>();
+        ring->events.resize(kRingCapacity);
+        lock_guard<mutex> guard(ringsLock);
+        ring->threadId = static_cast<uint32_t>(rings.size() + 1);
+        rings.push_back(ring);
+    }
+    return *ring;
+}
+
+void Tracer::record(const char* name, uint64_t startNanos, uint64_t endNanos) {
+    Ring& ring = localRing();
+    lock_guard<mutex> guard(ring.lock);
+    ring.events[ring.written % kRingCapacity] = {name, startNanos, endNanos - startNanos};
+    ++ring.written;
+}
+
+string Tracer::chromeTraceJson() const {
+    ostringstream out;
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    bool first = true;
+    char line[64];
+
+    lock_guard<mutex> ringsGuard(ringsLock);
+    for (const auto& ring : rings) {
+        lock_guard<mutex> guard(ring->lock);
+        uint64_t begin = ring->written > kRingCapacity ? ring->written - kRingCapacity : 0;
+        for (uint64_t i = begin; i < ring->written; ++i) {
+            const Event& e = ring->events[i % kRingCapacity];
+            if (!first) out << ",";
+            first = false;
+            out << "{\"name\":\"" << e.name << "\",\"cat\":\"library\",\"ph\":\"X\",";
+            snprintf(line, sizeof(line), "\"ts\":%.3f,\"dur\":%.3f,", e.startNanos / 1e3, e.durationNanos / 1e3);
+            out << line << "\"pid\":1,\"tid\":" << ring->threadId << "}";
+        }
+    }
+    out << "]}";
+    return out.str();
+}
+
+bool Tracer::writeChromeTrace(const string& path) const {
+    ofstream file(path, ios::trunc);
+    if (!file.is_open()) {
+        cerr << "Error: Could not write trace to " << path << endl;
+        return false;
+    }
+    file << chromeTraceJson();
+    return true;
+}
+
+class TraceSpan {
+public:
+    explicit TraceSpan(const char* name) : name(tracer().isEnabled() ? name : nullptr) {
+        if (this->name) start = tracer().now();
+    }
+    ~TraceSpan() { end(); }
+
+    // Close the span early, before the end of its scope.
+    void end() {
+        if (name) {
+            tracer().record(name, start, tracer().now());
+            name = nullptr;
+        }
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name;
+    uint64_t start = 0;
+};
+
+// ================================
+// Query Profiler
+// ================================
+// Hooks sqlite3_trace_v2(SQLITE_TRACE_PROFILE) on each connection and
+// aggregates call count, total and max run time per statement text (the
+// SQL as written, with ? placeholders, so every execution of the same
+// query lands in one row). Executions slower than the threshold are
+// appended to the slow-query log with their bound parameter values.
+struct QueryStats {
+    string sql;
+    uint64_t calls = 0;
+    uint64_t totalNanos = 0;
+    uint64_t maxNanos = 0;
+};
+
+class QueryProfiler {
+public:
+    void attach(sqlite3* conn);
+    void configure(uint64_t slowThresholdMs, const string& slowLogPath);
+    // Statements ordered by total time, most expensive first.
+    vector<QueryStats> snapshot() const;
+    void report(ostream& out, size_t limit = 20) const;
+
+private:
+    static int onTrace(unsigned mask, void* context, void* statement, void* elapsed);
+    void record(sqlite3_stmt* stmt, uint64_t nanos);
+
+    struct Shard {
+        mutable mutex lock;
+        unordered_map<string, QueryStats> byText;
+    };
+    Shard shards[kMetricShards];
+
+    atomic<uint64_t> slowThresholdNanos{100000000};
+    mutex slowLogLock;
+    string slowLogPath = "slow_queries.log";
+    ofstream slowLog;
+};
+
+QueryProfiler& queryProfiler() {
+    static QueryProfiler profiler;
+    return profiler;
+}
+
+void QueryProfiler::attach(sqlite3* conn) {
+    if (conn) {
+        sqlite3_trace_v2(conn, SQLITE_TRACE_PROFILE, &QueryProfiler::onTrace, this);
+    }
+}
+
+void QueryProfiler::configure(uint64_t slowThresholdMs, const string& path) {
+    slowThresholdNanos = slowThresholdMs * 1000000;
+    lock_guard<mutex> guard(slowLogLock);
+    if (path != slowLogPath && slowLog.is_open()) {
+        slowLog.close();
+    }
+    slowLogPath = path;
+}
+
+int QueryProfiler::onTrace(unsigned mask, void* context, void* statement, void* elapsed) {
+    if (mask == SQLITE_TRACE_PROFILE) {
+        static_cast<QueryProfiler*>(context)->record(static_cast<sqlite3_stmt*>(statement),
+                                                     *static_cast<sqlite3_int64*>(elapsed));
+    }
+    return 0;
+}
+
+void QueryProfiler::record(sqlite3_stmt* stmt, uint64_t nanos) {
+    const char* text = sqlite3_sql(stmt);
+    if (!text) return;
+    string sql(text);
+
+    Shard& shard = shards[hash<string>()(sql) % kMetricShards];
+    {
+        lock_guard<mutex> guard(shard.lock);
+        QueryStats& stats = shard.byText[sql];
+        if (stats.calls == 0) stats.sql = sql;
+        ++stats.calls;
+        stats.totalNanos += nanos;
+        stats.maxNanos = max(stats.maxNanos, nanos);
+    }
+
+    if (nanos < slowThresholdNanos.load(memory_order_relaxed)) return;
+
+    // Bindings are still attached while the profile callback runs.
+    char* expanded = sqlite3_expanded_sql(stmt);
+    // Profile callbacks run on every connection's thread; localtime()
+    // returns a shared buffer, so use the reentrant form.
+    time_t now = time(nullptr);
+    tm local{};
+#ifdef _WIN32
+    localtime_s(&local, &now);
+#else
+    localtime_r(&now, &local);
+#endif
+    char stamp[32];
+    strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &local);
+
+    lock_guard<mutex> guard(slowLogLock);
+    if (!slowLog.is_open()) {
+        slowLog.open(slowLogPath, ios::app);
+    }
+    if (slowLog.is_open()) {
+        slowLog << stamp << " " << nanos / 1e6 << " ms " << (expanded ? expanded : text) << "\n";
+        slowLog.flush();
+    }
+    sqlite3_free(expanded);
+}
+
+vector<QueryStats> QueryProfiler::snapshot() const {
+    vector<QueryStats> result;
+    for (const Shard& shard : shards) {
+        lock_guard<mutex> guard(shard.lock);
+        for (const auto& entry : shard.byText) result.push_back(entry.second);
+    }
+    sort(result.begin(), result.end(),
+         [](const QueryStats& a, const QueryStats& b) { return a.totalNanos > b.totalNanos; });
+    return result;
+}
+
+void QueryProfiler::report(ostream& out, size_t limit) const {
+    vector<QueryStats> stats = snapshot();
+    char line[96];
+    snprintf(line, sizeof(line), "%10s %12s %10s %10s  %s\n", "calls", "total ms", "avg us", "max us", "statement");
+    out << line;
+    for (size_t i = 0; i < stats.size() && i < limit; ++i) {
+        const QueryStats& s = stats[i];
+        snprintf(line, sizeof(line), "%10llu %12.3f %10.1f %10.1f  ", static_cast<unsigned long long>(s.calls),
+                 s.totalNanos / 1e6, s.totalNanos / 1e3 / static_cast<double>(s.calls), s.maxNanos / 1e3);
+        out << line << s.sql << "\n";
+    }
+}
+
+// ================================
+// Change Feed
+// ================================
+// Captures row changes to Books, Users and Transactions on the main
+// connection and publishes them in commit order, numbered by a sequence
+// that only increases. Changes are held back while their transaction
+// runs and dropped on rollback. In WAL mode they are published from the
+// WAL hook, which SQLite calls only once the commit is in the log, so
+// consumers never see writes that did not happen; the commit hook fires
+// before that point, and a COMMIT can still fail after it. Other journal
+// modes have no post-commit callback, and there the commit hook publishes.
+// Owning the WAL hook replaces SQLite's default auto-checkpoint, so the
+// hook checkpoints at the same threshold itself. Published
+// changes go to an in-memory ring (the last kRingSize, served by
+// GET /changes) and, if $LIBRARY_CHANGE_LOG is set, are appended to that
+// file as NDJSON. The sequence resumes from the file's last line on
+// restart. Only changes made through this process's connection are seen,
+// so the log is locked to one process at a time.
+//
+// With the pre-update hook each change carries the old and/or new row as
+// a JSON object; without it only the table, operation and rowid are known.
+// A connection has a single pre-update hook, so attach without row images
+// before opening a session on it (see Replication).
+struct ChangeEvent {
+    uint64_t sequence = 0;
+    string json; // one NDJSON line, without the newline
+};
+
+string jsonEscape(string_view text);
+
+class ChangeFeed {
+public:
+    static constexpr size_t kRingSize = 65536;
+
+    ~ChangeFeed();
+    // Start capturing on conn. Call once the schema is final: column names
+    // are read here because the hooks themselves may not run queries.
+    void attach(sqlite3* conn, bool rowImages = true);
+    void detach(sqlite3* conn);
+    // Append published changes to path, continuing its sequence.
+    bool openLog(const string& path);
+    // Up to limit changes with a sequence above after, oldest first. gap is
+    // set when some of those changes have already left the ring.
+    vector<ChangeEvent> since(uint64_t after, size_t limit, bool& gap) const;
+    uint64_t lastSequence() const;
+
+private:
+    struct Capture {
+        ChangeFeed* feed = nullptr;
+        sqlite3* conn = nullptr;
+        bool rowImages = false;
+        bool wal = false;
+        unordered_map<string, vector<string>> columns;
+        vector<string> pending;
+    };
+
+#ifdef LIBRARY_HAVE_PREUPDATE_HOOK
+    static void onPreUpdate(void* context, sqlite3* conn, int op, const char* schema, const char* table,
+                            sqlite3_int64 oldRowid, sqlite3_int64 newRowid);
+#endif
+    static void onUpdate(void* context, int op, const char* schema, const char* table, sqlite3_int64 rowid);
+    static int onCommit(void* context);
+    static int onWalCommit(void* context, sqlite3* conn, const char* schema, int pages);
+    static void onRollback(void* context);
+
+    // SQLite's default wal_autocheckpoint, in pages.
+    static constexpr int kCheckpointPages = 1000;
+    void publish(vector<string>& pending);
+
+    mutable mutex lock;
+    vector<ChangeEvent> ring;
+    uint64_t nextSequence = 1;
+    uint64_t firstInRing = 1;
+    FILE* log = nullptr;
+    vector<unique_ptr<Capture>> captures;
+};
+
+ChangeFeed& changeFeed() {
+    static ChangeFeed feed;
+    return feed;
+}
+
+ChangeFeed::~ChangeFeed() {
+    if (log) fclose(log);
+}
+
+static const char* changeOperation(int op) {
+    return op == SQLITE_INSERT ? "insert" : op == SQLITE_DELETE ? "delete" : "update";
+}
+
+void ChangeFeed::attach(sqlite3* conn, bool rowImages) {
+    if (!conn) return;
+    detach(conn);
+    auto capture = make_unique<Capture>();
+    capture->feed = this;
+    capture->conn = conn;
+    for (const char* table : {"Books", "Users", "Transactions"}) {
+        const string sql = string("PRAGMA table_info(") + table + ");";
+        sqlite3_stmt* stmt = nullptr;
+        vector<string>& names = capture->columns[table];
+        if (sqlite3_prepare_v2(conn, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                const unsigned char* name = sqlite3_column_text(stmt, 1);
+                names.push_back(name ? reinterpret_cast<const char*>(name) : "");
+            }
+            sqlite3_finalize(stmt);
+        }
+    }
+#ifdef LIBRARY_HAVE_PREUPDATE_HOOK
+    capture->rowImages = rowImages;
+    if (rowImages) {
+        sqlite3_preupdate_hook(conn, &ChangeFeed::onPreUpdate, capture.get());
+    }
+#else
+    (void)rowImages;
+#endif
+    if (!capture->rowImages) {
+        sqlite3_update_hook(conn, &ChangeFeed::onUpdate, capture.get());
+    }
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(conn, "PRAGMA journal_mode;", -1, &stmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            const unsigned char* mode = sqlite3_column_text(stmt, 0);
+            capture->wal = mode && strcmp(reinterpret_cast<const char*>(mode), "wal") == 0;
+        }
+        sqlite3_finalize(stmt);
+    }
+    sqlite3_commit_hook(conn, &ChangeFeed::onCommit, capture.get());
+    sqlite3_rollback_hook(conn, &ChangeFeed::onRollback, capture.get());
+    if (capture->wal) {
+        sqlite3_wal_hook(conn, &ChangeFeed::onWalCommit, capture.get());
+    }
+    lock_guard<mutex> guard(lock);
+    captures.push_back(move(capture));
+}
+
+void ChangeFeed::detach(sqlite3* conn) {
+    lock_guard<mutex> guard(lock);
+    for (auto it = captures.begin(); it != captures.end(); ++it) {
+        if ((*it)->conn == conn) {
+#ifdef LIBRARY_HAVE_PREUPDATE_HOOK
+            if ((*it)->rowImages) sqlite3_preupdate_hook(conn, nullptr, nullptr);
+#endif
+            sqlite3_update_hook(conn, nullptr, nullptr);
+            sqlite3_commit_hook(conn, nullptr, nullptr);
+            sqlite3_rollback_hook(conn, nullptr, nullptr);
+            // Puts back SQLite's own WAL hook.
+            if ((*it)->wal) sqlite3_wal_autocheckpoint(conn, kCheckpointPages);
+            captures.erase(it);
+            return;
+        }
+    }
+}
+
+bool ChangeFeed::openLog(const string& path) {
+    lock_guard<mutex> guard(lock);
+    if (log) {
+        fclose(log);
+        log = nullptr;
+    }
+    FILE* file = fopen(path.c_str(), "a+");
+    if (!file) {
+        cerr << "Error: Could not open file " << path << endl;
+        return false;
+    }
+#ifdef LIBRARY_HAVE_MMAP
+    if (flock(fileno(file), LOCK_EX | LOCK_NB) != 0) {
+        cerr << "Change log " << path << " is in use by another process; changes are not logged." << endl;
+        fclose(file);
+        return false;
+    }
+#endif
+    // Resume after the last complete line; a torn final line from a crash
+    // has no newline and is skipped.
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    long start = max(0L, size - 65536L);
+    string tail(static_cast<size_t>(size - start), '\0');
+    fseek(file, start, SEEK_SET);
+    tail.resize(fread(&tail[0], 1, tail.size(), file));
+    size_t end = tail.rfind('\n');
+    if (end != string::npos) {
+        size_t begin = tail.rfind('\n', end == 0 ? 0 : end - 1);
+        begin = (begin == string::npos || begin == end) ? 0 : begin + 1;
+        const char* key = "{\"seq\":";
+        if (tail.compare(begin, strlen(key), key) == 0) {
+            uint64_t last = strtoull(tail.c_str() + begin + strlen(key), nullptr, 10);
+            if (last >= nextSequence) {
+                nextSequence = last + 1;
+                firstInRing = nextSequence;
+            }
+        }
+    }
+#ifdef LIBRARY_HAVE_MMAP
+    if (end != string::npos && end + 1 != tail.size() && ftruncate(fileno(file), start + static_cast<long>(end) + 1) != 0) {
+        cerr << "Error: Could not trim the torn last line of " << path << endl;
+    }
+#endif
+    log = file;
+    return true;
+}
+
+#ifdef LIBRARY_HAVE_PREUPDATE_HOOK
+static void appendChangeValue(string& out, sqlite3_value* value) {
+    switch (value ? sqlite3_value_type(value) : SQLITE_NULL) {
+    case SQLITE_INTEGER:
+        out += to_string(sqlite3_value_int64(value));
+        break;
+    case SQLITE_FLOAT: {
+        double number = sqlite3_value_double(value);
+        char text[32];
+        snprintf(text, sizeof(text), "%.17g", number);
+        out += isfinite(number) ? text : "null";
+        break;
+    }
+    case SQLITE_TEXT:
+        out += '"';
+        out += jsonEscape(string_view(reinterpret_cast<const char*>(sqlite3_value_text(value)),
+                                      static_cast<size_t>(sqlite3_value_bytes(value))));
+        out += '"';
+        break;
+    case SQLITE_BLOB: {
+        static const char digits[] = "0123456789abcdef";
+        const unsigned char* bytes = static_cast<const unsigned char*>(sqlite3_value_blob(value));
+        out += '"';
+        for (int i = 0; i < sqlite3_value_bytes(value); ++i) {
+            out += digits[bytes[i] >> 4];
+            out += digits[bytes[i] & 15];
+        }
+        out += '"';
+        break;
+    }
+    default:
+        out += "null";
+    }
+}
+
+static void appendChangeRow(string& out, sqlite3* conn, const vector<string>& names, bool newRow) {
+    out += '{';
+    int count = sqlite3_preupdate_count(conn);
+    for (int i = 0; i < count; ++i) {
+        sqlite3_value* value = nullptr;
+        if (newRow) sqlite3_preupdate_new(conn, i, &value);
+        else sqlite3_preupdate_old(conn, i, &value);
+        if (i) out += ',';
+        out += '"';
+        out += static_cast<size_t>(i) < names.size() ? jsonEscape(names[i]) : "c" + to_string(i);
+        out += "\":";
+        appendChangeValue(out, value);
+    }
+    out += '}';
+}
+
+void ChangeFeed::onPreUpdate(void* context, sqlite3* conn, int op, const char* schema, const char* table,
+                             sqlite3_int64 oldRowid, sqlite3_int64 newRowid) {
+    Capture& capture = *static_cast<Capture*>(context);
+    auto names = capture.columns.find(table);
+    if (strcmp(schema, "main") != 0 || names == capture.columns.end()) return;
+    string event = "\"table\":\"" + string(table) + "\",\"op\":\"" + changeOperation(op) +
+                   "\",\"rowid\":" + to_string(op == SQLITE_DELETE ? oldRowid : newRowid);
+    if (op != SQLITE_INSERT) {
+        event += ",\"old\":";
+        appendChangeRow(event, conn, names->second, false);
+    }
+    if (op != SQLITE_DELETE) {
+        event += ",\"new\":";
+        appendChangeRow(event, conn, names->second, true);
+    }
+    capture.pending.push_back(move(event));
+}
+#endif
+
+void ChangeFeed::onUpdate(void* context, int op, const char* schema, const char* table, sqlite3_int64 rowid) {
+    Capture& capture = *static_cast<Capture*>(context);
+    if (strcmp(schema, "main") != 0 || !capture.columns.count(table)) return;
+    capture.pending.push_back("\"table\":\"" + string(table) + "\",\"op\":\"" + changeOperation(op) +
+                              "\",\"rowid\":" + to_string(rowid));
+}
+
+// Pending changes stay put through a COMMIT that fails (SQLITE_BUSY), so a
+// retry publishes them once and a ROLLBACK drops them.
+int ChangeFeed::onCommit(void* context) {
+    Capture& capture = *static_cast<Capture*>(context);
+    if (!capture.wal && !capture.pending.empty()) {
+        capture.feed->publish(capture.pending);
+    }
+    return 0;
+}
+
+int ChangeFeed::onWalCommit(void* context, sqlite3* conn, const char* schema, int pages) {
+    Capture& capture = *static_cast<Capture*>(context);
+    if (strcmp(schema, "main") == 0 && !capture.pending.empty()) {
+        capture.feed->publish(capture.pending);
+    }
+    if (pages >= kCheckpointPages) {
+        sqlite3_wal_checkpoint_v2(conn, schema, SQLITE_CHECKPOINT_PASSIVE, nullptr, nullptr);
+    }
+    return SQLITE_OK;
+}
+
+void ChangeFeed::onRollback(void* context) {
+    static_cast<Capture*>(context)->pending.clear();
+}
+
+void ChangeFeed::publish(vector<string>& pending) {
+    static Counter& published = metrics().counter("library_changes_total", "Row changes published to the change feed.");
+    static Gauge& sequence = metrics().gauge("library_change_sequence", "Sequence number of the last published change.");
+
+    lock_guard<mutex> guard(lock);
+    if (ring.empty()) ring.resize(kRingSize);
+    for (string& body : pending) {
+        uint64_t seq = nextSequence++;
+        ChangeEvent& slot = ring[seq % kRingSize];
+        slot.sequence = seq;
+        slot.json = "{\"seq\":" + to_string(seq) + "," + body + "}";
+        if (log) {
+            fwrite(slot.json.data(), 1, slot.json.size(), log);
+            fputc('\n', log);
+        }
+    }
+    if (log) fflush(log);
+    if (nextSequence - firstInRing > kRingSize) firstInRing = nextSequence - kRingSize;
+    published.inc(pending.size());
+    sequence.set(static_cast<int64_t>(nextSequence - 1));
+    pending.clear();
+}
+
+vector<ChangeEvent> ChangeFeed::since(uint64_t after, size_t limit, bool& gap) const {
+    lock_guard<mutex> guard(lock);
+    gap = after + 1 < firstInRing;
+    vector<ChangeEvent> result;
+    for (uint64_t seq = max(after + 1, firstInRing); seq < nextSequence && result.size() < limit; ++seq) {
+        result.push_back(ring[seq % kRingSize]);
+    }
+    return result;
+}
+
+uint64_t ChangeFeed::lastSequence() const {
+    lock_guard<mutex> guard(lock);
+    return nextSequence - 1;
+}
+
 // ================================
 // SQLite Database Setup
 // ================================
 sqlite3* db = nullptr;
+const char* const databasePath = "library.db";
+const char* const catalogFilePath = "library.snap";
+const char* const shardPrefix = "library.shard";
+
+void openDatabase() {
+    static OperationMetrics instruments("openDatabase");
+    OperationScope scope(instruments);
+
+    int rc = sqlite3_open(databasePath, &db);
+    if (rc) {
+        cerr << "Error opening database: " << sqlite3_errmsg(db) << endl;
+        exit(1);
+    }
+    // WAL lets read connections run alongside the writer.
+    sqlite3_exec(db, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+    sqlite3_busy_timeout(db, 5000);
+    queryProfiler().attach(db);
+    metrics().gauge("library_database_open", "1 while the main database connection is open.").set(1);
+    scope.markOk();
+    cout << "Database opened successfully.\n";
+}
+
+void closeDatabase() {
+    if (db) {
+        changeFeed().detach(db);
+        sqlite3_close(db);
+        db = nullptr;
+        metrics().gauge("library_database_open", "1 while the main database connection is open.").set(0);
+        cout << "Database closed successfully.\n";
+    }
+}
+
+static bool tableHasColumn(const char* table, const char* column) {
+    const string sql = string("PRAGMA table_info(") + table + ");";
+    sqlite3_stmt* stmt = nullptr;
+    bool found = false;
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        while (!found && sqlite3_step(stmt) == SQLITE_ROW) {
+            const unsigned char* name = sqlite3_column_text(stmt, 1);
+            found = name && strcmp(reinterpret_cast<const char*>(name), column) == 0;
+        }
+        sqlite3_finalize(stmt);
+    }
+    return found;
+}
+
+void createTables() {
+    const string createBooksTable = 
+        "CREATE TABLE IF NOT EXISTS Books ("
+        "ISBN TEXT PRIMARY KEY, "
+        "Title TEXT, "
+        "Author TEXT, "
+        "Genre TEXT, "
+        "AvailableCopies INTEGER, "
+        "BorrowedCount INTEGER DEFAULT 0, "
+        "ContentHash INTEGER);"; // hash of the last imported feed row, see bookContentHash
+
+    const string createUsersTable =
+        "CREATE TABLE IF NOT EXISTS Users ("
+        "UserID TEXT PRIMARY KEY, "
+        "Name TEXT, "
+        "UserType TEXT);";
+
+    const string createTransactionsTable =
+        "CREATE TABLE IF NOT EXISTS Transactions ("
+        "TransactionID INTEGER PRIMARY KEY AUTOINCREMENT, "
+        "UserID TEXT, "
+        "ISBN TEXT, "
+        "Action TEXT, "
+        "Timestamp DATETIME DEFAULT CURRENT_TIMESTAMP, "
+        "Branch TEXT, " // where a copy was borrowed or returned, if given
+        "FOREIGN KEY(UserID) REFERENCES Users(UserID), "
+        "FOREIGN KEY(ISBN) REFERENCES Books(ISBN));";
+
+    // Copies on the shelf at each branch. Books.AvailableCopies stays the
+    // total; copies no branch holds form the unassigned pool.
+    const string createBranchCopiesTable =
+        "CREATE TABLE IF NOT EXISTS BranchCopies ("
+        "ISBN TEXT NOT NULL, "
+        "Branch TEXT NOT NULL, "
+        "Copies INTEGER NOT NULL CHECK (Copies >= 0), "
+        "PRIMARY KEY (ISBN, Branch)) WITHOUT ROWID;";
+
+    // ISBNs removed by an incremental import that tombstones missing rows.
+    const string createTombstonesTable =
+        "CREATE TABLE IF NOT EXISTS BookTombstones ("
+        "ISBN TEXT PRIMARY KEY, "
+        "Timestamp DATETIME DEFAULT CURRENT_TIMESTAMP);";
+
+    // Single-row version of the Books table, used to tell whether a
+    // catalog file still matches the database. Epoch is random per database
+    // file; Generation is bumped by every change to Books.
+    const string createCatalogMeta =
+        "CREATE TABLE IF NOT EXISTS CatalogMeta ("
+        "Id INTEGER PRIMARY KEY CHECK (Id = 0), "
+        "Epoch INTEGER NOT NULL, "
+        "Generation INTEGER NOT NULL);"
+        "INSERT OR IGNORE INTO CatalogMeta VALUES (0, random(), 0);"
+        "CREATE TRIGGER IF NOT EXISTS BooksInsertGeneration AFTER INSERT ON Books "
+        "BEGIN UPDATE CatalogMeta SET Generation = Generation + 1; END;"
+        "CREATE TRIGGER IF NOT EXISTS BooksUpdateGeneration AFTER UPDATE ON Books "
+        "BEGIN UPDATE CatalogMeta SET Generation = Generation + 1; END;"
+        "CREATE TRIGGER IF NOT EXISTS BooksDeleteGeneration AFTER DELETE ON Books "
+        "BEGIN UPDATE CatalogMeta SET Generation = Generation + 1; END;";
+
+    char* errorMessage;
+
+    if (sqlite3_exec(db, createBooksTable.c_str(), nullptr, nullptr, &errorMessage) != SQLITE_OK) {
+        cerr << "Error creating Books table: " << errorMessage << endl;
+        sqlite3_free(errorMessage);
+    }
+
+    // Databases created before incremental imports lack the hash column.
+    if (!tableHasColumn("Books", "ContentHash") &&
+        sqlite3_exec(db, "ALTER TABLE Books ADD COLUMN ContentHash INTEGER;", nullptr, nullptr, &errorMessage) != SQLITE_OK) {
+        cerr << "Error adding Books.ContentHash: " << errorMessage << endl;
+        sqlite3_free(errorMessage);
+    }
+
+    if (sqlite3_exec(db, createTombstonesTable.c_str(), nullptr, nullptr, &errorMessage) != SQLITE_OK) {
+        cerr << "Error creating BookTombstones table: " << errorMessage << endl;
+        sqlite3_free(errorMessage);
+    }
+
+    if (sqlite3_exec(db, createCatalogMeta.c_str(), nullptr, nullptr, &errorMessage) != SQLITE_OK) {
+        cerr << "Error creating CatalogMeta table: " << errorMessage << endl;
+        sqlite3_free(errorMessage);
+    }
+
+    if (sqlite3_exec(db, createUsersTable.c_str(), nullptr, nullptr, &errorMessage) != SQLITE_OK) {
+        cerr << "Error creating Users table: " << errorMessage << endl;
+        sqlite3_free(errorMessage);
+    }
+
+    if (sqlite3_exec(db, createTransactionsTable.c_str(), nullptr, nullptr, &errorMessage) != SQLITE_OK) {
+        cerr << "Error creating Transactions table: " << errorMessage << endl;
+        sqlite3_free(errorMessage);
+    }
+
+    // Databases created before branches lack the Branch column.
+    if (!tableHasColumn("Transactions", "Branch") &&
+        sqlite3_exec(db, "ALTER TABLE Transactions ADD COLUMN Branch TEXT;", nullptr, nullptr, &errorMessage) != SQLITE_OK) {
+        cerr << "Error adding Transactions.Branch: " << errorMessage << endl;
+        sqlite3_free(errorMessage);
+    }
+
+    // returnBook sums one user's history for one ISBN on every return, and
+    // incremental imports sum a book's loans; ISBN first serves both.
+    if (sqlite3_exec(db,
+                     "DROP INDEX IF EXISTS TransactionsUserIsbn;"
+                     "CREATE INDEX IF NOT EXISTS TransactionsIsbnUser ON Transactions(ISBN, UserID);",
+                     nullptr, nullptr, &errorMessage) != SQLITE_OK) {
+        cerr << "Error creating Transactions index: " << errorMessage << endl;
+        sqlite3_free(errorMessage);
+    }
+
+    if (sqlite3_exec(db, createBranchCopiesTable.c_str(), nullptr, nullptr, &errorMessage) != SQLITE_OK) {
+        cerr << "Error creating BranchCopies table: " << errorMessage << endl;
+        sqlite3_free(errorMessage);
+    }
+
+    changeFeed().attach(db);
+    cout << "Tables created successfully.\n";
+}
+
+static bool readCatalogVersion(sqlite3* conn, int64_t& epoch, int64_t& generation) {
+    sqlite3_stmt* stmt = nullptr;
+    bool found = false;
+    if (sqlite3_prepare_v2(conn, "SELECT Epoch, Generation FROM CatalogMeta WHERE Id = 0;", -1, &stmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            epoch = sqlite3_column_int64(stmt, 0);
+            generation = sqlite3_column_int64(stmt, 1);
+            found = true;
+        }
+        sqlite3_finalize(stmt);
+    }
+    return found;
+}
+
+// ================================
+// Book Record
+// ================================
+struct Book {
+    int64_t id = 0; // Books rowid
+    string isbn;
+    string title;
+    string author;
+    string genre;
+    int availableCopies = 0;
+    int borrowedCount = 0;
+};
+
+// ================================
+// Book Cache (sharded LRU)
+// ================================
+// Read-through cache of Book rows keyed by ISBN. The key space is split
+// across shards, each with its own lock and LRU list, so concurrent
+// lookups of different titles rarely contend. Writers invalidate entries
+// rather than patching them. Readers that fill the cache from a query use
+// the ticketed put(), which drops the row if the key's shard was
+// invalidated after the read began; the unticketed put() is only for
+// warm-up, before any writer runs.
+struct CacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    size_t size = 0;
+
+    double hitRate() const {
+        uint64_t lookups = hits + misses;
+        return lookups ? static_cast<double>(hits) / lookups : 0.0;
+    }
+};
+
+class BookCache {
+public:
+    explicit BookCache(size_t capacity = 65536);
+
+    bool get(const string& isbn, Book& book);
+    // Take a ticket before reading a row from the database and pass it to
+    // put(); the row is only cached if nothing invalidated the key's shard
+    // in between, so a slow reader cannot cache a row a writer replaced.
+    uint64_t ticket(const string& isbn);
+    void put(const Book& book);
+    void put(const Book& book, uint64_t ticket);
+    void invalidate(const string& isbn);
+    void clear();
+    CacheStats stats() const;
+
+private:
+    static constexpr size_t kShards = 16;
+
+    struct Shard {
+        mutable mutex lock;
+        list<Book> entries; // front = most recently used
+        unordered_map<string, list<Book>::iterator> index;
+        uint64_t invalidations = 0;
+    };
+
+    Shard& shardFor(const string& isbn) { return shards[hash<string>()(isbn) % kShards]; }
+    // Caller holds shard.lock.
+    void insertLocked(Shard& shard, const Book& book);
+
+    Shard shards[kShards];
+    size_t shardCapacity;
+    atomic<uint64_t> hits{0};
+    atomic<uint64_t> misses{0};
+    atomic<uint64_t> evictions{0};
+};
+
+BookCache::BookCache(size_t capacity)
+    : shardCapacity(max<size_t>(1, capacity / kShards)) {}
+
+bool BookCache::get(const string& isbn, Book& book) {
+    Shard& shard = shardFor(isbn);
+    lock_guard<mutex> guard(shard.lock);
+    auto it = shard.index.find(isbn);
+    if (it == shard.index.end()) {
+        misses.fetch_add(1, memory_order_relaxed);
+        return false;
+    }
+    shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+    book = *it->second;
+    hits.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+uint64_t BookCache::ticket(const string& isbn) {
+    Shard& shard = shardFor(isbn);
+    lock_guard<mutex> guard(shard.lock);
+    return shard.invalidations;
+}
+
+void BookCache::put(const Book& book, uint64_t ticket) {
+    Shard& shard = shardFor(book.isbn);
+    // Check and insert under one lock, or an invalidation could land
+    // between them and the stale row would be cached anyway.
+    lock_guard<mutex> guard(shard.lock);
+    if (shard.invalidations != ticket) return;
+    insertLocked(shard, book);
+}
+
+void BookCache::put(const Book& book) {
+    Shard& shard = shardFor(book.isbn);
+    lock_guard<mutex> guard(shard.lock);
+    insertLocked(shard, book);
+}
+
+void BookCache::insertLocked(Shard& shard, const Book& book) {
+    auto it = shard.index.find(book.isbn);
+    if (it != shard.index.end()) {
+        *it->second = book;
+        shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+        return;
+    }
+    if (shard.entries.size() >= shardCapacity) {
+        shard.index.erase(shard.entries.back().isbn);
+        shard.entries.pop_back();
+        evictions.fetch_add(1, memory_order_relaxed);
+    }
+    shard.entries.push_front(book);
+    shard.index[book.isbn] = shard.entries.begin();
+}
+
+void BookCache::invalidate(const string& isbn) {
+    Shard& shard = shardFor(isbn);
+    lock_guard<mutex> guard(shard.lock);
+    ++shard.invalidations;
+    auto it = shard.index.find(isbn);
+    if (it != shard.index.end()) {
+        shard.entries.erase(it->second);
+        shard.index.erase(it);
+    }
+}
+
+void BookCache::clear() {
+    for (Shard& shard : shards) {
+        lock_guard<mutex> guard(shard.lock);
+        shard.entries.clear();
+        shard.index.clear();
+    }
+}
+
+CacheStats BookCache::stats() const {
+    CacheStats result;
+    result.hits = hits.load(memory_order_relaxed);
+    result.misses = misses.load(memory_order_relaxed);
+    result.evictions = evictions.load(memory_order_relaxed);
+    for (const Shard& shard : shards) {
+        lock_guard<mutex> guard(shard.lock);
+        result.size += shard.entries.size();
+    }
+    return result;
+}
+
+// ================================
+// Catalog Snapshot (columnar)
+// ================================
+// Struct-of-arrays copy of the Books table for in-memory scans. Strings
+// live back to back in one arena per column and are addressed through an
+// offset array (row i spans offsets[i]..offsets[i + 1]); Genre is
+// dictionary-encoded and the counters are plain int32 arrays, so filters
+// and aggregates run as tight loops over contiguous memory.
+class CatalogSnapshot {
+public:
+    bool load(sqlite3* conn);
+
+    size_t size() const { return availableCopies.size(); }
+    string_view isbn(size_t row) const { return column(isbnArena, isbnOffsets, row); }
+    string_view title(size_t row) const { return column(titleArena, titleOffsets, row); }
+    string_view author(size_t row) const { return column(authorArena, authorOffsets, row); }
+    string_view genre(size_t row) const { return genreDictionary[genreCodes[row]]; }
+
+    // Dictionary code for a genre, or -1 if no book carries it.
+    int32_t genreCode(string_view genre) const;
+    const vector<string>& genres() const { return genreDictionary; }
+
+    const int32_t* genreCodeData() const { return genreCodes.data(); }
+    const int32_t* availableCopiesData() const { return availableCopies.data(); }
+    const int32_t* borrowedCountData() const { return borrowedCount.data(); }
+
+    int64_t totalAvailableCopies() const;
+    int64_t totalBorrowedCount() const;
+
+private:
+    static string_view column(const string& arena, const vector<uint32_t>& offsets, size_t row) {
+        return string_view(arena.data() + offsets[row], offsets[row + 1] - offsets[row]);
+    }
+    static void append(string& arena, vector<uint32_t>& offsets, const unsigned char* text, int bytes);
+
+    string isbnArena, titleArena, authorArena;
+    vector<uint32_t> isbnOffsets, titleOffsets, authorOffsets;
+    vector<string> genreDictionary;
+    unordered_map<string, int32_t> genreLookup;
+    vector<int32_t> genreCodes;
+    vector<int32_t> availableCopies;
+    vector<int32_t> borrowedCount;
+};
+
+void CatalogSnapshot::append(string& arena, vector<uint32_t>& offsets, const unsigned char* text, int bytes) {
+    if (text) {
+        arena.append(reinterpret_cast<const char*>(text), static_cast<size_t>(bytes));
+    }
+    offsets.push_back(static_cast<uint32_t>(arena.size()));
+}
+
+// Rebuild every column from Books in a single pass over one statement.
+bool CatalogSnapshot::load(sqlite3* conn) {
+    *this = CatalogSnapshot();
+    isbnOffsets.push_back(0);
+    titleOffsets.push_back(0);
+    authorOffsets.push_back(0);
+
+    sqlite3_stmt* countStmt = nullptr;
+    if (sqlite3_prepare_v2(conn, "SELECT COUNT(*) FROM Books;", -1, &countStmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_step(countStmt) == SQLITE_ROW) {
+            size_t rows = static_cast<size_t>(sqlite3_column_int64(countStmt, 0));
+            isbnOffsets.reserve(rows + 1);
+            titleOffsets.reserve(rows + 1);
+            authorOffsets.reserve(rows + 1);
+            genreCodes.reserve(rows);
+            availableCopies.reserve(rows);
+            borrowedCount.reserve(rows);
+        }
+        sqlite3_finalize(countStmt);
+    }
+
+    const string sql = "SELECT ISBN, Title, Author, Genre, AvailableCopies, BorrowedCount FROM Books;";
+    sqlite3_stmt* stmt = nullptr;
+
+    if (sqlite3_prepare_v2(conn, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        cerr << "Error preparing snapshot query: " << sqlite3_errmsg(conn) << endl;
+        return false;
+    }
+
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        append(isbnArena, isbnOffsets, sqlite3_column_text(stmt, 0), sqlite3_column_bytes(stmt, 0));
+        append(titleArena, titleOffsets, sqlite3_column_text(stmt, 1), sqlite3_column_bytes(stmt, 1));
+        append(authorArena, authorOffsets, sqlite3_column_text(stmt, 2), sqlite3_column_bytes(stmt, 2));
+
+        const unsigned char* genreText = sqlite3_column_text(stmt, 3);
+        string genreName = genreText ? reinterpret_cast<const char*>(genreText) : "";
+        auto it = genreLookup.find(genreName);
+        if (it == genreLookup.end()) {
+            it = genreLookup.emplace(genreName, static_cast<int32_t>(genreDictionary.size())).first;
+            genreDictionary.push_back(genreName);
+        }
+        genreCodes.push_back(it->second);
+
+        availableCopies.push_back(sqlite3_column_int(stmt, 4));
+        borrowedCount.push_back(sqlite3_column_int(stmt, 5));
+    }
+    sqlite3_finalize(stmt);
+
+    if (rc != SQLITE_DONE) {
+        cerr << "Error building snapshot: " << sqlite3_errmsg(conn) << endl;
+        return false;
+    }
+    return true;
+}
+
+int32_t CatalogSnapshot::genreCode(string_view genre) const {
+    auto it = genreLookup.find(string(genre));
+    return it == genreLookup.end() ? -1 : it->second;
+}
+
+int64_t CatalogSnapshot::totalAvailableCopies() const {
+    int64_t total = 0;
+    for (size_t i = 0; i < availableCopies.size(); ++i) {
+        total += availableCopies[i];
+    }
+    return total;
+}
+
+int64_t CatalogSnapshot::totalBorrowedCount() const {
+    int64_t total = 0;
+    for (size_t i = 0; i < borrowedCount.size(); ++i) {
+        total += borrowedCount[i];
+    }
+    return total;
+}
+
+// ================================
+// Filter Kernels
+// ================================
+// Predicates over snapshot columns produce a SelectionBitmap with one bit
+// per row; bitmaps are then combined with AND/OR. Integer columns and the
+// dictionary-encoded Genre column are both int32, so one kernel handles
+// "AvailableCopies > 0" and "genre = X" alike. On x86 the comparison runs
+// eight lanes at a time with AVX2 when the CPU supports it; otherwise, and
+// for the tail of the column, a scalar loop does the same work.
+enum class CompareOp { Equal, NotEqual, Less, LessEqual, Greater, GreaterEqual };
+
+class SelectionBitmap {
+public:
+    SelectionBitmap() = default;
+    explicit SelectionBitmap(size_t rows) : rows(rows), words((rows + 63) / 64, 0) {}
+
+    size_t size() const { return rows; }
+    bool test(size_t row) const { return (words[row / 64] >> (row % 64)) & 1; }
+    void set(size_t row) { words[row / 64] |= uint64_t(1) << (row % 64); }
+    uint64_t* data() { return words.data(); }
+    const uint64_t* data() const { return words.data(); }
+    size_t wordCount() const { return words.size(); }
+
+    SelectionBitmap& intersect(const SelectionBitmap& other);
+    SelectionBitmap& unite(const SelectionBitmap& other);
+    size_t count() const;
+    vector<size_t> rowsSelected() const;
+
+private:
+    size_t rows = 0;
+    vector<uint64_t> words;
+};
+
+static inline int popcount64(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#else
+    int bits = 0;
+    for (; word; word &= word - 1) ++bits;
+    return bits;
+#endif
+}
+
+static inline int highestBit64(uint64_t word) {
+#if defined(__GNUC__)
+    return 63 - __builtin_clzll(word);
+#else
+    int bit = 0;
+    while (word >>= 1) ++bit;
+    return bit;
+#endif
+}
+
+static inline int lowestBit64(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_ctzll(word);
+#else
+    int bit = 0;
+    while (!(word & 1)) { word >>= 1; ++bit; }
+    return bit;
+#endif
+}
+
+SelectionBitmap& SelectionBitmap::intersect(const SelectionBitmap& other) {
+    size_t n = min(words.size(), other.words.size());
+    for (size_t i = 0; i < n; ++i) words[i] &= other.words[i];
+    for (size_t i = n; i < words.size(); ++i) words[i] = 0;
+    return *this;
+}
+
+SelectionBitmap& SelectionBitmap::unite(const SelectionBitmap& other) {
+    size_t n = min(words.size(), other.words.size());
+    for (size_t i = 0; i < n; ++i) words[i] |= other.words[i];
+    return *this;
+}
+
+size_t SelectionBitmap::count() const {
+    size_t total = 0;
+    for (uint64_t word : words) total += static_cast<size_t>(popcount64(word));
+    return total;
+}
+
+vector<size_t> SelectionBitmap::rowsSelected() const {
+    vector<size_t> result;
+    for (size_t w = 0; w < words.size(); ++w) {
+        for (uint64_t word = words[w]; word; word &= word - 1) {
+            result.push_back(w * 64 + static_cast<size_t>(lowestBit64(word)));
+        }
+    }
+    return result;
+}
+
+template <CompareOp Op>
+static inline bool compareScalar(int32_t lhs, int32_t rhs) {
+    switch (Op) {
+        case CompareOp::Equal:        return lhs == rhs;
+        case CompareOp::NotEqual:     return lhs != rhs;
+        case CompareOp::Less:         return lhs < rhs;
+        case CompareOp::LessEqual:    return lhs <= rhs;
+        case CompareOp::Greater:      return lhs > rhs;
+        case CompareOp::GreaterEqual: return lhs >= rhs;
+    }
+    return false;
+}
+
+// Fills bits [first, n) of the bitmap; first is always a multiple of 64.
+template <CompareOp Op>
+static void filterInt32Scalar(const int32_t* values, size_t first, size_t n, int32_t operand, uint64_t* words) {
+    for (size_t base = first; base < n; base += 64) {
+        size_t end = min(base + 64, n);
+        uint64_t bits = 0;
+        for (size_t i = base; i < end; ++i) {
+            bits |= uint64_t(compareScalar<Op>(values[i], operand)) << (i - base);
+        }
+        words[base / 64] = bits;
+    }
+}
+
+#ifdef LIBRARY_HAVE_AVX2
+// Handles whole 64-row words and returns how many rows it covered.
+template <CompareOp Op>
+__attribute__((target("avx2")))
+static size_t filterInt32Avx2(const int32_t* values, size_t n, int32_t operand, uint64_t* words) {
+    const __m256i rhs = _mm256_set1_epi32(operand);
+    const size_t fullWords = n / 64;
+
+    for (size_t w = 0; w < fullWords; ++w) {
+        uint64_t bits = 0;
+        for (int lane = 0; lane < 8; ++lane) {
+            __m256i lhs = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values + w * 64 + lane * 8));
+            __m256i hit;
+            bool negate = false;
+            switch (Op) {
+                case CompareOp::Equal:        hit = _mm256_cmpeq_epi32(lhs, rhs); break;
+                case CompareOp::NotEqual:     hit = _mm256_cmpeq_epi32(lhs, rhs); negate = true; break;
+                case CompareOp::Less:         hit = _mm256_cmpgt_epi32(rhs, lhs); break;
+                case CompareOp::LessEqual:    hit = _mm256_cmpgt_epi32(lhs, rhs); negate = true; break;
+                case CompareOp::Greater:      hit = _mm256_cmpgt_epi32(lhs, rhs); break;
+                case CompareOp::GreaterEqual: hit = _mm256_cmpgt_epi32(rhs, lhs); negate = true; break;
+            }
+            uint32_t mask = static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(hit)));
+            if (negate) mask = ~mask & 0xFFu;
+            bits |= uint64_t(mask) << (lane * 8);
+        }
+        words[w] = bits;
+    }
+    return fullWords * 64;
+}
+
+static bool cpuHasAvx2() {
+    static const bool supported = __builtin_cpu_supports("avx2");
+    return supported;
+}
+#endif
+
+template <CompareOp Op>
+static void filterInt32(const int32_t* values, size_t n, int32_t operand, uint64_t* words) {
+    size_t done = 0;
+#ifdef LIBRARY_HAVE_AVX2
+    if (cpuHasAvx2()) {
+        done = filterInt32Avx2<Op>(values, n, operand, words);
+    }
+#endif
+    filterInt32Scalar<Op>(values, done, n, operand, words);
+}
+
+// Select rows where column[row] <op> operand.
+SelectionBitmap filterColumn(const int32_t* column, size_t rows, CompareOp op, int32_t operand) {
+    SelectionBitmap result(rows);
+    uint64_t* words = result.data();
+    switch (op) {
+        case CompareOp::Equal:        filterInt32<CompareOp::Equal>(column, rows, operand, words); break;
+        case CompareOp::NotEqual:     filterInt32<CompareOp::NotEqual>(column, rows, operand, words); break;
+        case CompareOp::Less:         filterInt32<CompareOp::Less>(column, rows, operand, words); break;
+        case CompareOp::LessEqual:    filterInt32<CompareOp::LessEqual>(column, rows, operand, words); break;
+        case CompareOp::Greater:      filterInt32<CompareOp::Greater>(column, rows, operand, words); break;
+        case CompareOp::GreaterEqual: filterInt32<CompareOp::GreaterEqual>(column, rows, operand, words); break;
+    }
+    return result;
+}
+
+// ================================
+// Roaring Bitmap
+// ================================
+// Compressed set of 32-bit ids. Ids are bucketed by their high 16 bits;
+// each bucket (container) stores its low 16 bits either as a sorted array
+// (sparse, up to 4096 values) or as a 65536-bit bitmap (dense), switching
+// representation as it grows or shrinks. Intersections work container by
+// container and only ever touch keys present on both sides.
+class RoaringBitmap {
+public:
+    void add(uint32_t value);
+    void remove(uint32_t value);
+    bool contains(uint32_t value) const;
+    uint64_t cardinality() const;
+    uint64_t andCardinality(const RoaringBitmap& other) const;
+    RoaringBitmap intersect(const RoaringBitmap& other) const;
+    // Containers held as bitmaps rather than arrays.
+    size_t bitmapContainers() const;
+
+private:
+    static constexpr uint32_t kArrayLimit = 4096;
+    static constexpr size_t kBitmapWords = 1024;
+
+    struct Container {
+        uint16_t key = 0;
+        uint32_t cardinality = 0;
+        vector<uint16_t> array;  // sorted low bits while sparse
+        vector<uint64_t> bitmap; // kBitmapWords words once dense
+
+        bool isBitmap() const { return !bitmap.empty(); }
+        bool contains(uint16_t low) const;
+        void toBitmap();
+        void toArray();
+    };
+
+    static uint64_t andCardinality(const Container& a, const Container& b);
+    static Container intersect(const Container& a, const Container& b);
+
+    vector<Container>::iterator find(uint16_t key);
+    vector<Container>::const_iterator find(uint16_t key) const;
+
+    vector<Container> containers; // sorted by key
+};
+
+bool RoaringBitmap::Container::contains(uint16_t low) const {
+    if (isBitmap()) return (bitmap[low / 64] >> (low % 64)) & 1;
+    return binary_search(array.begin(), array.end(), low);
+}
+
+void RoaringBitmap::Container::toBitmap() {
+    bitmap.assign(kBitmapWords, 0);
+    for (uint16_t low : array) bitmap[low / 64] |= uint64_t(1) << (low % 64);
+    vector<uint16_t>().swap(array);
+}
+
+void RoaringBitmap::Container::toArray() {
+    array.clear();
+    array.reserve(cardinality);
+    for (size_t w = 0; w < kBitmapWords; ++w) {
+        for (uint64_t word = bitmap[w]; word; word &= word - 1) {
+            array.push_back(static_cast<uint16_t>(w * 64 + static_cast<size_t>(lowestBit64(word))));
+        }
+    }
+    vector<uint64_t>().swap(bitmap);
+}
+
+vector<RoaringBitmap::Container>::iterator RoaringBitmap::find(uint16_t key) {
+    return lower_bound(containers.begin(), containers.end(), key,
+                       [](const Container& c, uint16_t k) { return c.key < k; });
+}
+
+vector<RoaringBitmap::Container>::const_iterator RoaringBitmap::find(uint16_t key) const {
+    return lower_bound(containers.begin(), containers.end(), key,
+                       [](const Container& c, uint16_t k) { return c.key < k; });
+}
+
+void RoaringBitmap::add(uint32_t value) {
+    uint16_t key = static_cast<uint16_t>(value >> 16);
+    uint16_t low = static_cast<uint16_t>(value & 0xFFFF);
+
+    auto it = find(key);
+    if (it == containers.end() || it->key != key) {
+        it = containers.insert(it, Container());
+        it->key = key;
+    }
+
+    if (it->isBitmap()) {
+        uint64_t& word = it->bitmap[low / 64];
+        uint64_t bit = uint64_t(1) << (low % 64);
+        if (!(word & bit)) {
+            word |= bit;
+            ++it->cardinality;
+        }
+        return;
+    }
+
+    auto pos = lower_bound(it->array.begin(), it->array.end(), low);
+    if (pos != it->array.end() && *pos == low) return;
+    it->array.insert(pos, low);
+    if (++it->cardinality > kArrayLimit) it->toBitmap();
+}
+
+void RoaringBitmap::remove(uint32_t value) {
+    uint16_t key = static_cast<uint16_t>(value >> 16);
+    uint16_t low = static_cast<uint16_t>(value & 0xFFFF);
+
+    auto it = find(key);
+    if (it == containers.end() || it->key != key) return;
+
+    if (it->isBitmap()) {
+        uint64_t& word = it->bitmap[low / 64];
+        uint64_t bit = uint64_t(1) << (low % 64);
+        if (!(word & bit)) return;
+        word &= ~bit;
+        if (--it->cardinality <= kArrayLimit) it->toArray();
+    } else {
+        auto pos = lower_bound(it->array.begin(), it->array.end(), low);
+        if (pos == it->array.end() || *pos != low) return;
+        it->array.erase(pos);
+        --it->cardinality;
+    }
+
+    if (it->cardinality == 0) containers.erase(it);
+}
+
+bool RoaringBitmap::contains(uint32_t value) const {
+    uint16_t key = static_cast<uint16_t>(value >> 16);
+    auto it = find(key);
+    return it != containers.end() && it->key == key && it->contains(static_cast<uint16_t>(value & 0xFFFF));
+}
+
+uint64_t RoaringBitmap::cardinality() const {
+    uint64_t total = 0;
+    for (const Container& c : containers) total += c.cardinality;
+    return total;
+}
+
+size_t RoaringBitmap::bitmapContainers() const {
+    return static_cast<size_t>(count_if(containers.begin(), containers.end(),
+                                        [](const Container& c) { return c.isBitmap(); }));
+}
+
+uint64_t RoaringBitmap::andCardinality(const Container& a, const Container& b) {
+    uint64_t total = 0;
+    if (a.isBitmap() && b.isBitmap()) {
+        for (size_t w = 0; w < kBitmapWords; ++w) total += static_cast<uint64_t>(popcount64(a.bitmap[w] & b.bitmap[w]));
+    } else if (a.isBitmap() || b.isBitmap()) {
+        const Container& sparse = a.isBitmap() ? b : a;
+        const Container& dense = a.isBitmap() ? a : b;
+        for (uint16_t low : sparse.array) total += dense.contains(low);
+    } else {
+        size_t i = 0, j = 0;
+        while (i < a.array.size() && j < b.array.size()) {
+            if (a.array[i] < b.array[j]) ++i;
+            else if (a.array[i] > b.array[j]) ++j;
+            else { ++total; ++i; ++j; }
+        }
+    }
+    return total;
+}
+
+RoaringBitmap::Container RoaringBitmap::intersect(const Container& a, const Container& b) {
+    Container result;
+    result.key = a.key;
+    if (a.isBitmap() && b.isBitmap()) {
+        result.bitmap.resize(kBitmapWords);
+        for (size_t w = 0; w < kBitmapWords; ++w) {
+            result.bitmap[w] = a.bitmap[w] & b.bitmap[w];
+            result.cardinality += static_cast<uint32_t>(popcount64(result.bitmap[w]));
+        }
+        if (result.cardinality <= kArrayLimit) result.toArray();
+    } else if (a.isBitmap() || b.isBitmap()) {
+        const Container& sparse = a.isBitmap() ? b : a;
+        const Container& dense = a.isBitmap() ? a : b;
+        for (uint16_t low : sparse.array) {
+            if (dense.contains(low)) result.array.push_back(low);
+        }
+        result.cardinality = static_cast<uint32_t>(result.array.size());
+    } else {
+        set_intersection(a.array.begin(), a.array.end(), b.array.begin(), b.array.end(),
+                         back_inserter(result.array));
+        result.cardinality = static_cast<uint32_t>(result.array.size());
+    }
+    return result;
+}
+
+uint64_t RoaringBitmap::andCardinality(const RoaringBitmap& other) const {
+    uint64_t total = 0;
+    size_t i = 0, j = 0;
+    while (i < containers.size() && j < other.containers.size()) {
+        if (containers[i].key < other.containers[j].key) ++i;
+        else if (containers[i].key > other.containers[j].key) ++j;
+        else total += andCardinality(containers[i++], other.containers[j++]);
+    }
+    return total;
+}
+
+RoaringBitmap RoaringBitmap::intersect(const RoaringBitmap& other) const {
+    RoaringBitmap result;
+    size_t i = 0, j = 0;
+    while (i < containers.size() && j < other.containers.size()) {
+        if (containers[i].key < other.containers[j].key) ++i;
+        else if (containers[i].key > other.containers[j].key) ++j;
+        else {
+            Container c = intersect(containers[i++], other.containers[j++]);
+            if (c.cardinality) result.containers.push_back(move(c));
+        }
+    }
+    return result;
+}
+
+// ================================
+// Facet Index
+// ================================
+// One RoaringBitmap of book ids (Books rowids) per Genre value plus one
+// each for in-stock and out-of-stock books. Facet counts for a result set
+// are intersection cardinalities against these bitmaps.
+struct FacetCounts {
+    map<string, uint64_t> genres;
+    uint64_t available = 0;
+    uint64_t outOfStock = 0;
+};
+
+class FacetIndex {
+public:
+    void clear();
+    void addBook(uint32_t id, const string& genre, int availableCopies);
+    // Drops the id from every bitmap; for a book deleted or about to be
+    // re-added with a new genre.
+    void removeBook(uint32_t id);
+    void setAvailable(uint32_t id, bool available);
+    // Counts over the whole catalog, or over resultSet when given.
+    FacetCounts counts(const RoaringBitmap* resultSet = nullptr) const;
+
+private:
+    unordered_map<string, RoaringBitmap> byGenre;
+    RoaringBitmap available;
+    RoaringBitmap outOfStock;
+    mutable mutex lock;
+};
+
+void FacetIndex::clear() {
+    lock_guard<mutex> guard(lock);
+    byGenre.clear();
+    available = RoaringBitmap();
+    outOfStock = RoaringBitmap();
+}
+
+void FacetIndex::addBook(uint32_t id, const string& genre, int availableCopies) {
+    lock_guard<mutex> guard(lock);
+    byGenre[genre].add(id);
+    if (availableCopies > 0) {
+        available.add(id);
+    } else {
+        outOfStock.add(id);
+    }
+}
+
+void FacetIndex::removeBook(uint32_t id) {
+    lock_guard<mutex> guard(lock);
+    for (auto& entry : byGenre) entry.second.remove(id);
+    available.remove(id);
+    outOfStock.remove(id);
+}
+
+void FacetIndex::setAvailable(uint32_t id, bool isAvailable) {
+    lock_guard<mutex> guard(lock);
+    if (isAvailable) {
+        outOfStock.remove(id);
+        available.add(id);
+    } else {
+        available.remove(id);
+        outOfStock.add(id);
+    }
+}
+
+FacetCounts FacetIndex::counts(const RoaringBitmap* resultSet) const {
+    lock_guard<mutex> guard(lock);
+    FacetCounts result;
+    for (const auto& entry : byGenre) {
+        uint64_t n = resultSet ? entry.second.andCardinality(*resultSet) : entry.second.cardinality();
+        if (n) result.genres[entry.first] = n;
+    }
+    result.available = resultSet ? available.andCardinality(*resultSet) : available.cardinality();
+    result.outOfStock = resultSet ? outOfStock.andCardinality(*resultSet) : outOfStock.cardinality();
+    return result;
+}
+
+// ================================
+// Borrow Ranking (Top-K)
+// ================================
+// Keeps every book ordered by BorrowedCount, descending. Books with the
+// same count form a contiguous group, and groupStart records where each
+// group begins, so incrementing a count is a single swap with the head of
+// its group: O(1) per borrow, and the top k are simply the first k slots.
+class BorrowRanking {
+public:
+    void clear();
+    void add(const string& isbn, int count);
+    // Bulk form of add for loads: one merge pass instead of a group walk
+    // per book, which degrades to O(distinct counts) each when counts vary.
+    void addAll(vector<pair<string, int>> books);
+    // Drops the given books in one compaction pass; unknown ISBNs are
+    // ignored. A book whose count was rewritten is removed, then re-added.
+    void removeAll(const vector<string>& gone);
+    void increment(const string& isbn);
+    vector<pair<string, int>> top(size_t k) const;
+
+private:
+    void swapSlots(size_t a, size_t b);
+
+    vector<string> isbns;
+    vector<int> counts;
+    unordered_map<string, size_t> position;
+    unordered_map<int, size_t> groupStart;
+    mutable mutex lock;
+};
+
+void BorrowRanking::clear() {
+    lock_guard<mutex> guard(lock);
+    isbns.clear();
+    counts.clear();
+    position.clear();
+    groupStart.clear();
+}
+
+void BorrowRanking::swapSlots(size_t a, size_t b) {
+    if (a == b) return;
+    swap(isbns[a], isbns[b]);
+    swap(counts[a], counts[b]);
+    position[isbns[a]] = a;
+    position[isbns[b]] = b;
+}
+
+void BorrowRanking::add(const string& isbn, int count) {
+    lock_guard<mutex> guard(lock);
+    if (position.count(isbn)) return;
+
+    // Append at the bottom, then hop over whole groups with a lower count
+    // by swapping with each group's head until the order is restored.
+    size_t slot = isbns.size();
+    isbns.push_back(isbn);
+    counts.push_back(count);
+    position[isbn] = slot;
+
+    while (slot > 0 && counts[slot - 1] < count) {
+        int lower = counts[slot - 1];
+        size_t head = groupStart[lower];
+        swapSlots(slot, head);
+        // The lower group shifts down by one slot.
+        groupStart[lower] = head + 1;
+        slot = head;
+    }
+    if (slot == 0 || counts[slot - 1] != count) {
+        groupStart[count] = slot;
+    }
+}
+
+void BorrowRanking::addAll(vector<pair<string, int>> books) {
+    lock_guard<mutex> guard(lock);
+    position.reserve(isbns.size() + books.size());
+
+    // One hash probe per new book: keep a pointer to its position entry
+    // (references into unordered_map survive rehashing). As with add(),
+    // the first entry for an ISBN wins.
+    vector<size_t*> slots;
+    slots.reserve(books.size());
+    size_t kept = 0;
+    for (size_t k = 0; k < books.size(); ++k) {
+        auto inserted = position.emplace(books[k].first, 0);
+        if (inserted.second) {
+            slots.push_back(&inserted.first->second);
+            if (kept != k) books[kept] = move(books[k]);
+            ++kept;
+        }
+    }
+    books.resize(kept);
+
+    vector<uint32_t> order(books.size());
+    for (size_t j = 0; j < order.size(); ++j) order[j] = static_cast<uint32_t>(j);
+    stable_sort(order.begin(), order.end(), [&books](uint32_t a, uint32_t b) { return books[a].second > books[b].second; });
+
+    vector<string> mergedIsbns;
+    vector<int> mergedCounts;
+    mergedIsbns.reserve(isbns.size() + books.size());
+    mergedCounts.reserve(counts.size() + books.size());
+
+    // Existing entries go first within a count, matching add(); only the
+    // ones that shift need their position rewritten.
+    size_t i = 0;
+    size_t j = 0;
+    while (i < isbns.size() || j < order.size()) {
+        size_t slot = mergedIsbns.size();
+        if (j == order.size() || (i < isbns.size() && counts[i] >= books[order[j]].second)) {
+            if (slot != i) position[isbns[i]] = slot;
+            mergedIsbns.push_back(move(isbns[i]));
+            mergedCounts.push_back(counts[i]);
+            ++i;
+        } else {
+            *slots[order[j]] = slot;
+            mergedIsbns.push_back(move(books[order[j]].first));
+            mergedCounts.push_back(books[order[j]].second);
+            ++j;
+        }
+    }
+
+    isbns.swap(mergedIsbns);
+    counts.swap(mergedCounts);
+    groupStart.clear();
+    for (size_t slot = 0; slot < counts.size(); ++slot) {
+        if (slot == 0 || counts[slot - 1] != counts[slot]) {
+            groupStart[counts[slot]] = slot;
+        }
+    }
+}
+
+void BorrowRanking::removeAll(const vector<string>& gone) {
+    lock_guard<mutex> guard(lock);
+    vector<bool> drop(isbns.size(), false);
+    size_t dropped = 0;
+    for (const string& isbn : gone) {
+        auto it = position.find(isbn);
+        if (it == position.end() || drop[it->second]) continue;
+        drop[it->second] = true;
+        ++dropped;
+    }
+    if (!dropped) return;
+
+    // Survivors keep their relative order, so the ranking stays sorted.
+    size_t kept = 0;
+    for (size_t slot = 0; slot < isbns.size(); ++slot) {
+        if (drop[slot]) {
+            position.erase(isbns[slot]);
+            continue;
+        }
+        if (kept != slot) {
+            isbns[kept] = move(isbns[slot]);
+            counts[kept] = counts[slot];
+            position[isbns[kept]] = kept;
+        }
+        ++kept;
+    }
+    isbns.resize(kept);
+    counts.resize(kept);
+    groupStart.clear();
+    for (size_t slot = 0; slot < counts.size(); ++slot) {
+        if (slot == 0 || counts[slot - 1] != counts[slot]) {
+            groupStart[counts[slot]] = slot;
+        }
+    }
+}
+
+void BorrowRanking::increment(const string& isbn) {
+    lock_guard<mutex> guard(lock);
+    auto it = position.find(isbn);
+    if (it == position.end()) return;
+
+    int count = counts[it->second];
+    size_t head = groupStart[count];
+    swapSlots(it->second, head);
+
+    // The head slot leaves its group and joins (or starts) the next one.
+    if (head + 1 < counts.size() && counts[head + 1] == count) {
+        groupStart[count] = head + 1;
+    } else {
+        groupStart.erase(count);
+    }
+    counts[head] = count + 1;
+    if (!groupStart.count(count + 1)) {
+        groupStart[count + 1] = head;
+    }
+}
+
+vector<pair<string, int>> BorrowRanking::top(size_t k) const {
+    lock_guard<mutex> guard(lock);
+    vector<pair<string, int>> result;
+    size_t n = min(k, isbns.size());
+    result.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        result.emplace_back(isbns[i], counts[i]);
+    }
+    return result;
+}
+
+// ================================
+// Branch Inventory
+// ================================
+// Copies on the shelf at each branch as an ISBN x branch matrix of signed
+// 32-bit counters: one row per book some branch holds, one column per
+// branch, so "which branches have this in stock" is a hash probe and a scan
+// of a few counters. Loaded from BranchCopies and changed by deltas after
+// each committed borrow, return or transfer. Counters are plain sums, never
+// clamped, so deltas commute and commits that finish out of order still
+// leave the right counts; a counter can dip below zero between two such
+// deltas, and readers see that as no copies.
+class BranchInventory {
+public:
+    void clear();
+    // Adds each (branch, delta) to the book's counters under one lock, so a
+    // transfer is never seen half applied.
+    void apply(const string& isbn, const vector<pair<string, int>>& deltas);
+    // Zeroes every branch's count for a book that was deleted.
+    void erase(const string& isbn);
+    int copies(const string& isbn, const string& branch) const;
+    // Branches with at least one copy of the book, in the order first seen.
+    vector<pair<string, int>> inStock(const string& isbn) const;
+    size_t branchCount() const;
+
+private:
+    size_t column(const string& branch);
+
+    vector<string> names;
+    unordered_map<string, size_t> columns;
+    unordered_map<string, size_t> rows;
+    vector<int32_t> counters; // rows.size() x stride
+    size_t stride = 0;
+    mutable mutex lock;
+};
+
+void BranchInventory::clear() {
+    lock_guard<mutex> guard(lock);
+    names.clear();
+    columns.clear();
+    rows.clear();
+    counters.clear();
+    stride = 0;
+}
+
+// Index of a branch's column, adding it if new. The matrix is relaid out
+// with twice the stride when it runs out of columns.
+size_t BranchInventory::column(const string& branch) {
+    auto it = columns.find(branch);
+    if (it != columns.end()) return it->second;
+    if (names.size() == stride) {
+        size_t wider = max<size_t>(4, stride * 2);
+        vector<int32_t> relaid(rows.size() * wider, 0);
+        for (size_t row = 0; row < rows.size(); ++row) {
+            copy_n(counters.begin() + row * stride, stride, relaid.begin() + row * wider);
+        }
+        counters.swap(relaid);
+        stride = wider;
+    }
+    names.push_back(branch);
+    return columns[branch] = names.size() - 1;
+}
+
+void BranchInventory::apply(const string& isbn, const vector<pair<string, int>>& deltas) {
+    lock_guard<mutex> guard(lock);
+    for (const auto& delta : deltas) {
+        size_t col = column(delta.first);
+        auto row = rows.emplace(isbn, rows.size());
+        if (row.second) counters.resize(rows.size() * stride, 0);
+        counters[row.first->second * stride + col] += delta.second;
+    }
+}
+
+void BranchInventory::erase(const string& isbn) {
+    lock_guard<mutex> guard(lock);
+    auto row = rows.find(isbn);
+    if (row == rows.end()) return;
+    fill_n(counters.begin() + row->second * stride, stride, 0);
+}
+
+int BranchInventory::copies(const string& isbn, const string& branch) const {
+    lock_guard<mutex> guard(lock);
+    auto row = rows.find(isbn);
+    auto col = columns.find(branch);
+    if (row == rows.end() || col == columns.end()) return 0;
+    return max(0, counters[row->second * stride + col->second]);
+}
+
+vector<pair<string, int>> BranchInventory::inStock(const string& isbn) const {
+    lock_guard<mutex> guard(lock);
+    vector<pair<string, int>> result;
+    auto row = rows.find(isbn);
+    if (row == rows.end()) return result;
+    const int32_t* counts = counters.data() + row->second * stride;
+    for (size_t col = 0; col < names.size(); ++col) {
+        if (counts[col] > 0) result.emplace_back(names[col], counts[col]);
+    }
+    return result;
+}
+
+size_t BranchInventory::branchCount() const {
+    lock_guard<mutex> guard(lock);
+    return names.size();
+}
+
+// ================================
+// Borrowing Policy
+// ================================
+// Per-UserType limits on outstanding loans. Every known user's type and
+// current loan count sit in one hash map, loaded from Users and
+// Transactions at startup, so borrowBook checks the limit with a single
+// lookup instead of a COUNT over Transactions. A borrow reserves its slot
+// before writing and releases it if the write fails, so concurrent
+// borrows by one user cannot overshoot the limit.
+class BorrowPolicy {
+public:
+    static constexpr int kUnlimited = -1;
+
+    BorrowPolicy() { setLimits({{"student", 5}, {"staff", 20}}); }
+    // Limits by UserType, compared without regard to case. "*" covers
+    // types without an entry and users missing from Users; without it
+    // they are unlimited.
+    void setLimits(const map<string, int>& limits);
+    // Parses "student=5,staff=20,*=10".
+    static bool parseLimits(const string& text, map<string, int>& limits);
+    void clear();
+    void setUserType(const string& userID, const string& userType);
+    void addLoans(const string& userID, int count);
+    // Takes a loan slot if the user is under the limit; otherwise returns
+    // false with the limit that applies.
+    bool reserve(const string& userID, int& limit);
+    void release(const string& userID);
+    bool atLimit(const string& userID) const;
+    // Users with an entry: everyone in Users plus unknown borrowers with loans.
+    size_t trackedUsers() const;
+
+private:
+    struct UserState {
+        uint16_t type = 0; // index into limitByType; 0 is "*", for unknown users
+        int32_t loans = 0;
+    };
+    uint16_t typeIndex(const string& userType);
+    int limitOf(const UserState& state) const { return limitByType[state.type]; }
+
+    map<string, int> limits;
+    unordered_map<string, uint16_t> typeIds{{"*", 0}};
+    vector<int> limitByType{kUnlimited};
+    unordered_map<string, UserState> users;
+    mutable mutex lock;
+};
+
+static Gauge& outstandingLoans() {
+    static Gauge& gauge = metrics().gauge("library_loans_outstanding", "Books currently on loan, by the borrowing policy.");
+    return gauge;
+}
+
+void BorrowPolicy::setLimits(const map<string, int>& newLimits) {
+    lock_guard<mutex> guard(lock);
+    limits.clear();
+    for (const auto& entry : newLimits) {
+        string type = entry.first;
+        transform(type.begin(), type.end(), type.begin(), ::tolower);
+        limits[type] = entry.second;
+    }
+    auto fallback = limits.find("*");
+    for (const auto& entry : typeIds) {
+        auto limit = limits.find(entry.first);
+        limitByType[entry.second] = limit != limits.end() ? limit->second
+                                    : fallback != limits.end() ? fallback->second : kUnlimited;
+    }
+}
+
+bool BorrowPolicy::parseLimits(const string& text, map<string, int>& parsed) {
+    stringstream stream(text);
+    string item;
+    while (getline(stream, item, ',')) {
+        size_t eq = item.find('=');
+        if (eq == string::npos || eq == 0) return false;
+        try {
+            size_t used = 0;
+            int limit = stoi(item.substr(eq + 1), &used);
+            if (limit < 0 || used != item.size() - eq - 1) return false;
+            parsed[item.substr(0, eq)] = limit;
+        } catch (const logic_error&) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Caller holds lock. Every type gets its own slot, so setLimits can
+// change the limit of users already loaded.
+uint16_t BorrowPolicy::typeIndex(const string& userType) {
+    string type = userType;
+    transform(type.begin(), type.end(), type.begin(), ::tolower);
+    auto it = typeIds.find(type);
+    if (it != typeIds.end()) return it->second;
+    if (limitByType.size() > numeric_limits<uint16_t>::max()) return 0;
+    auto limit = limits.find(type);
+    auto fallback = limits.find("*");
+    limitByType.push_back(limit != limits.end() ? limit->second : fallback != limits.end() ? fallback->second : kUnlimited);
+    return typeIds[type] = static_cast<uint16_t>(limitByType.size() - 1);
+}
+
+void BorrowPolicy::clear() {
+    lock_guard<mutex> guard(lock);
+    users.clear();
+    outstandingLoans().set(0);
+}
+
+void BorrowPolicy::setUserType(const string& userID, const string& userType) {
+    lock_guard<mutex> guard(lock);
+    users[userID].type = typeIndex(userType);
+}
+
+void BorrowPolicy::addLoans(const string& userID, int count) {
+    lock_guard<mutex> guard(lock);
+    users[userID].loans += count;
+    outstandingLoans().add(count);
+}
+
+// Users missing from Users only get an entry while a "*" limit makes
+// their loans worth counting, and lose it once those loans are back, so
+// borrows under unknown IDs cannot grow the map without bound.
+bool BorrowPolicy::reserve(const string& userID, int& limit) {
+    lock_guard<mutex> guard(lock);
+    auto it = users.find(userID);
+    if (it == users.end()) {
+        limit = limitOf(UserState());
+        if (limit == 0) return false;
+        if (limit != kUnlimited) users.emplace(userID, UserState{0, 1});
+    } else {
+        UserState& state = it->second;
+        limit = limitOf(state);
+        if (limit != kUnlimited && state.loans >= limit) return false;
+        ++state.loans;
+    }
+    outstandingLoans().add(1);
+    return true;
+}
+
+void BorrowPolicy::release(const string& userID) {
+    lock_guard<mutex> guard(lock);
+    auto it = users.find(userID);
+    if (it == users.end()) {
+        // A loan reserve() did not track.
+        outstandingLoans().add(-1);
+        return;
+    }
+    if (it->second.loans == 0) return;
+    --it->second.loans;
+    outstandingLoans().add(-1);
+    if (it->second.type == 0 && it->second.loans == 0) users.erase(it);
+}
+
+bool BorrowPolicy::atLimit(const string& userID) const {
+    lock_guard<mutex> guard(lock);
+    auto it = users.find(userID);
+    UserState state = it == users.end() ? UserState() : it->second;
+    return limitOf(state) != kUnlimited && state.loans >= limitOf(state);
+}
+
+size_t BorrowPolicy::trackedUsers() const {
+    lock_guard<mutex> guard(lock);
+    return users.size();
+}
+
+// ================================
+// Read Pool (work stealing)
+// ================================
+// Runs read-only queries across a fixed set of workers, each owning a
+// read-only SQLite connection. Every worker has its own deque: it pops its
+// newest job from the back, and an idle worker steals the oldest job from
+// the front of someone else's deque, so load evens out without a shared
+// queue becoming the bottleneck.
+class WorkStealingPool {
+public:
+    using Job = function<void(sqlite3*)>;
+
+    struct WorkerStats {
+        uint64_t executed = 0;
+        uint64_t stolen = 0;
+        double utilization = 0.0; // fraction of wall time spent running jobs
+    };
+
+    WorkStealingPool(const string& databasePath, size_t workerCount);
+    ~WorkStealingPool();
+
+    void submit(Job job);
+    // Run job on a worker's connection and wait for it. Called from a
+    // worker it runs inline, so nested reads cannot deadlock the pool.
+    void run(const Job& job);
+    vector<WorkerStats> stats() const;
+
+private:
+    struct Worker {
+        mutex lock;
+        deque<Job> jobs;
+        sqlite3* conn = nullptr;
+        atomic<uint64_t> executed{0};
+        atomic<uint64_t> stolen{0};
+        atomic<uint64_t> busyNanos{0};
+        thread runner;
+    };
+
+    bool popLocal(Worker& worker, Job& job);
+    bool steal(size_t thief, Job& job);
+    void workerLoop(size_t index);
+
+    vector<unique_ptr<Worker>> workers;
+    atomic<size_t> nextQueue{0};
+    mutex idleLock;
+    condition_variable idle;
+    atomic<size_t> pending{0};
+    bool stopping = false;
+    chrono::steady_clock::time_point started;
+
+    static thread_local Worker* currentWorker;
+    static thread_local const WorkStealingPool* currentPool;
+};
+
+thread_local WorkStealingPool::Worker* WorkStealingPool::currentWorker = nullptr;
+thread_local const WorkStealingPool* WorkStealingPool::currentPool = nullptr;
+
+WorkStealingPool::WorkStealingPool(const string& databasePath, size_t workerCount)
+    : started(chrono::steady_clock::now()) {
+    workerCount = max<size_t>(1, workerCount);
+    for (size_t i = 0; i < workerCount; ++i) {
+        unique_ptr<Worker> worker(new Worker());
+        if (sqlite3_open_v2(databasePath.c_str(), &worker->conn, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX,
+                            nullptr) != SQLITE_OK) {
+            cerr << "Error opening read connection: " << sqlite3_errmsg(worker->conn) << endl;
+        }
+        sqlite3_busy_timeout(worker->conn, 5000);
+        queryProfiler().attach(worker->conn);
+        workers.push_back(move(worker));
+    }
+    for (size_t i = 0; i < workerCount; ++i) {
+        workers[i]->runner = thread(&WorkStealingPool::workerLoop, this, i);
+    }
+}
+
+// Finishes every queued job, then closes the worker connections.
+WorkStealingPool::~WorkStealingPool() {
+    {
+        lock_guard<mutex> guard(idleLock);
+        stopping = true;
+    }
+    idle.notify_all();
+    for (auto& worker : workers) {
+        worker->runner.join();
+        sqlite3_close(worker->conn);
+    }
+}
+
+void WorkStealingPool::submit(Job job) {
+    Worker* target = currentPool == this ? currentWorker : workers[nextQueue++ % workers.size()].get();
+    {
+        lock_guard<mutex> guard(target->lock);
+        target->jobs.push_back(move(job));
+    }
+    {
+        lock_guard<mutex> guard(idleLock);
+        ++pending;
+    }
+    idle.notify_one();
+}
+
+void WorkStealingPool::run(const Job& job) {
+    if (currentPool == this) {
+        job(currentWorker->conn);
+        return;
+    }
+    promise<void> done;
+    future<void> finished = done.get_future();
+    submit([&job, &done](sqlite3* conn) {
+        try {
+            job(conn);
+            done.set_value();
+        } catch (...) {
+            done.set_exception(current_exception());
+        }
+    });
+    finished.get();
+}
+
+bool WorkStealingPool::popLocal(Worker& worker, Job& job) {
+    lock_guard<mutex> guard(worker.lock);
+    if (worker.jobs.empty()) return false;
+    job = move(worker.jobs.back());
+    worker.jobs.pop_back();
+    return true;
+}
+
+bool WorkStealingPool::steal(size_t thief, Job& job) {
+    for (size_t offset = 1; offset < workers.size(); ++offset) {
+        Worker& victim = *workers[(thief + offset) % workers.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.jobs.empty()) {
+            job = move(victim.jobs.front());
+            victim.jobs.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
+
+void WorkStealingPool::workerLoop(size_t index) {
+    Worker& self = *workers[index];
+    currentWorker = &self;
+    currentPool = this;
+
+    for (;;) {
+        Job job;
+        bool stolen = false;
+        if (!popLocal(self, job)) {
+            stolen = steal(index, job);
+        }
+
+        if (job) {
+            --pending;
+            auto begin = chrono::steady_clock::now();
+            job(self.conn);
+            self.busyNanos += static_cast<uint64_t>(
+                chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - begin).count());
+            ++self.executed;
+            if (stolen) ++self.stolen;
+            continue;
+        }
+
+        unique_lock<mutex> guard(idleLock);
+        idle.wait(guard, [this] { return stopping || pending.load() > 0; });
+        if (stopping && pending.load() == 0) return;
+    }
+}
+
+vector<WorkStealingPool::WorkerStats> WorkStealingPool::stats() const {
+    double elapsed = static_cast<double>(
+        chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count());
+    vector<WorkerStats> result;
+    for (const auto& worker : workers) {
+        WorkerStats s;
+        s.executed = worker->executed.load();
+        s.stolen = worker->stolen.load();
+        s.utilization = elapsed > 0 ? static_cast<double>(worker->busyNanos.load()) / elapsed : 0.0;
+        result.push_back(s);
+    }
+    return result;
+}
+
+// ================================
+// Catalog File (binary snapshot)
+// ================================
+// A copy of the Books table laid out for mmap: a fixed header, one
+// fixed-width record per book, then a heap holding the string fields.
+// The header carries the CatalogMeta epoch and generation it was taken
+// at, so a reader can tell whether the database has moved on, and a
+// checksum over records and heap. Integers are in host byte order.
+static constexpr uint32_t kCatalogFileVersion = 1;
+static constexpr char kCatalogFileMagic[8] = {'L', 'I', 'B', 'C', 'A', 'T', '\0', '\0'};
+
+struct CatalogFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize; // sizeof(CatalogFileRecord) of the writer
+    int64_t epoch;
+    int64_t generation;
+    uint64_t recordCount;
+    uint64_t heapSize;
+    uint64_t checksum;
+};
+
+enum CatalogField { FieldIsbn, FieldTitle, FieldAuthor, FieldGenre, FieldCount };
+
+struct CatalogFileRecord {
+    int64_t id; // Books rowid
+    uint32_t offset[FieldCount]; // into the string heap
+    uint32_t length[FieldCount];
+    int32_t availableCopies;
+    int32_t borrowedCount;
+};
+
+static_assert(sizeof(CatalogFileHeader) == 56, "catalog file header layout");
+static_assert(sizeof(CatalogFileRecord) == 48, "catalog file record layout");
+
+// 64-bit multiply-xorshift over 8-byte words; seed chains regions.
+static uint64_t checksum64(const char* data, size_t size, uint64_t seed = 0) {
+    uint64_t hash = seed ^ 0x9e3779b97f4a7c15ull ^ size;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof word);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdull;
+        hash ^= hash >> 32;
+    }
+    for (; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ull;
+    }
+    return hash ^ (hash >> 29);
+}
+
+class CatalogFileWriter {
+public:
+    bool add(const Book& book);
+    // Writes to path.tmp and renames over path, so readers never see a
+    // partial file.
+    bool finish(const string& path, int64_t epoch, int64_t generation);
+
+private:
+    vector<CatalogFileRecord> records;
+    string heap;
+};
+
+bool CatalogFileWriter::add(const Book& book) {
+    const string* fields[FieldCount] = {&book.isbn, &book.title, &book.author, &book.genre};
+    CatalogFileRecord record = {};
+    record.id = book.id;
+    for (int f = 0; f < FieldCount; ++f) {
+        if (heap.size() + fields[f]->size() > numeric_limits<uint32_t>::max()) {
+            cerr << "Error: catalog string heap exceeds 4 GiB" << endl;
+            return false;
+        }
+        record.offset[f] = static_cast<uint32_t>(heap.size());
+        record.length[f] = static_cast<uint32_t>(fields[f]->size());
+        heap += *fields[f];
+    }
+    record.availableCopies = book.availableCopies;
+    record.borrowedCount = book.borrowedCount;
+    records.push_back(record);
+    return true;
+}
+
+bool CatalogFileWriter::finish(const string& path, int64_t epoch, int64_t generation) {
+    CatalogFileHeader header = {};
+    memcpy(header.magic, kCatalogFileMagic, sizeof header.magic);
+    header.version = kCatalogFileVersion;
+    header.recordSize = sizeof(CatalogFileRecord);
+    header.epoch = epoch;
+    header.generation = generation;
+    header.recordCount = records.size();
+    header.heapSize = heap.size();
+    const char* recordBytes = reinterpret_cast<const char*>(records.data());
+    size_t recordLength = records.size() * sizeof(CatalogFileRecord);
+    header.checksum = checksum64(heap.data(), heap.size(), checksum64(recordBytes, recordLength));
+
+    const string tempPath = path + ".tmp";
+    ofstream out(tempPath, ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof header);
+    out.write(recordBytes, static_cast<streamsize>(recordLength));
+    out.write(heap.data(), static_cast<streamsize>(heap.size()));
+    out.close();
+    if (!out || rename(tempPath.c_str(), path.c_str()) != 0) {
+        cerr << "Error writing catalog file " << path << endl;
+        remove(tempPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Read-only view of a catalog file, mmapped where available.
+class CatalogFile {
+public:
+    CatalogFile() = default;
+    ~CatalogFile();
+    CatalogFile(const CatalogFile&) = delete;
+    CatalogFile& operator=(const CatalogFile&) = delete;
+
+    // Maps path and checks magic, version, layout, bounds and checksum.
+    // A missing file fails quietly; a damaged one is reported.
+    bool open(const string& path);
+    // Reads and checks only the header, without mapping the body.
+    static bool readHeader(const string& path, CatalogFileHeader& header);
+
+    const CatalogFileHeader& header() const { return *reinterpret_cast<const CatalogFileHeader*>(data); }
+    size_t size() const { return static_cast<size_t>(header().recordCount); }
+    const CatalogFileRecord& record(size_t i) const { return records[i]; }
+    string_view field(const CatalogFileRecord& record, CatalogField f) const {
+        return string_view(heap + record.offset[f], record.length[f]);
+    }
+    Book book(size_t i) const;
+
+private:
+    void close();
+
+    const char* data = nullptr;
+    size_t length = 0;
+    bool mapped = false;
+    vector<char> buffer; // used when mmap is unavailable
+    const CatalogFileRecord* records = nullptr;
+    const char* heap = nullptr;
+};
+
+CatalogFile::~CatalogFile() {
+    close();
+}
+
+void CatalogFile::close() {
+#ifdef LIBRARY_HAVE_MMAP
+    if (mapped) {
+        munmap(const_cast<char*>(data), length);
+    }
+#endif
+    data = nullptr;
+    length = 0;
+    mapped = false;
+    buffer.clear();
+    records = nullptr;
+    heap = nullptr;
+}
+
+static bool validCatalogHeader(const CatalogFileHeader& header) {
+    return memcmp(header.magic, kCatalogFileMagic, sizeof header.magic) == 0 &&
+           header.version == kCatalogFileVersion && header.recordSize == sizeof(CatalogFileRecord);
+}
+
+bool CatalogFile::readHeader(const string& path, CatalogFileHeader& header) {
+    ifstream in(path, ios::binary);
+    return in.read(reinterpret_cast<char*>(&header), sizeof header) && validCatalogHeader(header);
+}
+
+bool CatalogFile::open(const string& path) {
+    close();
+#ifdef LIBRARY_HAVE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        length = static_cast<size_t>(info.st_size);
+        void* region = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (region != MAP_FAILED) {
+            data = static_cast<const char*>(region);
+            mapped = true;
+        }
+    }
+    ::close(fd);
+#else
+    ifstream in(path, ios::binary);
+    if (!in.is_open()) {
+        return false;
+    }
+    buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    data = buffer.data();
+    length = buffer.size();
+#endif
+
+    if (!data || length < sizeof(CatalogFileHeader) || !validCatalogHeader(header())) {
+        cerr << "Error: " << path << " is not a version " << kCatalogFileVersion << " catalog file" << endl;
+        close();
+        return false;
+    }
+    const CatalogFileHeader& h = header();
+    size_t body = length - sizeof(CatalogFileHeader);
+    if (h.recordCount > body / sizeof(CatalogFileRecord) ||
+        h.heapSize != body - h.recordCount * sizeof(CatalogFileRecord)) {
+        cerr << "Error: " << path << " is truncated" << endl;
+        close();
+        return false;
+    }
+    const char* recordBytes = data + sizeof(CatalogFileHeader);
+    size_t recordLength = static_cast<size_t>(h.recordCount) * sizeof(CatalogFileRecord);
+    records = reinterpret_cast<const CatalogFileRecord*>(recordBytes);
+    heap = recordBytes + recordLength;
+    if (checksum64(heap, h.heapSize, checksum64(recordBytes, recordLength)) != h.checksum) {
+        cerr << "Error: " << path << " failed its checksum" << endl;
+        close();
+        return false;
+    }
+    for (size_t i = 0; i < size(); ++i) {
+        for (int f = 0; f < FieldCount; ++f) {
+            if (static_cast<uint64_t>(records[i].offset[f]) + records[i].length[f] > h.heapSize) {
+                cerr << "Error: " << path << " has a record outside its string heap" << endl;
+                close();
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+Book CatalogFile::book(size_t i) const {
+    const CatalogFileRecord& r = records[i];
+    Book book;
+    book.id = r.id;
+    book.isbn = string(field(r, FieldIsbn));
+    book.title = string(field(r, FieldTitle));
+    book.author = string(field(r, FieldAuthor));
+    book.genre = string(field(r, FieldGenre));
+    book.availableCopies = r.availableCopies;
+    book.borrowedCount = r.borrowedCount;
+    return book;
+}
+
+// ================================
+// CSV Reader
+// ================================
+// Streaming RFC 4180 reader. Fields may be quoted; quoted fields can hold
+// commas, newlines and doubled quotes (""). Unquoted fields are trimmed
+// of spaces, tabs and CR at their edges only, never inside. Input is read
+// in large blocks and each record is parsed straight out of the block, so
+// the common unquoted case is a single forward scan per field.
+class CsvReader {
+public:
+    explicit CsvReader(istream& in, size_t blockSize = 1 << 20) : in(in), blockSize(blockSize) {}
+
+    // Read the next record into fields, reusing its strings. Returns false
+    // at end of input. A blank line yields one empty field.
+    bool next(vector<string>& fields);
+    // 1-based line on which the last record returned by next() started.
+    size_t line() const { return recordLine; }
+
+private:
+    bool parseRecord(vector<string>& fields);
+    void refill();
+
+    istream& in;
+    size_t blockSize;
+    string buffer;
+    size_t pos = 0;
+    bool eof = false;
+    size_t nextLine = 1;
+    size_t recordLine = 0;
+};
+
+void CsvReader::refill() {
+    buffer.erase(0, pos);
+    pos = 0;
+    size_t kept = buffer.size();
+    buffer.resize(kept + blockSize);
+    in.read(&buffer[kept], static_cast<streamsize>(blockSize));
+    size_t got = static_cast<size_t>(in.gcount());
+    buffer.resize(kept + got);
+    if (got == 0 || !in) eof = true;
+}
+
+bool CsvReader::next(vector<string>& fields) {
+    for (;;) {
+        if (pos >= buffer.size() && eof) return false;
+        if (pos < buffer.size() && parseRecord(fields)) {
+            // Strip a UTF-8 byte order mark from the first field of the file.
+            if (recordLine == 1 && !fields.empty() && fields[0].compare(0, 3, "\xEF\xBB\xBF") == 0) {
+                fields[0].erase(0, 3);
+            }
+            return true;
+        }
+        refill();
+    }
+}
+
+// Parse one record starting at pos. Returns false, leaving pos unchanged,
+// when the block ends before the record does and more input may follow.
+bool CsvReader::parseRecord(vector<string>& fields) {
+    const char* data = buffer.data();
+    const size_t size = buffer.size();
+    size_t p = pos;
+    size_t count = 0;
+    size_t newlines = 0;
+
+    for (;;) {
+        if (count == fields.size()) fields.emplace_back();
+        string& field = fields[count++];
+
+        while (p < size && (data[p] == ' ' || data[p] == '\t')) ++p;
+
+        if (p < size && data[p] == '"') {
+            field.clear();
+            ++p;
+            for (;;) {
+                const char* quote = static_cast<const char*>(memchr(data + p, '"', size - p));
+                size_t end = quote ? static_cast<size_t>(quote - data) : size;
+                newlines += static_cast<size_t>(std::count(data + p, data + end, '\n'));
+                field.append(data + p, end - p);
+                if (!quote) {
+                    if (!eof) return false;
+                    p = size; // unterminated quote: keep what we have
+                    break;
+                }
+                if (end + 1 >= size && !eof) return false; // "" may straddle the block
+                if (end + 1 < size && data[end + 1] == '"') {
+                    field += '"';
+                    p = end + 2;
+                    continue;
+                }
+                p = end + 1;
+                break;
+            }
+            // Tolerate stray text between the closing quote and the delimiter.
+            while (p < size && data[p] != ',' && data[p] != '\n') {
+                if (data[p] != ' ' && data[p] != '\t' && data[p] != '\r') field += data[p];
+                ++p;
+            }
+        } else {
+            size_t start = p;
+            while (p < size && data[p] != ',' && data[p] != '\n') ++p;
+            size_t end = p;
+            while (end > start && (data[end - 1] == ' ' || data[end - 1] == '\t' || data[end - 1] == '\r')) --end;
+            field.assign(data + start, end - start);
+        }
+
+        if (p >= size && !eof) return false;
+        if (p < size && data[p] == ',') {
+            ++p;
+            continue;
+        }
+        if (p < size) {
+            ++p; // newline
+            ++newlines;
+        }
+        fields.resize(count);
+        pos = p;
+        recordLine = nextLine;
+        nextLine += newlines;
+        return true;
+    }
+}
+
+// Positions of the Books columns in a CSV header, matched by name without
+// regard to case or surrounding spaces; -1 when the column is absent.
+struct BookCsvColumns {
+    int isbn = -1;
+    int title = -1;
+    int author = -1;
+    int genre = -1;
+    int availableCopies = -1;
+    int borrowedCount = -1; // optional
+    size_t width = 0;
+
+    // Returns false and names the missing columns if any required one is absent.
+    bool map(const vector<string>& header, string& missing);
+};
+
+bool BookCsvColumns::map(const vector<string>& header, string& missing) {
+    width = header.size();
+    for (size_t i = 0; i < header.size(); ++i) {
+        string name = header[i];
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        int index = static_cast<int>(i);
+        if (name == "isbn") isbn = index;
+        else if (name == "title") title = index;
+        else if (name == "author") author = index;
+        else if (name == "genre") genre = index;
+        else if (name == "availablecopies" || name == "copies") availableCopies = index;
+        else if (name == "borrowedcount" || name == "timesborrowed") borrowedCount = index;
+    }
+
+    missing.clear();
+    const pair<const char*, int> required[] = {
+        {"ISBN", isbn}, {"Title", title}, {"Author", author}, {"Genre", genre}, {"AvailableCopies", availableCopies}};
+    for (const auto& column : required) {
+        if (column.second < 0) missing += (missing.empty() ? "" : ", ") + string(column.first);
+    }
+    return missing.empty();
+}
+
+// Positions of the Users columns in a CSV header, matched like
+// BookCsvColumns.
+struct UserCsvColumns {
+    int userID = -1;
+    int name = -1;
+    int userType = -1;
+    size_t width = 0;
+
+    bool map(const vector<string>& header, string& missing);
+};
+
+bool UserCsvColumns::map(const vector<string>& header, string& missing) {
+    width = header.size();
+    for (size_t i = 0; i < header.size(); ++i) {
+        string column = header[i];
+        transform(column.begin(), column.end(), column.begin(), ::tolower);
+        int index = static_cast<int>(i);
+        if (column == "userid" || column == "id") userID = index;
+        else if (column == "name") name = index;
+        else if (column == "usertype" || column == "type") userType = index;
+    }
+
+    missing.clear();
+    const pair<const char*, int> required[] = {{"UserID", userID}, {"Name", name}, {"UserType", userType}};
+    for (const auto& column : required) {
+        if (column.second < 0) missing += (missing.empty() ? "" : ", ") + string(column.first);
+    }
+    return missing.empty();
+}
+
+struct CsvImportOptions {
+    // Parse and validate every row but leave the database untouched.
+    bool validateOnly = false;
+    // Compare each row's content hash with the stored one: skip unchanged
+    // rows and update changed ones instead of leaving existing ISBNs alone.
+    bool incremental = false;
+    // With incremental, delete books whose ISBN is absent from the file and
+    // record them in BookTombstones. Not done if any row failed.
+    bool tombstoneMissing = false;
+};
+
+// What a user import does with a row whose UserID is already in Users.
+enum class DuplicateUserPolicy {
+    Skip,   // keep the stored user
+    Update, // overwrite its Name and UserType
+    Fail,   // reject the row as an error
+};
+
+struct UserImportOptions {
+    bool validateOnly = false;
+    DuplicateUserPolicy onDuplicate = DuplicateUserPolicy::Skip;
+};
+
+struct CsvImportReport {
+    size_t rows = 0;       // data rows read, excluding the header and blank lines
+    size_t imported = 0;   // rows inserted and committed
+    size_t skipped = 0;    // valid rows whose ISBN was already in the catalog
+    size_t updated = 0;    // incremental: existing rows whose content changed
+    size_t unchanged = 0;  // incremental: existing rows with a matching hash
+    size_t tombstoned = 0; // incremental: books removed as missing from the file
+    size_t onLoan = 0;     // incremental: missing books kept because copies are still on loan
+    size_t errors = 0;
+};
+
+// FNV-1a over the normalized catalog fields of a feed row. Counts are
+// hashed as parsed integers so "05" and "5" compare equal. Stored in
+// Books.ContentHash as a signed 64-bit value.
+static int64_t bookContentHash(const string& title, const string& author, const string& genre, int copies, int borrowed) {
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](const char* data, size_t size) {
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= static_cast<unsigned char>(data[i]);
+            hash *= 1099511628211ull;
+        }
+        hash ^= 0x1f; // field separator
+        hash *= 1099511628211ull;
+    };
+    mix(title.data(), title.size());
+    mix(author.data(), author.size());
+    mix(genre.data(), genre.size());
+    mix(reinterpret_cast<const char*>(&copies), sizeof copies);
+    mix(reinterpret_cast<const char*>(&borrowed), sizeof borrowed);
+    return static_cast<int64_t>(hash);
+}
+
+// ================================
+// Replication (session changesets)
+// ================================
+// Keeps a read replica for reports in step with the primary through a
+// directory of files. The shipper runs in the serving process: it copies
+// the database to dir/base.db and opens an SQLite session on the main
+// connection. Every interval it cuts the session's changeset into
+// dir/<epoch>-<sequence>.changeset and starts a fresh session. Cuts hold
+// the library's write lock, so a changeset never carries half a
+// transaction. A session only sees this connection's writes. When PRAGMA
+// data_version shows another process has committed, the shipper reseeds
+// base.db under a new epoch. The replicate command applies the files in
+// sequence order to its own copy of base.db, records the last applied
+// sequence in the same transaction, and copies base.db again when the
+// epoch changes. After every cut, shipped or empty, the shipper rewrites
+// dir/heartbeat with the time it last had everything shipped, so the
+// replica can tell an idle primary from a stalled one.
+#ifdef LIBRARY_HAVE_SESSION
+static constexpr char kChangesetFileMagic[8] = {'L', 'I', 'B', 'C', 'S', 'E', 'T', '\0'};
+
+struct ChangesetFileHeader {
+    char magic[8];
+    int64_t epoch;
+    uint64_t sequence;
+    int64_t capturedMs; // system clock when the changeset was cut
+    uint64_t size;
+    uint64_t checksum;
+};
+
+static_assert(sizeof(ChangesetFileHeader) == 48, "changeset file header layout");
+
+static string heartbeatPath(const string& dir) {
+    return dir + "/heartbeat";
+}
+
+static string changesetPath(const string& dir, int64_t epoch, uint64_t sequence) {
+    char name[64];
+    snprintf(name, sizeof(name), "/%016llx-%012llu.changeset", static_cast<unsigned long long>(epoch),
+             static_cast<unsigned long long>(sequence));
+    return dir + name;
+}
+
+static int64_t wallClockMs() {
+    return chrono::duration_cast<chrono::milliseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Epoch and last applied sequence of a base or replica database.
+static bool readReplicaState(sqlite3* conn, int64_t& epoch, uint64_t& sequence) {
+    sqlite3_stmt* stmt = nullptr;
+    bool found = false;
+    if (sqlite3_prepare_v2(conn, "SELECT Epoch, Sequence FROM ReplicaState WHERE Id = 0;", -1, &stmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            epoch = sqlite3_column_int64(stmt, 0);
+            sequence = static_cast<uint64_t>(sqlite3_column_int64(stmt, 1));
+            found = true;
+        }
+        sqlite3_finalize(stmt);
+    }
+    return found;
+}
+
+class ChangesetShipper {
+public:
+    // writers must be held by every write transaction on conn; cuts take
+    // it so they always fall between transactions.
+    ChangesetShipper(sqlite3* conn, mutex& writers, const string& dir, int intervalMs);
+    // Ships what is left and closes the session.
+    ~ChangesetShipper();
+    bool start();
+
+private:
+    bool seed();
+    bool cut();
+    void run();
+    void writeHeartbeat();
+
+    sqlite3* conn;
+    mutex& writers;
+    string dir;
+    int intervalMs;
+    sqlite3_session* session = nullptr;
+    int64_t epoch = 0;
+    uint64_t sequence = 0;
+    int64_t dataVersion = 0;
+    mutex lock;
+    condition_variable wake;
+    bool stopping = false;
+    thread worker;
+};
+
+static int64_t readDataVersion(sqlite3* conn) {
+    sqlite3_stmt* stmt = nullptr;
+    int64_t version = -1;
+    if (sqlite3_prepare_v2(conn, "PRAGMA data_version;", -1, &stmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) version = sqlite3_column_int64(stmt, 0);
+        sqlite3_finalize(stmt);
+    }
+    return version;
+}
+
+// Replaces the session with an empty one attached to every table.
+static int restartSession(sqlite3* conn, sqlite3_session*& session) {
+    if (session) sqlite3session_delete(session);
+    session = nullptr;
+    int rc = sqlite3session_create(conn, "main", &session);
+    return rc == SQLITE_OK ? sqlite3session_attach(session, nullptr) : rc;
+}
+
+ChangesetShipper::ChangesetShipper(sqlite3* conn, mutex& writers, const string& dir, int intervalMs)
+    : conn(conn), writers(writers), dir(dir), intervalMs(intervalMs) {}
+
+ChangesetShipper::~ChangesetShipper() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    if (worker.joinable()) {
+        worker.join();
+        cut();
+    }
+    if (session) sqlite3session_delete(session);
+}
+
+bool ChangesetShipper::start() {
+    error_code error;
+    filesystem::create_directories(dir, error);
+    // The session needs the connection's pre-update hook.
+    changeFeed().attach(conn, false);
+    if (!seed()) {
+        return false;
+    }
+    worker = thread(&ChangesetShipper::run, this);
+    cout << "Shipping changesets to " << dir << " every " << intervalMs << " ms\n";
+    return true;
+}
+
+// Copies the database to base.db under a new epoch and restarts the
+// session from that point. Writers wait only for the last slice.
+bool ChangesetShipper::seed() {
+    static Counter& seeds = metrics().counter("library_replication_seeds_total", "Replica base copies written.");
+    static OperationMetrics instruments("replicationSeed");
+    OperationScope scope(instruments);
+
+    const string basePath = dir + "/base.db";
+    const string tempPath = basePath + ".tmp";
+    remove(tempPath.c_str());
+    sqlite3* target = nullptr;
+    if (sqlite3_open(tempPath.c_str(), &target) != SQLITE_OK) {
+        cerr << "Error opening " << tempPath << ": " << sqlite3_errmsg(target) << endl;
+        sqlite3_close(target);
+        return false;
+    }
+
+    const int pagesPerStep = 256;
+    sqlite3_backup* backup = nullptr;
+    auto begin = [&] {
+        if (backup) sqlite3_backup_finish(backup);
+        backup = sqlite3_backup_init(target, "main", conn, "main");
+        // A zero-page step only sizes the copy.
+        return backup ? sqlite3_backup_step(backup, 0) : sqlite3_errcode(target);
+    };
+
+    int rc = SQLITE_OK;
+    {
+        // What the old session held is superseded by the new base.
+        lock_guard<mutex> guard(writers);
+        rc = restartSession(conn, session);
+    }
+    // All but the last slice is copied without the lock. The backup restarts
+    // by itself when another connection writes, and writes on conn are
+    // carried into the copy as they happen.
+    if (rc == SQLITE_OK) rc = begin();
+    while (rc == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+        if (rc != SQLITE_OK) {
+            this_thread::sleep_for(chrono::milliseconds(5));
+        } else if (sqlite3_backup_remaining(backup) <= pagesPerStep) {
+            break;
+        }
+        rc = sqlite3_backup_step(backup, pagesPerStep);
+        // Only a database that shrank under the copy finishes here; a write
+        // after it would be missed, so start over.
+        if (rc == SQLITE_DONE) rc = begin();
+    }
+    if (rc == SQLITE_OK) {
+        // The last slice and the session restart happen with writers held,
+        // so the base and the first changeset meet exactly.
+        lock_guard<mutex> guard(writers);
+        sqlite3_backup_step(backup, -1);
+        rc = sqlite3_backup_finish(backup);
+        backup = nullptr;
+        if (rc == SQLITE_OK) {
+            rc = restartSession(conn, session);
+            dataVersion = readDataVersion(conn);
+        }
+    }
+    if (backup) sqlite3_backup_finish(backup);
+
+    random_device entropy;
+    epoch = static_cast<int64_t>(entropy() & 0x7fffffff) << 32 | entropy();
+    sequence = 0;
+    if (rc != SQLITE_OK) {
+        cerr << "Error copying the database to " << tempPath << endl;
+    } else {
+        string state = "PRAGMA journal_mode=DELETE;";
+        // Changesets already carry what the primary's triggers did; the
+        // same triggers firing again on the replica would conflict.
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(target, "SELECT name FROM sqlite_master WHERE type = 'trigger';", -1, &stmt, nullptr) == SQLITE_OK) {
+            while (sqlite3_step(stmt) == SQLITE_ROW) {
+                state += "DROP TRIGGER \"" + string(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0))) + "\";";
+            }
+            sqlite3_finalize(stmt);
+        }
+        state += "CREATE TABLE ReplicaState (Id INTEGER PRIMARY KEY CHECK (Id = 0), Epoch INTEGER, Sequence INTEGER);"
+                 "INSERT INTO ReplicaState VALUES (0, " + to_string(epoch) + ", 0);";
+        rc = sqlite3_exec(target, state.c_str(), nullptr, nullptr, nullptr);
+        if (rc != SQLITE_OK) cerr << "Error seeding replica base: " << sqlite3_errmsg(target) << endl;
+    }
+    sqlite3_close(target);
+    if (rc != SQLITE_OK || rename(tempPath.c_str(), basePath.c_str()) != 0) {
+        remove(tempPath.c_str());
+        return false;
+    }
+
+    // Files from earlier epochs can no longer be applied.
+    error_code error;
+    for (const auto& entry : filesystem::directory_iterator(dir, error)) {
+        if (entry.path().extension() == ".changeset") filesystem::remove(entry.path(), error);
+    }
+    writeHeartbeat();
+    seeds.inc();
+    scope.markOk();
+    return true;
+}
+
+// A header with no body, naming the last shipped sequence and when the
+// shipper last had nothing left to ship.
+void ChangesetShipper::writeHeartbeat() {
+    ChangesetFileHeader header = {};
+    memcpy(header.magic, kChangesetFileMagic, sizeof header.magic);
+    header.epoch = epoch;
+    header.sequence = sequence;
+    header.capturedMs = wallClockMs();
+    header.checksum = checksum64(nullptr, 0);
+    const string path = heartbeatPath(dir);
+    const string tempPath = path + ".tmp";
+    ofstream out(tempPath, ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof header);
+    out.close();
+    if (!out || rename(tempPath.c_str(), path.c_str()) != 0) {
+        remove(tempPath.c_str());
+    }
+}
+
+bool ChangesetShipper::cut() {
+    static Counter& shipped = metrics().counter("library_replication_changesets_total", "Changesets shipped to replicas.");
+    static Counter& shippedBytes = metrics().counter("library_replication_bytes_total", "Changeset bytes shipped to replicas.");
+    static Histogram& cutDuration =
+        metrics().histogram("library_replication_cut_duration_seconds", "Time writers wait per changeset cut.");
+    static Gauge& lastSequence = metrics().gauge("library_replication_sequence", "Sequence of the last shipped changeset.");
+
+    int size = 0;
+    void* changeset = nullptr;
+    int rc = SQLITE_OK;
+    {
+        lock_guard<mutex> guard(writers);
+        auto cutStart = chrono::steady_clock::now();
+        if (readDataVersion(conn) != dataVersion) {
+            rc = SQLITE_SCHEMA;
+        } else if (!sqlite3session_isempty(session)) {
+            rc = sqlite3session_changeset(session, &size, &changeset);
+            if (rc == SQLITE_OK) rc = restartSession(conn, session);
+        }
+        cutDuration.observe(static_cast<uint64_t>(
+            chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - cutStart).count()));
+    }
+    if (rc == SQLITE_SCHEMA) {
+        cout << "Database changed outside this process; reseeding the replica base.\n";
+        return seed();
+    }
+    if (rc != SQLITE_OK) {
+        cerr << "Error cutting changeset: " << sqlite3_errstr(rc) << "; reseeding the replica base." << endl;
+        sqlite3_free(changeset);
+        return seed();
+    }
+    if (!changeset) {
+        writeHeartbeat();
+        return true;
+    }
+
+    ChangesetFileHeader header = {};
+    memcpy(header.magic, kChangesetFileMagic, sizeof header.magic);
+    header.epoch = epoch;
+    header.sequence = sequence + 1;
+    header.capturedMs = wallClockMs();
+    header.size = static_cast<uint64_t>(size);
+    header.checksum = checksum64(static_cast<const char*>(changeset), header.size);
+
+    const string path = changesetPath(dir, epoch, header.sequence);
+    const string tempPath = path + ".tmp";
+    ofstream out(tempPath, ios::binary | ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof header);
+    out.write(static_cast<const char*>(changeset), size);
+    out.close();
+    sqlite3_free(changeset);
+    if (!out || rename(tempPath.c_str(), path.c_str()) != 0) {
+        // The session has been restarted, so the replica can only catch
+        // up from a new base.
+        cerr << "Error writing changeset " << path << "; reseeding the replica base." << endl;
+        remove(tempPath.c_str());
+        return seed();
+    }
+    sequence = header.sequence;
+    shipped.inc();
+    shippedBytes.inc(header.size);
+    lastSequence.set(static_cast<int64_t>(sequence));
+    writeHeartbeat();
+    return true;
+}
+
+void ChangesetShipper::run() {
+    unique_lock<mutex> guard(lock);
+    while (!stopping) {
+        wake.wait_for(guard, chrono::milliseconds(intervalMs));
+        if (stopping) break;
+        guard.unlock();
+        cut();
+        guard.lock();
+    }
+}
+
+static int onReplicaConflict(void* context, int conflict, sqlite3_changeset_iter*) {
+    ++*static_cast<uint64_t*>(context);
+    // The replica should match the primary row for row; take the
+    // primary's version of anything that has drifted.
+    return conflict == SQLITE_CHANGESET_DATA || conflict == SQLITE_CHANGESET_CONFLICT ? SQLITE_CHANGESET_REPLACE
+                                                                                        : SQLITE_CHANGESET_OMIT;
+}
+
+// Copies dir/base.db over the replica, in place so open readers see the
+// switch atomically.
+static bool seedReplica(sqlite3* replica, const string& dir) {
+    sqlite3* base = nullptr;
+    int rc = sqlite3_open_v2((dir + "/base.db").c_str(), &base, SQLITE_OPEN_READONLY, nullptr);
+    if (rc == SQLITE_OK) {
+        if (sqlite3_backup* backup = sqlite3_backup_init(replica, "main", base, "main")) {
+            while ((rc = sqlite3_backup_step(backup, 1024)) == SQLITE_OK || rc == SQLITE_BUSY || rc == SQLITE_LOCKED) {
+                if (rc != SQLITE_OK) this_thread::sleep_for(chrono::milliseconds(5));
+            }
+            rc = sqlite3_backup_finish(backup);
+        } else {
+            rc = sqlite3_errcode(replica);
+        }
+    }
+    if (rc != SQLITE_OK) {
+        cerr << "Error copying " << dir << "/base.db: " << sqlite3_errstr(rc) << endl;
+    }
+    sqlite3_close(base);
+    return rc == SQLITE_OK;
+}
+
+static bool readChangesetHeader(const string& path, ChangesetFileHeader& header) {
+    ifstream in(path, ios::binary);
+    return in.read(reinterpret_cast<char*>(&header), sizeof header) &&
+           memcmp(header.magic, kChangesetFileMagic, sizeof header.magic) == 0;
+}
+
+// Capture time of the oldest change the replica does not have yet: the
+// next changeset's, if it is waiting; otherwise the shipper's heartbeat
+// when it has shipped nothing newer, or else the last applied changeset's.
+// Lag measured from here keeps growing while the primary or shipper is
+// stalled. 0 when not known.
+static int64_t unappliedSinceMs(const string& dir, int64_t epoch, uint64_t sequence, int64_t appliedCapturedMs) {
+    ChangesetFileHeader header = {};
+    if (readChangesetHeader(changesetPath(dir, epoch, sequence + 1), header) && header.epoch == epoch) {
+        return header.capturedMs;
+    }
+    if (readChangesetHeader(heartbeatPath(dir), header) && header.epoch == epoch && header.sequence == sequence) {
+        return max(appliedCapturedMs, header.capturedMs);
+    }
+    return appliedCapturedMs;
+}
+
+// Applies the next changeset of the replica's epoch, if it has arrived.
+// Returns 1 when one was applied, 0 when there is none, -1 on error.
+static int applyNextChangeset(sqlite3* replica, const string& dir, int64_t epoch, uint64_t& sequence,
+                              int64_t& capturedMs) {
+    static Counter& conflicts = metrics().counter("library_replica_conflicts_total", "Changeset rows that did not match the replica.");
+    const string path = changesetPath(dir, epoch, sequence + 1);
+    ifstream in(path, ios::binary);
+    if (!in) {
+        return 0;
+    }
+    ChangesetFileHeader header = {};
+    string body;
+    if (in.read(reinterpret_cast<char*>(&header), sizeof header)) {
+        body.resize(header.size);
+        in.read(&body[0], static_cast<streamsize>(body.size()));
+    }
+    if (!in || memcmp(header.magic, kChangesetFileMagic, sizeof header.magic) != 0 || header.epoch != epoch ||
+        header.sequence != sequence + 1 || checksum64(body.data(), body.size()) != header.checksum) {
+        cerr << "Error: changeset " << path << " is damaged" << endl;
+        return -1;
+    }
+
+    uint64_t conflictCount = 0;
+    const string advance = "UPDATE ReplicaState SET Sequence = " + to_string(header.sequence) + " WHERE Id = 0;";
+    int rc = sqlite3_exec(replica, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+    if (rc == SQLITE_OK) {
+        rc = sqlite3changeset_apply(replica, static_cast<int>(body.size()), &body[0], nullptr, &onReplicaConflict,
+                                    &conflictCount);
+    }
+    if (rc == SQLITE_OK) rc = sqlite3_exec(replica, advance.c_str(), nullptr, nullptr, nullptr);
+    if (rc == SQLITE_OK) rc = sqlite3_exec(replica, "COMMIT;", nullptr, nullptr, nullptr);
+    if (rc != SQLITE_OK) {
+        cerr << "Error applying changeset " << path << ": " << sqlite3_errmsg(replica) << endl;
+        sqlite3_exec(replica, "ROLLBACK;", nullptr, nullptr, nullptr);
+        return -1;
+    }
+    conflicts.inc(conflictCount);
+    in.close();
+    remove(path.c_str());
+    sequence = header.sequence;
+    capturedMs = header.capturedMs;
+    return 1;
+}
+
+static volatile sig_atomic_t replicaStopRequested = 0;
+
+static void handleReplicaStopSignal(int) {
+    replicaStopRequested = 1;
+}
+
+int runReplica(int argc, char* argv[]) {
+    string replicaPath = "library-replica.db";
+    string dir = "library.replication";
+    int intervalMs = 200;
+    bool once = false;
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.compare(0, 7, "--from=") == 0) dir = arg.substr(7);
+        else if (arg.compare(0, 14, "--interval-ms=") == 0) intervalMs = max(1, atoi(arg.c_str() + 14));
+        else if (arg == "--once") once = true;
+        else if (arg.compare(0, 2, "--") == 0) {
+            cerr << "Usage: " << argv[0] << " replicate [replica.db] [--from=dir] [--interval-ms=N] [--once]" << endl;
+            return 1;
+        } else replicaPath = arg;
+    }
+    static Gauge& lagGauge = metrics().gauge("library_replica_lag_milliseconds",
+                                             "Age of the oldest change on the primary the replica has not applied.");
+    static Gauge& sequenceGauge = metrics().gauge("library_replica_sequence", "Sequence of the last applied changeset.");
+
+    sqlite3* replica = nullptr;
+    if (sqlite3_open(replicaPath.c_str(), &replica) != SQLITE_OK) {
+        cerr << "Error opening " << replicaPath << ": " << sqlite3_errmsg(replica) << endl;
+        sqlite3_close(replica);
+        return 1;
+    }
+    sqlite3_exec(replica, "PRAGMA journal_mode=WAL;", nullptr, nullptr, nullptr);
+    sqlite3_busy_timeout(replica, 5000);
+    queryProfiler().attach(replica);
+
+    int64_t epoch = 0;
+    uint64_t sequence = 0;
+    int64_t lagMs = 0;
+    int64_t capturedMs = 0;
+    uint64_t applied = 0;
+    const char* metricsPath = getenv("LIBRARY_METRICS_FILE");
+    auto lastReport = chrono::steady_clock::now();
+    auto lastMetricsWrite = lastReport;
+    int status = 0;
+    signal(SIGINT, handleReplicaStopSignal);
+    signal(SIGTERM, handleReplicaStopSignal);
+    while (!replicaStopRequested) {
+        sqlite3* base = nullptr;
+        int64_t baseEpoch = 0;
+        uint64_t baseSequence = 0;
+        bool haveBase = sqlite3_open_v2((dir + "/base.db").c_str(), &base, SQLITE_OPEN_READONLY, nullptr) == SQLITE_OK &&
+                        readReplicaState(base, baseEpoch, baseSequence);
+        sqlite3_close(base);
+        if (haveBase && (!readReplicaState(replica, epoch, sequence) || epoch != baseEpoch)) {
+            if (!seedReplica(replica, dir) || !readReplicaState(replica, epoch, sequence)) {
+                status = 1;
+                break;
+            }
+            cout << "Replica seeded from " << dir << "/base.db (epoch " << hex << epoch << dec << ")\n";
+            capturedMs = 0;
+        }
+
+        int result = haveBase ? 1 : 0;
+        while (result == 1) {
+            result = applyNextChangeset(replica, dir, epoch, sequence, capturedMs);
+            if (result == 1) {
+                ++applied;
+                sequenceGauge.set(static_cast<int64_t>(sequence));
+            }
+        }
+        if (result < 0) {
+            status = 1;
+            break;
+        }
+        if (haveBase) {
+            int64_t since = unappliedSinceMs(dir, epoch, sequence, capturedMs);
+            lagMs = since ? max<int64_t>(0, wallClockMs() - since) : 0;
+            lagGauge.set(lagMs);
+        }
+        if (once) break;
+        auto now = chrono::steady_clock::now();
+        // Scrapers read the file while the replica runs, not only on exit.
+        if (metricsPath && now - lastMetricsWrite >= chrono::seconds(1)) {
+            metrics().writePrometheusFile(metricsPath);
+            lastMetricsWrite = now;
+        }
+        if (now - lastReport >= chrono::seconds(10)) {
+            cout << "Replica at sequence " << sequence << ", " << applied << " changesets applied, lag " << lagMs
+                 << " ms" << endl;
+            lastReport = now;
+        }
+        this_thread::sleep_for(chrono::milliseconds(intervalMs));
+    }
+    cout << "Replica at sequence " << sequence << ", " << applied << " changesets applied, lag " << lagMs << " ms\n";
+    sqlite3_close(replica);
+    return status;
+}
+#endif
+
+// ================================
+// Sharded Storage
+// ================================
+// Books and Transactions split across N SQLite files by a stable hash of
+// the ISBN. A book's loans live in its shard, so every borrow and return
+// is a single-shard transaction. Each shard has a writer thread with its
+// own connection that commits whatever has queued up as one transaction
+// (group commit), each job under its own savepoint so a failed job rolls
+// back alone. Each shard also has a reader thread for lookups and for
+// fan-out scans. Users and everything else stay in library.db.
+// FNV-1a: stable across builds and platforms, unlike std::hash, so a
+// book stays in the shard it was written to.
+static uint64_t shardHash(const unsigned char* data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i) hash = (hash ^ data[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+class ShardWorker {
+public:
+    using Job = function<bool(sqlite3*)>;
+
+    ShardWorker(const string& path, bool writer);
+    ~ShardWorker();
+    ShardWorker(const ShardWorker&) = delete;
+    ShardWorker& operator=(const ShardWorker&) = delete;
+
+    bool isOpen() const { return conn != nullptr; }
+    // The future resolves once the job has run and, for a writer, the
+    // transaction holding it has committed: false if either failed. If the
+    // transaction could not begin or commit, error gets the SQLite code.
+    future<bool> submit(Job job, int* error = nullptr);
+
+private:
+    void run();
+
+    sqlite3* conn = nullptr;
+    bool writer;
+    mutex lock;
+    condition_variable ready;
+    struct Pending {
+        Job job;
+        promise<bool> done;
+        int* error;
+    };
+
+    deque<Pending> queue;
+    bool stopping = false;
+    thread worker;
+};
+
+ShardWorker::ShardWorker(const string& path, bool writer) : writer(writer) {
+    int flags = writer ? SQLITE_OPEN_READWRITE : SQLITE_OPEN_READONLY;
+    if (sqlite3_open_v2(path.c_str(), &conn, flags | SQLITE_OPEN_NOMUTEX, nullptr) != SQLITE_OK) {
+        cerr << "Error opening shard " << path << ": " << sqlite3_errmsg(conn) << endl;
+        sqlite3_close(conn);
+        conn = nullptr;
+        return;
+    }
+    sqlite3_busy_timeout(conn, 5000);
+    queryProfiler().attach(conn);
+    worker = thread(&ShardWorker::run, this);
+}
+
+ShardWorker::~ShardWorker() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    if (worker.joinable()) worker.join();
+    sqlite3_close(conn);
+}
+
+future<bool> ShardWorker::submit(Job job, int* error) {
+    promise<bool> done;
+    future<bool> result = done.get_future();
+    {
+        lock_guard<mutex> guard(lock);
+        queue.push_back({move(job), move(done), error});
+    }
+    ready.notify_one();
+    return result;
+}
+
+void ShardWorker::run() {
+    static Counter& commits = metrics().counter("library_shard_commits_total", "Transactions committed by shard writers.");
+    static Counter& jobs = metrics().counter("library_shard_write_jobs_total", "Write jobs run by shard writers.");
+    deque<Pending> batch;
+    while (true) {
+        {
+            unique_lock<mutex> guard(lock);
+            ready.wait(guard, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) return;
+            batch.swap(queue);
+        }
+        if (!writer) {
+            for (auto& item : batch) item.done.set_value(item.job(conn));
+            batch.clear();
+            continue;
+        }
+
+        vector<bool> results;
+        results.reserve(batch.size());
+        int error = sqlite3_exec(conn, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+        bool committed = error == SQLITE_OK;
+        for (auto& item : batch) {
+            bool ok = committed && sqlite3_exec(conn, "SAVEPOINT job;", nullptr, nullptr, nullptr) == SQLITE_OK;
+            ok = ok && item.job(conn);
+            if (committed && !ok) sqlite3_exec(conn, "ROLLBACK TO job;", nullptr, nullptr, nullptr);
+            if (committed) sqlite3_exec(conn, "RELEASE job;", nullptr, nullptr, nullptr);
+            results.push_back(ok);
+        }
+        if (committed && (error = sqlite3_exec(conn, "COMMIT;", nullptr, nullptr, nullptr)) != SQLITE_OK) {
+            cerr << "Error committing shard transaction: " << sqlite3_errmsg(conn) << endl;
+            sqlite3_exec(conn, "ROLLBACK;", nullptr, nullptr, nullptr);
+            committed = false;
+        }
+        commits.inc();
+        jobs.inc(batch.size());
+        for (size_t i = 0; i < batch.size(); ++i) {
+            if (!committed && batch[i].error) *batch[i].error = error;
+            batch[i].done.set_value(committed && results[i]);
+        }
+        batch.clear();
+    }
+}
+
+class ShardSet {
+public:
+    // Opens <prefix>-0.db ... <prefix>-<count-1>.db, as written by
+    // runShardSplit for the same count.
+    bool open(const string& prefix, size_t count);
+    size_t size() const { return shards.size(); }
+    size_t shardOf(const string& isbn) const {
+        return static_cast<size_t>(shardHash(reinterpret_cast<const unsigned char*>(isbn.data()), isbn.size()) % shards.size());
+    }
+    // Book ids in the in-memory indexes: shard rowids interleaved so they
+    // stay unique across shards.
+    uint32_t bookId(size_t shard, int64_t rowid) const { return static_cast<uint32_t>(rowid * shards.size() + shard); }
+    bool write(size_t shard, ShardWorker::Job job, int* error = nullptr) {
+        return shards[shard].writer->submit(move(job), error).get();
+    }
+    bool read(size_t shard, ShardWorker::Job job) { return shards[shard].reader->submit(move(job)).get(); }
+    // Runs job on every shard's reader at once; true if all succeeded.
+    bool readAll(const function<bool(size_t shard, sqlite3* conn)>& job);
+
+    static string path(const string& prefix, size_t shard) { return prefix + "-" + to_string(shard) + ".db"; }
+    // Creates the tables and records count as the file's user_version, so
+    // a shard is never opened as part of a set of a different size.
+    static bool createSchema(sqlite3* conn, size_t count);
+
+private:
+    struct Shard {
+        unique_ptr<ShardWorker> writer;
+        unique_ptr<ShardWorker> reader;
+    };
+    vector<Shard> shards;
+};
+
+// Books, Transactions and BranchCopies as in createTables(), without the
+// reference to Users, which are not sharded.
+bool ShardSet::createSchema(sqlite3* conn, size_t count) {
+    const string schema =
+        "PRAGMA journal_mode=WAL;"
+        "PRAGMA user_version=" + to_string(count) + ";"
+        "CREATE TABLE IF NOT EXISTS Books ("
+        "ISBN TEXT PRIMARY KEY, Title TEXT, Author TEXT, Genre TEXT, AvailableCopies INTEGER, "
+        "BorrowedCount INTEGER DEFAULT 0, ContentHash INTEGER);"
+        "CREATE TABLE IF NOT EXISTS Transactions ("
+        "TransactionID INTEGER PRIMARY KEY AUTOINCREMENT, UserID TEXT, ISBN TEXT, Action TEXT, "
+        "Timestamp DATETIME DEFAULT CURRENT_TIMESTAMP, Branch TEXT, FOREIGN KEY(ISBN) REFERENCES Books(ISBN));"
+        "CREATE INDEX IF NOT EXISTS TransactionsIsbnUser ON Transactions(ISBN, UserID);"
+        "CREATE TABLE IF NOT EXISTS BranchCopies ("
+        "ISBN TEXT NOT NULL, Branch TEXT NOT NULL, Copies INTEGER NOT NULL CHECK (Copies >= 0), "
+        "PRIMARY KEY (ISBN, Branch)) WITHOUT ROWID;";
+    char* errorMessage = nullptr;
+    if (sqlite3_exec(conn, schema.c_str(), nullptr, nullptr, &errorMessage) != SQLITE_OK) {
+        cerr << "Error creating shard tables: " << errorMessage << endl;
+        sqlite3_free(errorMessage);
+        return false;
+    }
+    return true;
+}
+
+bool ShardSet::open(const string& prefix, size_t count) {
+    shards.clear();
+    shards.resize(count);
+    for (size_t i = 0; i < count; ++i) {
+        shards[i].writer.reset(new ShardWorker(path(prefix, i), true));
+        int64_t version = 0;
+        bool opened = shards[i].writer->isOpen() && write(i, [&version](sqlite3* conn) {
+            sqlite3_stmt* stmt = nullptr;
+            if (sqlite3_prepare_v2(conn, "PRAGMA user_version;", -1, &stmt, nullptr) == SQLITE_OK &&
+                sqlite3_step(stmt) == SQLITE_ROW) {
+                version = sqlite3_column_int64(stmt, 0);
+            }
+            sqlite3_finalize(stmt);
+            return true;
+        });
+        if (opened && version != static_cast<int64_t>(count)) {
+            cerr << "Error: " << path(prefix, i) << " belongs to a set of " << version << " shards, not " << count
+                 << "; run `shard " << count << "` first" << endl;
+        }
+        if (!opened || version != static_cast<int64_t>(count)) {
+            shards.clear();
+            return false;
+        }
+        shards[i].reader.reset(new ShardWorker(path(prefix, i), false));
+        if (!shards[i].reader->isOpen()) {
+            shards.clear();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ShardSet::readAll(const function<bool(size_t shard, sqlite3* conn)>& job) {
+    vector<future<bool>> pending;
+    pending.reserve(shards.size());
+    for (size_t i = 0; i < shards.size(); ++i) {
+        pending.push_back(shards[i].reader->submit([&job, i](sqlite3* conn) { return job(i, conn); }));
+    }
+    bool ok = true;
+    for (auto& result : pending) ok = result.get() && ok;
+    return ok;
+}
+
+// Splits library.db's Books, Transactions and BranchCopies into count
+// shard files, one thread per shard. Existing shard files are replaced.
+int runShardSplit(const string& prefix, size_t count) {
+    auto start = chrono::steady_clock::now();
+    vector<int64_t> books(count), transactions(count);
+    vector<string> errors(count);
+    vector<thread> workers;
+    for (size_t shard = 0; shard < count; ++shard) {
+        workers.emplace_back([&, shard] {
+            const string path = ShardSet::path(prefix, shard);
+            for (const char* suffix : {"", "-wal", "-shm"}) remove((path + suffix).c_str());
+            sqlite3* conn = nullptr;
+            if (sqlite3_open(path.c_str(), &conn) != SQLITE_OK || !ShardSet::createSchema(conn, count)) {
+                errors[shard] = sqlite3_errmsg(conn);
+                sqlite3_close(conn);
+                return;
+            }
+            // The same hash as ShardSet::shardOf, as an SQL function.
+            sqlite3_create_function(conn, "shard_of", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, &count,
+                [](sqlite3_context* context, int, sqlite3_value** args) {
+                    size_t shards = *static_cast<size_t*>(sqlite3_user_data(context));
+                    const unsigned char* text = sqlite3_value_text(args[0]);
+                    uint64_t hash = shardHash(text, text ? static_cast<size_t>(sqlite3_value_bytes(args[0])) : 0);
+                    sqlite3_result_int64(context, static_cast<int64_t>(hash % shards));
+                }, nullptr, nullptr);
+            const string where = " WHERE shard_of(ISBN) = " + to_string(shard) + ";";
+            const string sql = string("ATTACH DATABASE '") + databasePath + "' AS source; BEGIN;"
+                "INSERT INTO Books (ISBN, Title, Author, Genre, AvailableCopies, BorrowedCount, ContentHash) "
+                "SELECT ISBN, Title, Author, Genre, AvailableCopies, BorrowedCount, ContentHash FROM source.Books" + where +
+                "INSERT INTO Transactions SELECT * FROM source.Transactions" + where +
+                "INSERT INTO BranchCopies SELECT * FROM source.BranchCopies" + where + "COMMIT;";
+            if (sqlite3_exec(conn, sql.c_str(), nullptr, nullptr, nullptr) != SQLITE_OK) {
+                errors[shard] = sqlite3_errmsg(conn);
+            } else {
+                sqlite3_stmt* stmt = nullptr;
+                if (sqlite3_prepare_v2(conn, "SELECT (SELECT COUNT(*) FROM Books), (SELECT COUNT(*) FROM Transactions);",
+                                       -1, &stmt, nullptr) == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+                    books[shard] = sqlite3_column_int64(stmt, 0);
+                    transactions[shard] = sqlite3_column_int64(stmt, 1);
+                }
+                sqlite3_finalize(stmt);
+            }
+            sqlite3_close(conn);
+        });
+    }
+    for (thread& worker : workers) worker.join();
+
+    int status = 0;
+    for (size_t shard = 0; shard < count; ++shard) {
+        if (!errors[shard].empty()) {
+            cerr << "Error writing " << ShardSet::path(prefix, shard) << ": " << errors[shard] << endl;
+            status = 1;
+        } else {
+            cout << ShardSet::path(prefix, shard) << ": " << books[shard] << " books, " << transactions[shard]
+                 << " transactions\n";
+        }
+    }
+    cout << "Split " << databasePath << " into " << count << " shards in "
+         << chrono::duration<double>(chrono::steady_clock::now() - start).count() << " s\n";
+    return status;
+}
+
+// ================================
+// Library Class
+// ================================
+// Why a borrow or return did or did not go through.
+enum class CheckoutResult {
+    Ok,
+    NotFound,     // no book with that ISBN
+    Unavailable,  // borrow: no copy on the shelf (at the branch, if one was given)
+    AtLimit,      // borrow: the user already has as many loans as their type allows
+    NoLoan,       // return: the user has no outstanding loan of the book
+    Busy,         // the database stayed locked past the busy timeout
+    StorageError, // any other SQLite failure
+};
+
+class Library {
+public:
+    bool addBook(const string& title, const string& author, const string& genre, const string& isbn, int copies);
+    bool addUser(const string& name, const string& userID, const string& userType);
+    // With a branch, the copy leaves (or goes back to) that branch's shelf;
+    // without one, it comes from the copies no branch holds. When result is
+    // given it receives the reason for a false return.
+    bool borrowBook(const string& userID, const string& isbn, const string& branch = "",
+                    CheckoutResult* result = nullptr);
+    bool returnBook(const string& userID, const string& isbn, const string& branch = "",
+                    CheckoutResult* result = nullptr);
+    // Moves copies from one branch to another in a single transaction. An
+    // empty branch name is the unassigned pool.
+    bool transferCopies(const string& isbn, const string& from, const string& to, int copies);
+    // Branches with the book on the shelf, from memory.
+    vector<pair<string, int>> branchStock(const string& isbn) const;
+    // Replace the per-UserType loan limits (see Borrowing Policy) from text
+    // such as "student=5,staff=20,*=10". Call before warmStart().
+    bool setBorrowLimits(const string& spec);
+    bool atBorrowLimit(const string& userID) const;
+    void displayBooks();
+    CsvImportReport addBooksFromCSV(const string& filePath, const CsvImportOptions& options = CsvImportOptions());
+    CsvImportReport addUsersFromCSV(const string& filePath, const UserImportOptions& options = UserImportOptions());
+    void loadIndexes();
+    // Seed indexes and the book cache from a catalog file when it matches
+    // the database; otherwise loadIndexes() and rewrite the file.
+    void warmStart(const string& catalogPath);
+    // Write the catalog file unless (without force) its header already
+    // matches the database.
+    bool saveCatalogFile(const string& catalogPath, bool force = false);
+    vector<pair<string, int>> topBorrowed(size_t k) const;
+    bool findBook(const string& isbn, Book& book);
+    vector<Book> searchBooks(const string& text, const string& genre, int limit);
+    CacheStats cacheStats() const;
+    bool snapshotCatalog(CatalogSnapshot& snapshot) const;
+    FacetCounts facetCounts(const RoaringBitmap* resultSet = nullptr) const;
+    // Route findBook/searchBooks through a work-stealing pool with one
+    // read-only connection per worker. Call after openDatabase().
+    void enableReadPool(size_t workers);
+    vector<WorkStealingPool::WorkerStats> readPoolStats() const;
+    // Ship committed changes to dir for a `replicate` process (see
+    // Replication). Call after createTables(); stop before closeDatabase().
+    bool enableReplication(const string& dir, int intervalMs);
+    void stopReplication();
+    // Keep Books and Transactions in count files named <prefix>-<n>.db
+    // (see Sharded Storage) for book lookups, searches, addBook, borrows
+    // and returns. Call after createTables() and before warmStart().
+    bool enableSharding(const string& prefix, size_t count);
+    // Drop the per-operation messages (book added, borrowed, returned...)
+    // that addBook, addUser, borrowBook, returnBook and transferCopies print,
+    // e.g. while a load test drives them from many threads.
+    void setQuiet(bool on) { quiet = on; }
+
+private:
+    ostream& progress();
+    void runRead(const WorkStealingPool::Job& job);
+    bool runWrite(const string& isbn, const ShardWorker::Job& work, int* error = nullptr);
+    uint32_t indexId(const string& isbn, int64_t rowid) const;
+    bool updateCopies(sqlite3* conn, const string& sql, const string& isbn, bool& matched, uint32_t& bookId,
+                      int& remainingCopies);
+    bool updateBranchCopies(sqlite3* conn, const string& isbn, const string& branch, int delta, bool& matched);
+    bool logTransaction(sqlite3* conn, const string& userID, const string& isbn, const char* action,
+                        const string& branch);
+    void loadBranchInventory();
+    void loadLoans();
+
+    // Serializes write transactions on the shared connection.
+    mutex writeMutex;
+    BorrowRanking borrowRanking;
+    BookCache bookCache;
+    FacetIndex facetIndex;
+    BranchInventory branchInventory;
+    BorrowPolicy borrowPolicy;
+    unique_ptr<WorkStealingPool> readPool;
+#ifdef LIBRARY_HAVE_SESSION
+    unique_ptr<ChangesetShipper> replication;
+#endif
+    unique_ptr<ShardSet> shards;
+    atomic<bool> quiet{false};
+};
+
+// An ostream with no buffer is always in a failed state and drops whatever
+// is written to it; one per thread, so nothing is shared.
+ostream& Library::progress() {
+    thread_local ostream discard(nullptr);
+    return quiet.load(memory_order_relaxed) ? discard : cout;
+}
+
+void Library::enableReadPool(size_t workers) {
+    readPool.reset(new WorkStealingPool(databasePath, workers));
+}
+
+bool Library::enableReplication(const string& dir, int intervalMs) {
+#ifdef LIBRARY_HAVE_SESSION
+    if (shards) {
+        cerr << "Error: replication does not cover sharded storage" << endl;
+        return false;
+    }
+    replication.reset(new ChangesetShipper(db, writeMutex, dir, intervalMs));
+    if (!replication->start()) {
+        replication.reset();
+        return false;
+    }
+    return true;
+#else
+    (void)intervalMs;
+    cerr << "Error: replication to " << dir << " needs a build with -DLIBRARY_WITH_SESSION" << endl;
+    return false;
+#endif
+}
+
+void Library::stopReplication() {
+#ifdef LIBRARY_HAVE_SESSION
+    replication.reset();
+#endif
+}
+
+bool Library::enableSharding(const string& prefix, size_t count) {
+    unique_ptr<ShardSet> set(new ShardSet());
+    if (count == 0 || !set->open(prefix, count)) {
+        cerr << "Error: could not open " << count << " shards at " << prefix << "-*.db" << endl;
+        return false;
+    }
+    shards = move(set);
+    cout << "Books and Transactions are sharded across " << count << " files (" << prefix << "-*.db)\n";
+    return true;
+}
+
+// Id of a book in the in-memory indexes: its rowid, interleaved by shard
+// when sharded.
+uint32_t Library::indexId(const string& isbn, int64_t rowid) const {
+    return shards ? shards->bookId(shards->shardOf(isbn), rowid) : static_cast<uint32_t>(rowid);
+}
+
+vector<WorkStealingPool::WorkerStats> Library::readPoolStats() const {
+    return readPool ? readPool->stats() : vector<WorkStealingPool::WorkerStats>();
+}
+
+void Library::runRead(const WorkStealingPool::Job& job) {
+    if (readPool) {
+        readPool->run(job);
+    } else {
+        job(db);
+    }
+}
+
+// Seed the in-memory structures from the Books table. Call once after
+// createTables(); addBook and borrowBook keep them current afterwards.
+void Library::loadIndexes() {
+    const string sql = "SELECT rowid, ISBN, Genre, AvailableCopies, BorrowedCount FROM Books;";
+    vector<pair<string, int>> ranked;
+    borrowRanking.clear();
+    facetIndex.clear();
+
+    // Shards are scanned in parallel into their own lists, then merged.
+    struct IndexRow {
+        uint32_t id;
+        string genre;
+        int availableCopies;
+    };
+    size_t parts = shards ? shards->size() : 1;
+    vector<vector<pair<string, int>>> rankedParts(parts);
+    vector<vector<IndexRow>> rowParts(parts);
+    auto scan = [&](size_t part, sqlite3* conn) {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(conn, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            cerr << "Error loading indexes: " << sqlite3_errmsg(conn) << endl;
+            return false;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            int64_t rowid = sqlite3_column_int64(stmt, 0);
+            string isbn = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+            const unsigned char* genre = sqlite3_column_text(stmt, 2);
+            uint32_t id = shards ? shards->bookId(part, rowid) : static_cast<uint32_t>(rowid);
+            rowParts[part].push_back({id, genre ? reinterpret_cast<const char*>(genre) : "", sqlite3_column_int(stmt, 3)});
+            rankedParts[part].emplace_back(move(isbn), sqlite3_column_int(stmt, 4));
+        }
+        sqlite3_finalize(stmt);
+        return true;
+    };
+    if (shards) {
+        shards->readAll(scan);
+    } else {
+        scan(0, db);
+    }
+
+    for (size_t part = 0; part < parts; ++part) {
+        for (const IndexRow& row : rowParts[part]) facetIndex.addBook(row.id, row.genre, row.availableCopies);
+        if (ranked.empty()) ranked = move(rankedParts[part]);
+        else move(rankedParts[part].begin(), rankedParts[part].end(), back_inserter(ranked));
+    }
+    borrowRanking.addAll(move(ranked));
+    loadBranchInventory();
+}
+
+// BranchCopies is not in the catalog file, so this runs on every start.
+void Library::loadBranchInventory() {
+    const string sql = "SELECT ISBN, Branch, Copies FROM BranchCopies;";
+    vector<vector<tuple<string, string, int>>> parts(shards ? shards->size() : 1);
+    auto scan = [&](size_t part, sqlite3* conn) {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(conn, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            cerr << "Error loading branch copies: " << sqlite3_errmsg(conn) << endl;
+            return false;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            parts[part].emplace_back(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+                                     reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1)), sqlite3_column_int(stmt, 2));
+        }
+        sqlite3_finalize(stmt);
+        return true;
+    };
+    if (shards) {
+        shards->readAll(scan);
+    } else {
+        scan(0, db);
+    }
+
+    branchInventory.clear();
+    for (const auto& rows : parts) {
+        for (const auto& row : rows) branchInventory.apply(get<0>(row), {{get<1>(row), get<2>(row)}});
+    }
+}
+
+// Users are in library.db; their outstanding loans are summed from
+// Transactions, which may be spread over shards.
+void Library::loadLoans() {
+    const string loansSql =
+        "SELECT UserID, SUM(CASE Action WHEN 'Borrow' THEN 1 WHEN 'Return' THEN -1 ELSE 0 END) "
+        "FROM Transactions GROUP BY UserID;";
+    borrowPolicy.clear();
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT UserID, UserType FROM Users;", -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const unsigned char* type = sqlite3_column_text(stmt, 1);
+            borrowPolicy.setUserType(reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0)),
+                                     type ? reinterpret_cast<const char*>(type) : "");
+        }
+        sqlite3_finalize(stmt);
+    } else {
+        cerr << "Error loading users: " << sqlite3_errmsg(db) << endl;
+    }
+
+    vector<vector<pair<string, int>>> parts(shards ? shards->size() : 1);
+    auto scan = [&](size_t part, sqlite3* conn) {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(conn, loansSql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+            cerr << "Error loading loans: " << sqlite3_errmsg(conn) << endl;
+            return false;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            const unsigned char* userID = sqlite3_column_text(stmt, 0);
+            int loans = sqlite3_column_int(stmt, 1);
+            if (userID && loans > 0) parts[part].emplace_back(reinterpret_cast<const char*>(userID), loans);
+        }
+        sqlite3_finalize(stmt);
+        return true;
+    };
+    if (shards) {
+        shards->readAll(scan);
+    } else {
+        scan(0, db);
+    }
+    for (const auto& loans : parts) {
+        for (const auto& entry : loans) borrowPolicy.addLoans(entry.first, entry.second);
+    }
+}
+
+bool Library::setBorrowLimits(const string& spec) {
+    map<string, int> limits;
+    if (!BorrowPolicy::parseLimits(spec, limits)) {
+        cerr << "Error: borrowing limits must look like student=5,staff=20,*=10, not '" << spec << "'" << endl;
+        return false;
+    }
+    borrowPolicy.setLimits(limits);
+    return true;
+}
+
+bool Library::atBorrowLimit(const string& userID) const {
+    return borrowPolicy.atLimit(userID);
+}
+
+vector<pair<string, int>> Library::topBorrowed(size_t k) const {
+    return borrowRanking.top(k);
+}
+
+// Columns: rowid, ISBN, Title, Author, Genre, AvailableCopies, BorrowedCount.
+static const char* const kBookColumns = "rowid, ISBN, Title, Author, Genre, AvailableCopies, BorrowedCount";
+
+static string columnString(sqlite3_stmt* stmt, int col) {
+    const unsigned char* text = sqlite3_column_text(stmt, col);
+    return text ? reinterpret_cast<const char*>(text) : "";
+}
+
+static void readBookRow(sqlite3_stmt* stmt, Book& book) {
+    book.id = sqlite3_column_int64(stmt, 0);
+    book.isbn = columnString(stmt, 1);
+    book.title = columnString(stmt, 2);
+    book.author = columnString(stmt, 3);
+    book.genre = columnString(stmt, 4);
+    book.availableCopies = sqlite3_column_int(stmt, 5);
+    book.borrowedCount = sqlite3_column_int(stmt, 6);
+}
+
+void Library::warmStart(const string& catalogPath) {
+    static const size_t kWarmCacheBooks = 4096;
+    static OperationMetrics instruments("warmStart");
+    OperationScope scope(instruments);
+    TraceSpan span("warmStart");
+    auto start = chrono::steady_clock::now();
+    loadLoans();
+
+    // The catalog file describes library.db; shards are scanned directly.
+    if (shards) {
+        loadIndexes();
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        scope.markOk();
+        cout << "Loaded indexes from " << shards->size() << " shards in " << ms << " ms\n";
+        return;
+    }
+
+    int64_t epoch = 0;
+    int64_t generation = 0;
+    CatalogFile file;
+    if (readCatalogVersion(db, epoch, generation) && file.open(catalogPath)) {
+        if (file.header().epoch == epoch && file.header().generation == generation) {
+            vector<pair<string, int>> ranked;
+            ranked.reserve(file.size());
+            borrowRanking.clear();
+            facetIndex.clear();
+            for (size_t i = 0; i < file.size(); ++i) {
+                const CatalogFileRecord& record = file.record(i);
+                ranked.emplace_back(string(file.field(record, FieldIsbn)), record.borrowedCount);
+                facetIndex.addBook(static_cast<uint32_t>(record.id), string(file.field(record, FieldGenre)),
+                                   record.availableCopies);
+            }
+            borrowRanking.addAll(move(ranked));
+
+            // The most borrowed books are the likeliest first lookups.
+            vector<uint32_t> order(file.size());
+            for (size_t i = 0; i < order.size(); ++i) order[i] = static_cast<uint32_t>(i);
+            size_t warm = min(kWarmCacheBooks, order.size());
+            partial_sort(order.begin(), order.begin() + warm, order.end(), [&file](uint32_t a, uint32_t b) {
+                return file.record(a).borrowedCount > file.record(b).borrowedCount;
+            });
+            for (size_t i = 0; i < warm; ++i) {
+                bookCache.put(file.book(order[i]));
+            }
+            loadBranchInventory();
+
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            scope.markOk();
+            cout << "Loaded " << file.size() << " books from " << catalogPath << " in " << ms << " ms\n";
+            return;
+        }
+        cout << catalogPath << " is out of date; rebuilding from the database.\n";
+    }
+
+    loadIndexes();
+    if (saveCatalogFile(catalogPath, true)) {
+        scope.markOk();
+    }
+}
+
+// Reads through its own read-only connection inside one transaction, so
+// the rows match the recorded generation without holding writeMutex.
+bool Library::saveCatalogFile(const string& catalogPath, bool force) {
+    static OperationMetrics instruments("saveCatalogFile");
+    OperationScope scope(instruments);
+    TraceSpan span("saveCatalogFile");
+    if (shards) {
+        scope.markOk();
+        return true; // nothing in library.db to snapshot
+    }
+
+    sqlite3* conn = nullptr;
+    if (sqlite3_open_v2(databasePath, &conn, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        cerr << "Error opening read connection: " << sqlite3_errmsg(conn) << endl;
+        sqlite3_close(conn);
+        return false;
+    }
+    sqlite3_busy_timeout(conn, 5000);
+    queryProfiler().attach(conn);
+
+    bool ok = sqlite3_exec(conn, "BEGIN;", nullptr, nullptr, nullptr) == SQLITE_OK;
+    int64_t epoch = 0;
+    int64_t generation = 0;
+    ok = ok && readCatalogVersion(conn, epoch, generation);
+
+    CatalogFileHeader existing;
+    if (ok && !force && CatalogFile::readHeader(catalogPath, existing) && existing.epoch == epoch &&
+        existing.generation == generation) {
+        sqlite3_exec(conn, "COMMIT;", nullptr, nullptr, nullptr);
+        sqlite3_close(conn);
+        scope.markOk();
+        return true;
+    }
+
+    CatalogFileWriter writer;
+    sqlite3_stmt* stmt = nullptr;
+    const string sql = string("SELECT ") + kBookColumns + " FROM Books;";
+    if (ok && sqlite3_prepare_v2(conn, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        Book book;
+        int rc;
+        while (ok && (rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            readBookRow(stmt, book);
+            ok = writer.add(book);
+        }
+        ok = ok && rc == SQLITE_DONE;
+        sqlite3_finalize(stmt);
+    } else {
+        ok = false;
+    }
+    if (!ok) {
+        cerr << "Error reading catalog: " << sqlite3_errmsg(conn) << endl;
+    }
+    sqlite3_exec(conn, "COMMIT;", nullptr, nullptr, nullptr);
+    sqlite3_close(conn);
+
+    if (!ok || !writer.finish(catalogPath, epoch, generation)) {
+        return false;
+    }
+    scope.markOk();
+    cout << "Catalog written to " << catalogPath << ".\n";
+    return true;
+}
+
+bool Library::findBook(const string& isbn, Book& book) {
+    if (bookCache.get(isbn, book)) {
+        return true;
+    }
+
+    const string sql = string("SELECT ") + kBookColumns + " FROM Books WHERE ISBN = ?;";
+    uint64_t ticket = bookCache.ticket(isbn);
+    bool found = false;
+
+    auto lookup = [&](sqlite3* conn) {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(conn, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, isbn.c_str(), -1, SQLITE_STATIC);
+
+            int rc = sqlite3_step(stmt);
+            if (rc == SQLITE_ROW) {
+                readBookRow(stmt, book);
+                book.id = indexId(isbn, book.id);
+                found = true;
+            } else if (rc != SQLITE_DONE) {
+                cerr << "Error looking up book: " << sqlite3_errmsg(conn) << endl;
+            }
+            sqlite3_finalize(stmt);
+        } else {
+            cerr << "Error preparing lookup statement: " << sqlite3_errmsg(conn) << endl;
+        }
+        return true;
+    };
+    if (shards) {
+        shards->read(shards->shardOf(isbn), lookup);
+    } else {
+        runRead(lookup);
+    }
+
+    if (found) {
+        bookCache.put(book, ticket);
+    }
+    return found;
+}
+
+// Substring match on Title or Author, optionally restricted to one genre.
+// An empty text or genre matches everything.
+vector<Book> Library::searchBooks(const string& text, const string& genre, int limit) {
+    const string sql = string("SELECT ") + kBookColumns + " FROM Books "
+        "WHERE (?1 = '' OR Title LIKE ?2 OR Author LIKE ?2) "
+        "AND (?3 = '' OR Genre = ?3) "
+        "LIMIT ?4;";
+    const string pattern = "%" + text + "%";
+    vector<Book> results;
+
+    auto search = [&](sqlite3* conn, vector<Book>& out, size_t shard) {
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(conn, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, text.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, pattern.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, genre.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_int(stmt, 4, limit);
+
+            int rc;
+            while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+                Book book;
+                readBookRow(stmt, book);
+                if (shards) book.id = shards->bookId(shard, book.id);
+                out.push_back(move(book));
+            }
+            if (rc != SQLITE_DONE) {
+                cerr << "Error searching books: " << sqlite3_errmsg(conn) << endl;
+            }
+            sqlite3_finalize(stmt);
+        } else {
+            cerr << "Error preparing search statement: " << sqlite3_errmsg(conn) << endl;
+        }
+        return true;
+    };
+
+    if (!shards) {
+        runRead([&](sqlite3* conn) { search(conn, results, 0); });
+        return results;
+    }
+    // Every shard runs the query with the full limit at once; the first
+    // limit rows, in shard order, are kept.
+    vector<vector<Book>> parts(shards->size());
+    shards->readAll([&](size_t shard, sqlite3* conn) { return search(conn, parts[shard], shard); });
+    size_t cap = limit < 0 ? numeric_limits<size_t>::max() : static_cast<size_t>(limit);
+    for (vector<Book>& part : parts) {
+        for (Book& book : part) {
+            if (results.size() == cap) return results;
+            results.push_back(move(book));
+        }
+    }
+    return results;
+}
+
+CacheStats Library::cacheStats() const {
+    return bookCache.stats();
+}
+
+bool Library::snapshotCatalog(CatalogSnapshot& snapshot) const {
+    return snapshot.load(db);
+}
+
+FacetCounts Library::facetCounts(const RoaringBitmap* resultSet) const {
+    return facetIndex.counts(resultSet);
+}
+
+bool Library::addBook(const string& title, const string& author, const string& genre, const string& isbn, int copies) {
+    static OperationMetrics instruments("addBook");
+    OperationScope scope(instruments);
+    TraceSpan span("addBook");
+
+    int64_t rowid = 0;
+    bool exists = false;
+    bool added = runWrite(isbn, [&](sqlite3* conn) {
+        // Check if the book already exists
+        const string checkSql = "SELECT COUNT(*) FROM Books WHERE ISBN = ?;";
+        sqlite3_stmt* checkStmt = nullptr;
+        TraceSpan checkSpan("addBook.check");
+
+        if (sqlite3_prepare_v2(conn, checkSql.c_str(), -1, &checkStmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(checkStmt, 1, isbn.c_str(), -1, SQLITE_STATIC);
+
+            if (sqlite3_step(checkStmt) == SQLITE_ROW) {
+                exists = sqlite3_column_int(checkStmt, 0) > 0;
+                sqlite3_finalize(checkStmt);
+                if (exists) {
+                    return false;
+                }
+            } else {
+                cerr << "Error checking book existence: " << sqlite3_errmsg(conn) << endl;
+                sqlite3_finalize(checkStmt);
+                return false;
+            }
+        } else {
+            cerr << "Error preparing check statement: " << sqlite3_errmsg(conn) << endl;
+            return false;
+        }
+        checkSpan.end();
+
+        // Insert the new book
+        const string insertSql = "INSERT INTO Books (ISBN, Title, Author, Genre, AvailableCopies) VALUES (?, ?, ?, ?, ?);";
+        sqlite3_stmt* insertStmt = nullptr;
+        bool inserted = false;
+
+        if (sqlite3_prepare_v2(conn, insertSql.c_str(), -1, &insertStmt, nullptr) == SQLITE_OK) {
+            TraceSpan bindSpan("addBook.bind");
+            sqlite3_bind_text(insertStmt, 1, isbn.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(insertStmt, 2, title.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(insertStmt, 3, author.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(insertStmt, 4, genre.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_int(insertStmt, 5, copies);
+            bindSpan.end();
+
+            TraceSpan stepSpan("addBook.step");
+            int rc = sqlite3_step(insertStmt);
+            stepSpan.end();
+
+            if (rc == SQLITE_DONE) {
+                rowid = sqlite3_last_insert_rowid(conn);
+                inserted = true;
+            } else {
+                cerr << "Error adding book: " << sqlite3_errmsg(conn) << endl;
+            }
+            sqlite3_finalize(insertStmt);
+        } else {
+            cerr << "Error preparing insert statement: " << sqlite3_errmsg(conn) << endl;
+        }
+        return inserted;
+    });
+
+    if (exists) {
+        scope.markRejected();
+        progress() << "Book with ISBN " << isbn << " already exists. Skipping insertion.\n";
+        return false;
+    }
+    if (added) {
+        borrowRanking.add(isbn, 0);
+        facetIndex.addBook(indexId(isbn, rowid), genre, copies);
+        bookCache.invalidate(isbn);
+        scope.markOk();
+        progress() << "Book added successfully.\n";
+    }
+    return added;
+}
+
+bool Library::addUser(const string& name, const string& userID, const string& userType) {
+    static OperationMetrics instruments("addUser");
+    OperationScope scope(instruments);
+    TraceSpan span("addUser");
+    if (userID.empty()) {
+        cerr << "Error adding user: empty UserID" << endl;
+        return false;
+    }
+
+    const string sql = "INSERT INTO Users (UserID, Name, UserType) VALUES (?, ?, ?) ON CONFLICT(UserID) DO NOTHING;";
+    sqlite3_stmt* stmt = nullptr;
+    bool ok = false;
+    bool exists = false;
+    {
+        lock_guard<mutex> guard(writeMutex);
+        if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+            sqlite3_bind_text(stmt, 1, userID.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 2, name.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(stmt, 3, userType.c_str(), -1, SQLITE_STATIC);
+            if (sqlite3_step(stmt) == SQLITE_DONE) {
+                ok = true;
+                exists = sqlite3_changes(db) == 0;
+            } else {
+                cerr << "Error adding user: " << sqlite3_errmsg(db) << endl;
+            }
+            sqlite3_finalize(stmt);
+        } else {
+            cerr << "Error preparing user insert statement: " << sqlite3_errmsg(db) << endl;
+        }
+    }
+
+    if (exists) {
+        scope.markRejected();
+        progress() << "User with ID " << userID << " already exists. Skipping insertion.\n";
+        return false;
+    }
+    if (ok) {
+        borrowPolicy.setUserType(userID, userType);
+        scope.markOk();
+        progress() << "User " << userID << " added successfully.\n";
+    }
+    return ok;
+}
+
+// Apply a copies update that RETURNs (rowid, AvailableCopies). matched is
+// false when the WHERE clause excluded the row, which is not an error.
+bool Library::updateCopies(sqlite3* conn, const string& sql, const string& isbn, bool& matched, uint32_t& bookId,
+                           int& remainingCopies) {
+    sqlite3_stmt* stmt = nullptr;
+    bool ok = false;
+    matched = false;
+
+    if (sqlite3_prepare_v2(conn, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        TraceSpan bindSpan("updateCopies.bind");
+        sqlite3_bind_text(stmt, 1, isbn.c_str(), -1, SQLITE_STATIC);
+        bindSpan.end();
+
+        TraceSpan stepSpan("updateCopies.step");
+        int rc = sqlite3_step(stmt);
+        if (rc == SQLITE_ROW) {
+            matched = true;
+            bookId = indexId(isbn, sqlite3_column_int64(stmt, 0));
+            remainingCopies = sqlite3_column_int(stmt, 1);
+            rc = sqlite3_step(stmt);
+        }
+        if (rc == SQLITE_DONE) {
+            ok = true;
+        } else {
+            cerr << "Error updating book: " << sqlite3_errmsg(conn) << endl;
+        }
+        sqlite3_finalize(stmt);
+    } else {
+        cerr << "Error preparing update statement: " << sqlite3_errmsg(conn) << endl;
+    }
+    return ok;
+}
+
+// Adds delta to a branch's copies of isbn. A decrement matches only if the
+// branch holds enough copies; an increment creates the row if needed.
+bool Library::updateBranchCopies(sqlite3* conn, const string& isbn, const string& branch, int delta, bool& matched) {
+    const char* sql = delta < 0
+        ? "UPDATE BranchCopies SET Copies = Copies + ?3 WHERE ISBN = ?1 AND Branch = ?2 AND Copies + ?3 >= 0;"
+        : "INSERT INTO BranchCopies (ISBN, Branch, Copies) VALUES (?1, ?2, ?3) "
+          "ON CONFLICT (ISBN, Branch) DO UPDATE SET Copies = Copies + excluded.Copies;";
+    sqlite3_stmt* stmt = nullptr;
+    bool ok = false;
+    matched = false;
+
+    if (sqlite3_prepare_v2(conn, sql, -1, &stmt, nullptr) == SQLITE_OK) {
+        sqlite3_bind_text(stmt, 1, isbn.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, branch.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_int(stmt, 3, delta);
+        if (sqlite3_step(stmt) == SQLITE_DONE) {
+            ok = true;
+            matched = sqlite3_changes(conn) > 0;
+        } else {
+            cerr << "Error updating branch copies: " << sqlite3_errmsg(conn) << endl;
+        }
+        sqlite3_finalize(stmt);
+    } else {
+        cerr << "Error preparing branch copies statement: " << sqlite3_errmsg(conn) << endl;
+    }
+    return ok;
+}
+
+bool Library::logTransaction(sqlite3* conn, const string& userID, const string& isbn, const char* action,
+                             const string& branch) {
+    const string sql = "INSERT INTO Transactions (UserID, ISBN, Action, Branch) VALUES (?, ?, ?, ?);";
+    sqlite3_stmt* stmt = nullptr;
+    bool ok = false;
+
+    if (sqlite3_prepare_v2(conn, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        TraceSpan bindSpan("logTransaction.bind");
+        sqlite3_bind_text(stmt, 1, userID.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 2, isbn.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(stmt, 3, action, -1, SQLITE_STATIC);
+        if (!branch.empty()) sqlite3_bind_text(stmt, 4, branch.c_str(), -1, SQLITE_STATIC);
+        bindSpan.end();
+
+        TraceSpan stepSpan("logTransaction.step");
+        int rc = sqlite3_step(stmt);
+        stepSpan.end();
+
+        if (rc == SQLITE_DONE) {
+            ok = true;
+        } else {
+            cerr << "Error logging transaction: " << sqlite3_errmsg(conn) << endl;
+        }
+        sqlite3_finalize(stmt);
+    } else {
+        cerr << "Error preparing log statement: " << sqlite3_errmsg(conn) << endl;
+    }
+    return ok;
+}
+
+// Commit when ok, otherwise roll back. Returns whether the work was kept;
+// if the commit itself failed, error gets its SQLite code.
+static bool finishTransaction(bool ok, int* error = nullptr) {
+    if (ok && sqlite3_exec(db, "COMMIT;", nullptr, nullptr, nullptr) == SQLITE_OK) {
+        return true;
+    }
+    if (ok) {
+        if (error) *error = sqlite3_errcode(db);
+        cerr << "Error committing transaction: " << sqlite3_errmsg(db) << endl;
+    }
+    sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
+    return false;
+}
+
+// Run work in a write transaction on the connection that holds isbn: its
+// shard's writer, or library.db under writeMutex. Returns whether the
+// work succeeded and was committed. If the transaction could not begin or
+// commit, error gets the SQLite code; failures inside work are its own.
+bool Library::runWrite(const string& isbn, const ShardWorker::Job& work, int* error) {
+    if (shards) {
+        return shards->write(shards->shardOf(isbn), work, error);
+    }
+    lock_guard<mutex> guard(writeMutex);
+    if (sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+        if (error) *error = sqlite3_errcode(db);
+        cerr << "Error starting transaction: " << sqlite3_errmsg(db) << endl;
+        return false;
+    }
+    bool ok = work(db);
+    TraceSpan commitSpan("transaction.commit");
+    return finishTransaction(ok, error);
+}
+
+static CheckoutResult storageFailure(int error) {
+    return error == SQLITE_BUSY || error == SQLITE_LOCKED ? CheckoutResult::Busy : CheckoutResult::StorageError;
+}
+
+// Sets exists to whether Books has isbn; false if the query failed.
+static bool bookExists(sqlite3* conn, const string& isbn, bool& exists) {
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(conn, "SELECT 1 FROM Books WHERE ISBN = ?;", -1, &stmt, nullptr) != SQLITE_OK) {
+        cerr << "Error preparing book lookup: " << sqlite3_errmsg(conn) << endl;
+        return false;
+    }
+    sqlite3_bind_text(stmt, 1, isbn.c_str(), -1, SQLITE_STATIC);
+    int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        cerr << "Error looking up book: " << sqlite3_errmsg(conn) << endl;
+    }
+    exists = rc == SQLITE_ROW;
+    sqlite3_finalize(stmt);
+    return rc == SQLITE_ROW || rc == SQLITE_DONE;
+}
+
+bool Library::borrowBook(const string& userID, const string& isbn, const string& branch, CheckoutResult* result) {
+    // Take a copy only if one is available; the WHERE clause makes the
+    // check and the decrement a single atomic step. Without a branch, the
+    // copies held by branches are not available.
+    const string updateSql = string(
+        "UPDATE Books SET AvailableCopies = AvailableCopies - 1, "
+        "BorrowedCount = BorrowedCount + 1 ") +
+        (branch.empty() ? "WHERE ISBN = ?1 AND AvailableCopies > "
+                          "(SELECT COALESCE(SUM(Copies), 0) FROM BranchCopies WHERE ISBN = ?1) "
+                        : "WHERE ISBN = ?1 AND AvailableCopies > 0 ") +
+        "RETURNING rowid, AvailableCopies;";
+
+    static OperationMetrics instruments("borrowBook");
+    OperationScope scope(instruments);
+    TraceSpan span("borrowBook");
+
+    CheckoutResult unused;
+    CheckoutResult& outcome = result ? *result : unused;
+    outcome = CheckoutResult::Ok;
+
+    int limit = 0;
+    if (!borrowPolicy.reserve(userID, limit)) {
+        outcome = CheckoutResult::AtLimit;
+        scope.markRejected();
+        progress() << "User " << userID << " already has " << limit << " books on loan, the limit for their type.\n";
+        return false;
+    }
+
+    int error = SQLITE_OK;
+    uint32_t bookId = 0;
+    int remainingCopies = 0;
+    bool committed = runWrite(isbn, [&](sqlite3* conn) {
+        auto failed = [&] {
+            outcome = storageFailure(sqlite3_errcode(conn));
+            return false;
+        };
+        bool matched = true;
+        if (!branch.empty() && !updateBranchCopies(conn, isbn, branch, -1, matched)) return failed();
+        if (matched && !updateCopies(conn, updateSql, isbn, matched, bookId, remainingCopies)) return failed();
+        if (!matched) {
+            // Tell a missing book from one with no copy to spare.
+            bool exists = false;
+            if (!bookExists(conn, isbn, exists)) return failed();
+            outcome = exists ? CheckoutResult::Unavailable : CheckoutResult::NotFound;
+            return false;
+        }
+        return logTransaction(conn, userID, isbn, "Borrow", branch) || failed();
+    }, &error);
+    if (!committed) {
+        borrowPolicy.release(userID);
+        if (outcome == CheckoutResult::Ok) outcome = storageFailure(error);
+        if (outcome == CheckoutResult::Unavailable) {
+            scope.markRejected();
+            progress() << "Book with ISBN " << isbn << " is not available for borrowing"
+                 << (branch.empty() ? "" : " at branch " + branch) << ".\n";
+        } else if (outcome == CheckoutResult::NotFound) {
+            scope.markRejected();
+            progress() << "Book with ISBN " << isbn << " not found.\n";
+        }
+        return false;
+    }
+
+    if (!branch.empty()) {
+        branchInventory.apply(isbn, {{branch, -1}});
+    }
+    borrowRanking.increment(isbn);
+    if (remainingCopies == 0) {
+        facetIndex.setAvailable(bookId, false);
+    }
+    bookCache.invalidate(isbn);
+    scope.markOk();
+    progress() << "Book " << isbn << " borrowed by user " << userID << ".\n";
+    return true;
+}
+
+bool Library::returnBook(const string& userID, const string& isbn, const string& branch, CheckoutResult* result) {
+    // A return must match an earlier borrow by the same user.
+    const string loansSql =
+        "SELECT COALESCE(SUM(CASE Action WHEN 'Borrow' THEN 1 WHEN 'Return' THEN -1 ELSE 0 END), 0) "
+        "FROM Transactions WHERE UserID = ? AND ISBN = ?;";
+    const string updateSql =
+        "UPDATE Books SET AvailableCopies = AvailableCopies + 1 "
+        "WHERE ISBN = ? "
+        "RETURNING rowid, AvailableCopies;";
+
+    static OperationMetrics instruments("returnBook");
+    OperationScope scope(instruments);
+
+    CheckoutResult unused;
+    CheckoutResult& outcome = result ? *result : unused;
+    outcome = CheckoutResult::Ok;
+
+    int error = SQLITE_OK;
+    uint32_t bookId = 0;
+    int remainingCopies = 0;
+    bool committed = runWrite(isbn, [&](sqlite3* conn) {
+        auto failed = [&] {
+            outcome = storageFailure(sqlite3_errcode(conn));
+            return false;
+        };
+        sqlite3_stmt* loansStmt = nullptr;
+        if (sqlite3_prepare_v2(conn, loansSql.c_str(), -1, &loansStmt, nullptr) != SQLITE_OK) {
+            cerr << "Error preparing loans statement: " << sqlite3_errmsg(conn) << endl;
+            return failed();
+        }
+        sqlite3_bind_text(loansStmt, 1, userID.c_str(), -1, SQLITE_STATIC);
+        sqlite3_bind_text(loansStmt, 2, isbn.c_str(), -1, SQLITE_STATIC);
+        int rc = sqlite3_step(loansStmt);
+        int loans = rc == SQLITE_ROW ? sqlite3_column_int(loansStmt, 0) : 0;
+        if (rc != SQLITE_ROW) {
+            cerr << "Error checking loans: " << sqlite3_errmsg(conn) << endl;
+            failed();
+        }
+        sqlite3_finalize(loansStmt);
+        if (rc != SQLITE_ROW) return false;
+
+        bool matched = false;
+        if (loans > 0 && !updateCopies(conn, updateSql, isbn, matched, bookId, remainingCopies)) return failed();
+        if (!matched) {
+            // No loan to return, or the book has left the catalog.
+            bool exists = false;
+            if (!bookExists(conn, isbn, exists)) return failed();
+            outcome = exists ? CheckoutResult::NoLoan : CheckoutResult::NotFound;
+            return false;
+        }
+        if (!branch.empty() && !updateBranchCopies(conn, isbn, branch, 1, matched)) return failed();
+        return logTransaction(conn, userID, isbn, "Return", branch) || failed();
+    }, &error);
+    if (!committed) {
+        if (outcome == CheckoutResult::Ok) outcome = storageFailure(error);
+        if (outcome == CheckoutResult::NoLoan) {
+            scope.markRejected();
+            progress() << "User " << userID << " has no outstanding loan of " << isbn << ".\n";
+        } else if (outcome == CheckoutResult::NotFound) {
+            scope.markRejected();
+            progress() << "Book with ISBN " << isbn << " not found.\n";
+        }
+        return false;
+    }
+
+    borrowPolicy.release(userID);
+    if (!branch.empty()) {
+        branchInventory.apply(isbn, {{branch, 1}});
+    }
+    if (remainingCopies == 1) {
+        facetIndex.setAvailable(bookId, true);
+    }
+    bookCache.invalidate(isbn);
+    scope.markOk();
+    progress() << "Book " << isbn << " returned by user " << userID << ".\n";
+    return true;
+}
+
+// Books.AvailableCopies does not change: the copies only change shelves.
+bool Library::transferCopies(const string& isbn, const string& from, const string& to, int copies) {
+    // Copies on the shelves that no branch holds.
+    const string poolSql =
+        "SELECT AvailableCopies - (SELECT COALESCE(SUM(Copies), 0) FROM BranchCopies WHERE ISBN = ?1) "
+        "FROM Books WHERE ISBN = ?1;";
+
+    static OperationMetrics instruments("transferCopies");
+    OperationScope scope(instruments);
+    TraceSpan span("transferCopies");
+    if (copies <= 0 || from == to) {
+        cerr << "Error: a transfer needs a positive number of copies and two different branches" << endl;
+        return false;
+    }
+
+    bool shortOfCopies = false;
+    bool committed = runWrite(isbn, [&](sqlite3* conn) {
+        bool matched = false;
+        if (from.empty()) {
+            sqlite3_stmt* stmt = nullptr;
+            if (sqlite3_prepare_v2(conn, poolSql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+                cerr << "Error preparing pool statement: " << sqlite3_errmsg(conn) << endl;
+                return false;
+            }
+            sqlite3_bind_text(stmt, 1, isbn.c_str(), -1, SQLITE_STATIC);
+            matched = sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_int(stmt, 0) >= copies;
+            sqlite3_finalize(stmt);
+        } else if (!updateBranchCopies(conn, isbn, from, -copies, matched)) {
+            return false;
+        }
+        shortOfCopies = !matched;
+        return matched && (to.empty() || updateBranchCopies(conn, isbn, to, copies, matched));
+    });
+    auto describe = [](const string& branch) { return branch.empty() ? string("the unassigned pool") : "branch " + branch; };
+    if (!committed) {
+        if (shortOfCopies) {
+            scope.markRejected();
+            progress() << describe(from) << " has fewer than " << copies << " copies of " << isbn << ".\n";
+        }
+        return false;
+    }
+
+    vector<pair<string, int>> deltas;
+    if (!from.empty()) deltas.emplace_back(from, -copies);
+    if (!to.empty()) deltas.emplace_back(to, copies);
+    branchInventory.apply(isbn, deltas);
+    scope.markOk();
+    progress() << "Moved " << copies << " copies of " << isbn << " from " << describe(from) << " to " << describe(to) << ".\n";
+    return true;
+}
+
+vector<pair<string, int>> Library::branchStock(const string& isbn) const {
+    return branchInventory.inStock(isbn);
+}
+
+// Non-negative integer cell; anything else (including trailing text) is rejected.
+static int parseCount(const string& text, const char* column) {
+    size_t used = 0;
+    long value = -1;
+    try {
+        value = stol(text, &used);
+    } catch (const logic_error&) {
+        used = 0;
+    }
+    if (text.empty() || used != text.size() || value < 0 || value > numeric_limits<int>::max()) {
+        throw invalid_argument(string("invalid ") + column + " '" + text + "'");
+    }
+    return static_cast<int>(value);
+}
+
+// Rows are inserted with one prepared statement in transactions of
+// kImportBatchRows, releasing writeMutex between batches so borrows are
+// not held up for the whole file. The in-memory indexes are updated only
+// for rows whose batch committed; the ranking catches up at the end.
+CsvImportReport Library::addBooksFromCSV(const string& filePath, const CsvImportOptions& options) {
+    static const size_t kImportBatchRows = 5000;
+    static OperationMetrics instruments("addBooksFromCSV");
+    static Counter& rowsOk = metrics().counter("library_csv_rows_total", "CSV rows processed by outcome.", "result=\"ok\"");
+    static Counter& rowsFailed = metrics().counter("library_csv_rows_total", "CSV rows processed by outcome.", "result=\"error\"");
+    OperationScope scope(instruments);
+    TraceSpan span("addBooksFromCSV");
+    CsvImportReport report;
+    if (shards) {
+        cerr << "Error: CSV imports write library.db; import before splitting it into shards" << endl;
+        ++report.errors;
+        return report;
+    }
+
+    ifstream file(filePath, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open file " << filePath << endl;
+        return report;
+    }
+
+    // Columns are located by header name, so their order in the file
+    // does not matter and extra columns are ignored.
+    CsvReader csv(file);
+    vector<string> fields;
+    BookCsvColumns columns;
+    string missing;
+    if (!csv.next(fields)) {
+        cerr << "Error: " << filePath << " is empty" << endl;
+        return report;
+    }
+    if (!columns.map(fields, missing)) {
+        cerr << "Error: " << filePath << " is missing column(s): " << missing << endl;
+        return report;
+    }
+
+    const string insertSql =
+        "INSERT INTO Books (ISBN, Title, Author, Genre, AvailableCopies, BorrowedCount, ContentHash) "
+        "VALUES (?, ?, ?, ?, ?, ?, ?) ON CONFLICT(ISBN) DO NOTHING;";
+    // Copies of a book out on loan, summed inside the batch transaction so
+    // borrows and returns that commit between batches are counted.
+    auto loansOf = [](const string& isbnParam) {
+        return "(SELECT COALESCE(SUM(CASE Action WHEN 'Borrow' THEN 1 WHEN 'Return' THEN -1 ELSE 0 END), 0) "
+               "FROM Transactions WHERE ISBN = " + isbnParam + ")";
+    };
+    // The feed counts every copy the library owns; AvailableCopies only
+    // the ones on a shelf, so copies out on loan are taken off. It never
+    // drops below what the branch shelves hold.
+    const string updateSql =
+        "UPDATE Books SET Title = ?1, Author = ?2, Genre = ?3, "
+        "AvailableCopies = MAX(?4 - " + loansOf("?7") + ", "
+        "(SELECT COALESCE(SUM(Copies), 0) FROM BranchCopies WHERE ISBN = ?7)), "
+        "BorrowedCount = COALESCE(?5, BorrowedCount), ContentHash = ?6 WHERE ISBN = ?7 "
+        "RETURNING rowid, Genre, AvailableCopies, BorrowedCount;";
+    // A book with copies still out is left alone: deleting it would strand
+    // those loans. sqlite3_changes() tells the two cases apart.
+    const string tombstoneSql[] = {
+        "DELETE FROM Books WHERE ISBN = ?1 AND " + loansOf("?1") + " <= 0 RETURNING rowid;",
+        "DELETE FROM BranchCopies WHERE ISBN = ?1;",
+        "INSERT OR REPLACE INTO BookTombstones (ISBN) VALUES (?1);"};
+    sqlite3_stmt* insertStmt = nullptr;
+    sqlite3_stmt* updateStmt = nullptr;
+    sqlite3_stmt* tombstoneStmt[3] = {nullptr, nullptr, nullptr};
+    auto finalizeAll = [&]() {
+        sqlite3_finalize(insertStmt);
+        sqlite3_finalize(updateStmt);
+        for (sqlite3_stmt* stmt : tombstoneStmt) sqlite3_finalize(stmt);
+    };
+    if (!options.validateOnly) {
+        bool prepared = sqlite3_prepare_v2(db, insertSql.c_str(), -1, &insertStmt, nullptr) == SQLITE_OK;
+        if (prepared && options.incremental) {
+            prepared = sqlite3_prepare_v2(db, updateSql.c_str(), -1, &updateStmt, nullptr) == SQLITE_OK;
+            for (size_t i = 0; prepared && i < 3; ++i) {
+                prepared = sqlite3_prepare_v2(db, tombstoneSql[i].c_str(), -1, &tombstoneStmt[i], nullptr) == SQLITE_OK;
+            }
+        }
+        if (!prepared) {
+            cerr << "Error preparing import statements: " << sqlite3_errmsg(db) << endl;
+            finalizeAll();
+            return report;
+        }
+    }
+
+    // Incremental mode compares against every stored hash, loaded in one
+    // scan. Entries are erased as their ISBN is seen, so what remains at
+    // the end is the set of books missing from the file.
+    unordered_map<string, optional<int64_t>> stored;
+    if (options.incremental && !options.validateOnly) {
+        TraceSpan loadSpan("csv.loadHashes");
+        sqlite3_stmt* stmt = nullptr;
+        if (sqlite3_prepare_v2(db, "SELECT ISBN, ContentHash FROM Books;", -1, &stmt, nullptr) != SQLITE_OK) {
+            cerr << "Error loading content hashes: " << sqlite3_errmsg(db) << endl;
+            finalizeAll();
+            return report;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            optional<int64_t> hash;
+            if (sqlite3_column_type(stmt, 1) != SQLITE_NULL) hash = sqlite3_column_int64(stmt, 1);
+            stored.emplace(columnString(stmt, 0), hash);
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    struct PendingBook {
+        uint32_t id;
+        string isbn;
+        string genre;
+        int copies;
+        int borrowed;
+    };
+    // An updated or tombstoned book, as the statement left it.
+    struct ChangedBook {
+        uint32_t id;
+        string isbn;
+        string genre;
+        int copies;
+        int borrowed;
+        bool rerank;  // BorrowedCount was rewritten from the feed
+        bool removed; // tombstoned
+    };
+    vector<PendingBook> pending;   // inserted in the open batch
+    vector<ChangedBook> changed;   // updated or tombstoned in the open batch
+    size_t batchUpdated = 0;
+    size_t batchTombstoned = 0;
+    size_t batchSkipped = 0;
+    unique_lock<mutex> guard(writeMutex, defer_lock);
+    bool inTransaction = false;
+    size_t batchRows = 0;
+
+    auto beginBatch = [&]() {
+        if (inTransaction) return;
+        guard.lock();
+        // IMMEDIATE takes the write lock up front, so loans summed inside
+        // the batch cannot be overtaken by another process's checkout.
+        if (sqlite3_exec(db, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            guard.unlock();
+            throw runtime_error(string("cannot start transaction: ") + sqlite3_errmsg(db));
+        }
+        inTransaction = true;
+    };
+
+    // Rows in the open batch, skipped ones included, count as ok only once
+    // it commits, and as errors if it is lost. The in-memory indexes are
+    // patched for just the books the batch touched, while writeMutex is
+    // still held, so no borrow can land between the commit and the patch
+    // or hit a book the ranking does not know yet.
+    auto closeBatch = [&](bool committed) {
+        if (committed) {
+            vector<pair<string, int>> ranked;
+            vector<string> unranked;
+            ranked.reserve(pending.size());
+            for (const PendingBook& book : pending) {
+                ranked.emplace_back(book.isbn, book.borrowed);
+                facetIndex.addBook(book.id, book.genre, book.copies);
+                bookCache.invalidate(book.isbn);
+            }
+            for (const ChangedBook& book : changed) {
+                bookCache.invalidate(book.isbn);
+                facetIndex.removeBook(book.id);
+                if (book.removed) {
+                    branchInventory.erase(book.isbn);
+                    unranked.push_back(book.isbn);
+                    continue;
+                }
+                facetIndex.addBook(book.id, book.genre, book.copies);
+                if (book.rerank) {
+                    unranked.push_back(book.isbn);
+                    ranked.emplace_back(book.isbn, book.borrowed);
+                }
+            }
+            borrowRanking.removeAll(unranked);
+            borrowRanking.addAll(move(ranked));
+            report.imported += pending.size();
+            report.updated += batchUpdated;
+            report.tombstoned += batchTombstoned;
+            report.skipped += batchSkipped;
+            rowsOk.inc(pending.size() + batchUpdated + batchSkipped);
+        } else {
+            report.errors += pending.size() + batchUpdated + batchTombstoned + batchSkipped;
+            rowsFailed.inc(pending.size() + batchUpdated + batchSkipped);
+        }
+        pending.clear();
+        changed.clear();
+        batchUpdated = 0;
+        batchTombstoned = 0;
+        batchSkipped = 0;
+        batchRows = 0;
+        inTransaction = false;
+        guard.unlock();
+    };
+
+    auto commitBatch = [&]() {
+        if (!inTransaction) return;
+        TraceSpan commitSpan("csv.commit");
+        closeBatch(finishTransaction(true));
+    };
+
+    // Some step errors (SQLITE_FULL, SQLITE_IOERR, ...) make SQLite roll
+    // back the whole transaction. Later rows would then autocommit one by
+    // one outside any batch, so drop the batch here and let the next row
+    // begin a new one.
+    auto abortIfRolledBack = [&]() {
+        if (!inTransaction || !sqlite3_get_autocommit(db)) return;
+        cerr << "SQLite rolled back the open batch; " << pending.size() + batchUpdated + batchTombstoned + batchSkipped
+             << " row(s) of it were lost\n";
+        closeBatch(false);
+    };
+
+    unordered_set<string> seen;
+    for (;;) {
+        TraceSpan parseSpan("csv.parse");
+        if (!csv.next(fields)) break;
+        parseSpan.end();
+
+        if (fields.size() == 1 && fields[0].empty()) continue; // blank line
+        ++report.rows;
+
+        try {
+            TraceSpan validateSpan("csv.validate");
+            if (fields.size() < columns.width) {
+                throw invalid_argument("expected " + to_string(columns.width) + " fields, found " + to_string(fields.size()));
+            }
+            const string& isbn = fields[columns.isbn];
+            if (isbn.empty()) {
+                throw invalid_argument("empty ISBN");
+            }
+            int copies = parseCount(fields[columns.availableCopies], "AvailableCopies");
+            bool hasBorrowed = columns.borrowedCount >= 0 && !fields[columns.borrowedCount].empty();
+            int borrowed = hasBorrowed ? parseCount(fields[columns.borrowedCount], "BorrowedCount") : 0;
+            if (!seen.insert(isbn).second) {
+                throw invalid_argument("duplicate ISBN " + isbn);
+            }
+            validateSpan.end();
+
+            if (options.validateOnly) {
+                rowsOk.inc();
+                continue;
+            }
+
+            const string& title = fields[columns.title];
+            const string& author = fields[columns.author];
+            const string& genre = fields[columns.genre];
+            int64_t hash = bookContentHash(title, author, genre, copies, borrowed);
+
+            auto existing = stored.find(isbn);
+            if (existing != stored.end()) {
+                bool same = existing->second == hash;
+                stored.erase(existing);
+                if (same) {
+                    ++report.unchanged;
+                    rowsOk.inc();
+                    continue;
+                }
+
+                beginBatch();
+                TraceSpan updateSpan("csv.update");
+                sqlite3_reset(updateStmt);
+                sqlite3_bind_text(updateStmt, 1, title.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_text(updateStmt, 2, author.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_text(updateStmt, 3, genre.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_int(updateStmt, 4, copies);
+                if (hasBorrowed) {
+                    sqlite3_bind_int(updateStmt, 5, borrowed);
+                } else {
+                    sqlite3_bind_null(updateStmt, 5);
+                }
+                sqlite3_bind_int64(updateStmt, 6, hash);
+                sqlite3_bind_text(updateStmt, 7, isbn.c_str(), -1, SQLITE_STATIC);
+                int rc = sqlite3_step(updateStmt);
+                if (rc == SQLITE_ROW) {
+                    const unsigned char* storedGenre = sqlite3_column_text(updateStmt, 1);
+                    changed.push_back({static_cast<uint32_t>(sqlite3_column_int64(updateStmt, 0)), isbn,
+                                       storedGenre ? reinterpret_cast<const char*>(storedGenre) : "",
+                                       sqlite3_column_int(updateStmt, 2), sqlite3_column_int(updateStmt, 3), hasBorrowed, false});
+                    rc = sqlite3_step(updateStmt);
+                }
+                if (rc != SQLITE_DONE) {
+                    throw runtime_error(sqlite3_errmsg(db));
+                }
+                ++batchUpdated;
+            } else {
+                beginBatch();
+                TraceSpan insertSpan("csv.insert");
+                sqlite3_reset(insertStmt);
+                sqlite3_bind_text(insertStmt, 1, isbn.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_text(insertStmt, 2, title.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_text(insertStmt, 3, author.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_text(insertStmt, 4, genre.c_str(), -1, SQLITE_STATIC);
+                sqlite3_bind_int(insertStmt, 5, copies);
+                sqlite3_bind_int(insertStmt, 6, borrowed);
+                sqlite3_bind_int64(insertStmt, 7, hash);
+                if (sqlite3_step(insertStmt) != SQLITE_DONE) {
+                    throw runtime_error(sqlite3_errmsg(db));
+                }
+                if (sqlite3_changes(db) > 0) {
+                    pending.push_back({static_cast<uint32_t>(sqlite3_last_insert_rowid(db)), isbn, genre, copies, borrowed});
+                } else {
+                    ++batchSkipped;
+                }
+            }
+            if (++batchRows >= kImportBatchRows) {
+                commitBatch();
+            }
+        } catch (const exception& e) {
+            ++report.errors;
+            rowsFailed.inc();
+            cerr << "Error processing line " << csv.line() << " of " << filePath << " (" << e.what() << ")\n";
+            abortIfRolledBack();
+        }
+    }
+
+    if (options.incremental && options.tombstoneMissing && !options.validateOnly) {
+        if (report.errors > 0) {
+            cerr << "Not tombstoning " << stored.size() << " missing book(s): " << report.errors << " row(s) of "
+                 << filePath << " failed\n";
+        } else {
+            TraceSpan tombstoneSpan("csv.tombstone");
+            for (const auto& entry : stored) {
+                try {
+                    beginBatch();
+                    bool kept = false;
+                    uint32_t id = 0;
+                    for (sqlite3_stmt* stmt : tombstoneStmt) {
+                        sqlite3_reset(stmt);
+                        sqlite3_bind_text(stmt, 1, entry.first.c_str(), -1, SQLITE_STATIC);
+                        int rc = sqlite3_step(stmt);
+                        if (rc == SQLITE_ROW) {
+                            id = static_cast<uint32_t>(sqlite3_column_int64(stmt, 0));
+                            rc = sqlite3_step(stmt);
+                        }
+                        if (rc != SQLITE_DONE) {
+                            throw runtime_error(sqlite3_errmsg(db));
+                        }
+                        // A later import tombstones it once every copy is back.
+                        if (stmt == tombstoneStmt[0] && sqlite3_changes(db) == 0) {
+                            kept = true;
+                            break;
+                        }
+                    }
+                    if (kept) {
+                        ++report.onLoan;
+                        cerr << "Not tombstoning ISBN " << entry.first << ": copies are still on loan\n";
+                        continue;
+                    }
+                    changed.push_back({id, entry.first, "", 0, 0, false, true});
+                    ++batchTombstoned;
+                    if (++batchRows >= kImportBatchRows) {
+                        commitBatch();
+                    }
+                } catch (const exception& e) {
+                    ++report.errors;
+                    cerr << "Error tombstoning ISBN " << entry.first << " (" << e.what() << ")\n";
+                    abortIfRolledBack();
+                }
+            }
+        }
+    }
+    commitBatch();
+    finalizeAll();
+
+    if (options.incremental && report.imported > 0) {
+        // A book that reappears in the feed is no longer tombstoned.
+        lock_guard<mutex> writeGuard(writeMutex);
+        sqlite3_exec(db, "DELETE FROM BookTombstones WHERE ISBN IN (SELECT ISBN FROM Books);", nullptr, nullptr, nullptr);
+    }
+
+    file.close();
+    scope.markOk();
+    if (options.validateOnly) {
+        cout << "Validated " << report.rows << " rows of " << filePath << ": " << report.errors << " error(s)\n";
+    } else if (options.incremental) {
+        cout << "Incremental import of " << filePath << ": " << report.imported << " added, " << report.updated
+             << " updated, " << report.unchanged << " unchanged, " << report.tombstoned << " tombstoned, "
+             << report.onLoan << " kept while on loan, " << report.errors << " error(s)\n";
+    } else {
+        cout << "Books added to the database from " << filePath << ": " << report.imported << " imported, "
+             << report.skipped << " already present, " << report.errors << " error(s)\n";
+    }
+    return report;
+}
+
+// Every row goes through one prepared upsert whose conflict clause
+// carries the duplicate policy, in transactions of kImportBatchRows that
+// release writeMutex between batches, as for books. In the report,
+// skipped counts rows left alone as duplicates and updated the ones
+// overwritten.
+CsvImportReport Library::addUsersFromCSV(const string& filePath, const UserImportOptions& options) {
+    static const size_t kImportBatchRows = 5000;
+    static OperationMetrics instruments("addUsersFromCSV");
+    static Counter& rowsOk =
+        metrics().counter("library_user_csv_rows_total", "User CSV rows processed by outcome.", "result=\"ok\"");
+    static Counter& rowsFailed =
+        metrics().counter("library_user_csv_rows_total", "User CSV rows processed by outcome.", "result=\"error\"");
+    OperationScope scope(instruments);
+    TraceSpan span("addUsersFromCSV");
+    CsvImportReport report;
+
+    ifstream file(filePath, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open file " << filePath << endl;
+        return report;
+    }
+
+    CsvReader csv(file);
+    vector<string> fields;
+    UserCsvColumns columns;
+    string missing;
+    if (!csv.next(fields)) {
+        cerr << "Error: " << filePath << " is empty" << endl;
+        return report;
+    }
+    if (!columns.map(fields, missing)) {
+        cerr << "Error: " << filePath << " is missing column(s): " << missing << endl;
+        return report;
+    }
+
+    string insertSql = "INSERT INTO Users (UserID, Name, UserType) VALUES (?, ?, ?)";
+    switch (options.onDuplicate) {
+    case DuplicateUserPolicy::Skip:
+        insertSql += " ON CONFLICT(UserID) DO NOTHING;";
+        break;
+    case DuplicateUserPolicy::Update:
+        // Rows that would not change anything count as skipped.
+        insertSql += " ON CONFLICT(UserID) DO UPDATE SET Name = excluded.Name, UserType = excluded.UserType "
+                     "WHERE Name IS NOT excluded.Name OR UserType IS NOT excluded.UserType;";
+        break;
+    case DuplicateUserPolicy::Fail:
+        insertSql += ";"; // a duplicate fails with SQLITE_CONSTRAINT, undoing only that row
+        break;
+    }
+    sqlite3_stmt* insertStmt = nullptr;
+    if (!options.validateOnly && sqlite3_prepare_v2(db, insertSql.c_str(), -1, &insertStmt, nullptr) != SQLITE_OK) {
+        cerr << "Error preparing user import statement: " << sqlite3_errmsg(db) << endl;
+        return report;
+    }
+
+    size_t batchInserted = 0;
+    size_t batchUpdated = 0;
+    size_t batchSkipped = 0;
+    size_t batchRows = 0;
+    vector<pair<string, string>> batchTypes; // inserted or updated in the open batch
+    unique_lock<mutex> guard(writeMutex, defer_lock);
+    bool inTransaction = false;
+
+    auto beginBatch = [&]() {
+        if (inTransaction) return;
+        guard.lock();
+        if (sqlite3_exec(db, "BEGIN;", nullptr, nullptr, nullptr) != SQLITE_OK) {
+            guard.unlock();
+            throw runtime_error(string("cannot start transaction: ") + sqlite3_errmsg(db));
+        }
+        inTransaction = true;
+    };
+
+    // Rows in the open batch, skipped ones included, count as ok only once
+    // it commits, and as errors if it is lost.
+    auto closeBatch = [&](bool committed) {
+        size_t written = batchInserted + batchUpdated + batchSkipped;
+        if (committed) {
+            for (const auto& user : batchTypes) borrowPolicy.setUserType(user.first, user.second);
+            report.imported += batchInserted;
+            report.updated += batchUpdated;
+            report.skipped += batchSkipped;
+            rowsOk.inc(written);
+        } else {
+            report.errors += written;
+            rowsFailed.inc(written);
+        }
+        batchInserted = 0;
+        batchUpdated = 0;
+        batchSkipped = 0;
+        batchRows = 0;
+        batchTypes.clear();
+        inTransaction = false;
+        guard.unlock();
+    };
+
+    auto commitBatch = [&]() {
+        if (!inTransaction) return;
+        TraceSpan commitSpan("csv.commit");
+        closeBatch(finishTransaction(true));
+    };
+
+    // As in addBooksFromCSV: a step error that made SQLite roll back the
+    // whole transaction takes the open batch with it.
+    auto abortIfRolledBack = [&]() {
+        if (!inTransaction || !sqlite3_get_autocommit(db)) return;
+        cerr << "SQLite rolled back the open batch; " << batchInserted + batchUpdated + batchSkipped
+             << " row(s) of it were lost\n";
+        closeBatch(false);
+    };
+
+    unordered_set<string> seen;
+    for (;;) {
+        TraceSpan parseSpan("csv.parse");
+        if (!csv.next(fields)) break;
+        parseSpan.end();
+
+        if (fields.size() == 1 && fields[0].empty()) continue; // blank line
+        ++report.rows;
+
+        try {
+            if (fields.size() < columns.width) {
+                throw invalid_argument("expected " + to_string(columns.width) + " fields, found " + to_string(fields.size()));
+            }
+            const string& userID = fields[columns.userID];
+            if (userID.empty()) {
+                throw invalid_argument("empty UserID");
+            }
+            if (!seen.insert(userID).second) {
+                throw invalid_argument("duplicate UserID " + userID);
+            }
+            if (options.validateOnly) {
+                rowsOk.inc();
+                continue;
+            }
+
+            beginBatch();
+            TraceSpan insertSpan("csv.insert");
+            sqlite3_reset(insertStmt);
+            sqlite3_bind_text(insertStmt, 1, userID.c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(insertStmt, 2, fields[columns.name].c_str(), -1, SQLITE_STATIC);
+            sqlite3_bind_text(insertStmt, 3, fields[columns.userType].c_str(), -1, SQLITE_STATIC);
+            // An upsert that updates leaves last_insert_rowid alone, and no
+            // inserted row has rowid 0, so this tells inserts from updates.
+            sqlite3_set_last_insert_rowid(db, 0);
+            int rc = sqlite3_step(insertStmt);
+            if (rc == SQLITE_CONSTRAINT && options.onDuplicate == DuplicateUserPolicy::Fail) {
+                throw invalid_argument("UserID " + userID + " already exists");
+            }
+            if (rc != SQLITE_DONE) {
+                throw runtime_error(sqlite3_errmsg(db));
+            }
+            if (sqlite3_changes(db) == 0) {
+                ++batchSkipped;
+            } else {
+                ++(sqlite3_last_insert_rowid(db) != 0 ? batchInserted : batchUpdated);
+                batchTypes.emplace_back(userID, fields[columns.userType]);
+            }
+            if (++batchRows >= kImportBatchRows) {
+                commitBatch();
+            }
+        } catch (const exception& e) {
+            ++report.errors;
+            rowsFailed.inc();
+            cerr << "Error processing line " << csv.line() << " of " << filePath << " (" << e.what() << ")\n";
+            abortIfRolledBack();
+        }
+    }
+    commitBatch();
+    sqlite3_finalize(insertStmt);
+
+    file.close();
+    scope.markOk();
+    if (options.validateOnly) {
+        cout << "Validated " << report.rows << " rows of " << filePath << ": " << report.errors << " error(s)\n";
+    } else {
+        cout << "Users added to the database from " << filePath << ": " << report.imported << " imported, "
+             << report.updated << " updated, " << report.skipped << " already present, " << report.errors
+             << " error(s)\n";
+    }
+    return report;
+}
+
+void Library::displayBooks() {
+    static OperationMetrics instruments("displayBooks");
+    OperationScope scope(instruments);
+
+    const string sql = "SELECT * FROM Books;";
+    sqlite3_stmt* stmt = nullptr;
+
+    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
+        cout << "\n=== Available Books ===\n";
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            string isbn = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+            string title = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
+            string author = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
+            string genre = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
+            int availableCopies = sqlite3_column_int(stmt, 4);
+            int borrowedCount = sqlite3_column_int(stmt, 5);
+
+            cout << "ISBN: " << isbn << ", Title: " << title
+                 << ", Author: " << author << ", Genre: " << genre
+                 << ", Available Copies: " << availableCopies
+                 << ", Times Borrowed: " << borrowedCount << endl;
+        }
+        sqlite3_finalize(stmt);
+        scope.markOk();
+    } else {
+        cerr << "Error querying books: " << sqlite3_errmsg(db) << endl;
+    }
+}
+
+// ================================
+// Thread Pool
+// ================================
+class ThreadPool {
+public:
+    explicit ThreadPool(size_t threads);
+    ~ThreadPool();
+    void submit(function<void()> task);
+    // Finishes every queued task and joins the workers. Safe to call twice.
+    void shutdown();
+
+private:
+    void workerLoop();
+
+    vector<thread> workers;
+    deque<function<void()>> tasks;
+    mutex lock;
+    condition_variable ready;
+    bool stopping = false;
+};
+
+ThreadPool::ThreadPool(size_t threads) {
+    for (size_t i = 0; i < max<size_t>(1, threads); ++i) {
+        workers.emplace_back(&ThreadPool::workerLoop, this);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    shutdown();
+}
+
+void ThreadPool::shutdown() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (thread& worker : workers) {
+        if (worker.joinable()) worker.join();
+    }
+}
+
+void ThreadPool::submit(function<void()> task) {
+    {
+        lock_guard<mutex> guard(lock);
+        tasks.push_back(move(task));
+    }
+    ready.notify_one();
+}
+
+void ThreadPool::workerLoop() {
+    for (;;) {
+        function<void()> task;
+        {
+            unique_lock<mutex> guard(lock);
+            ready.wait(guard, [this] { return stopping || !tasks.empty(); });
+            if (tasks.empty()) return;
+            task = move(tasks.front());
+            tasks.pop_front();
+        }
+        task();
+    }
+}
+
+// ================================
+// Async API (C++20 coroutines)
+// ================================
+// Awaitable wrappers around the blocking Library calls. Each call runs on
+// a dedicated database thread; the awaiting coroutine is suspended until
+// the result is ready and then resumed, either on the database thread or,
+// if one was supplied, on a separate pool so that continuation work does
+// not hold up the next query. Built only when compiling as C++20.
+#ifdef LIBRARY_HAVE_COROUTINES
+// Lazily started coroutine result. co_await it from another coroutine, or
+// call get() from ordinary code to run it and block for the value.
+template <typename T>
+class Task {
+public:
+    struct promise_type {
+        optional<T> value;
+        exception_ptr error;
+        coroutine_handle<> continuation;
+        function<void()> onDone; // used by get() when there is no continuation
+
+        Task get_return_object() { return Task(coroutine_handle<promise_type>::from_promise(*this)); }
+        suspend_always initial_suspend() noexcept { return {}; }
+
+        struct FinalAwaiter {
+            bool await_ready() noexcept { return false; }
+            coroutine_handle<> await_suspend(coroutine_handle<promise_type> handle) noexcept {
+                promise_type& promise = handle.promise();
+                if (promise.continuation) return promise.continuation;
+                if (promise.onDone) promise.onDone();
+                return noop_coroutine();
+            }
+            void await_resume() noexcept {}
+        };
+        FinalAwaiter final_suspend() noexcept { return {}; }
+
+        void return_value(T result) { value = move(result); }
+        void unhandled_exception() { error = current_exception(); }
+    };
+
+    Task(Task&& other) noexcept : handle(exchange(other.handle, nullptr)) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() {
+        if (handle) handle.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    coroutine_handle<> await_suspend(coroutine_handle<> caller) noexcept {
+        handle.promise().continuation = caller;
+        return handle;
+    }
+    T await_resume() { return take(); }
+
+    T get() {
+        mutex lock;
+        condition_variable finished;
+        bool done = false;
+        handle.promise().onDone = [&] {
+            lock_guard<mutex> guard(lock);
+            done = true;
+            finished.notify_all();
+        };
+        handle.resume();
+        unique_lock<mutex> guard(lock);
+        finished.wait(guard, [&] { return done; });
+        return take();
+    }
+
+private:
+    explicit Task(coroutine_handle<promise_type> handle) : handle(handle) {}
+
+    T take() {
+        promise_type& promise = handle.promise();
+        if (promise.error) rethrow_exception(promise.error);
+        return move(*promise.value);
+    }
+
+    coroutine_handle<promise_type> handle;
+};
+
+class AsyncLibrary {
+public:
+    // resumeOn: pool to resume awaiting coroutines on; nullptr resumes them
+    // on the database thread.
+    explicit AsyncLibrary(Library& library, ThreadPool* resumeOn = nullptr)
+        : library(library), resumeOn(resumeOn), dbExecutor(1) {}
+
+    template <typename T>
+    class Call {
+    public:
+        Call(AsyncLibrary& owner, function<T()> work) : owner(owner), work(move(work)) {}
+
+        bool await_ready() const noexcept { return false; }
+        void await_suspend(coroutine_handle<> caller) {
+            owner.dbExecutor.submit([this, caller] {
+                try {
+                    result = work();
+                } catch (...) {
+                    error = current_exception();
+                }
+                owner.resume(caller);
+            });
+        }
+        T await_resume() {
+            if (error) rethrow_exception(error);
+            return move(*result);
+        }
+
+    private:
+        AsyncLibrary& owner;
+        function<T()> work;
+        optional<T> result;
+        exception_ptr error;
+    };
+
+    Call<bool> addBook(string title, string author, string genre, string isbn, int copies) {
+        return Call<bool>(*this, [=, this] { return library.addBook(title, author, genre, isbn, copies); });
+    }
+    Call<bool> borrowBook(string userID, string isbn) {
+        return Call<bool>(*this, [=, this] { return library.borrowBook(userID, isbn); });
+    }
+    Call<bool> returnBook(string userID, string isbn) {
+        return Call<bool>(*this, [=, this] { return library.returnBook(userID, isbn); });
+    }
+    Call<optional<Book>> findBook(string isbn) {
+        return Call<optional<Book>>(*this, [=, this]() -> optional<Book> {
+            Book book;
+            if (!library.findBook(isbn, book)) return nullopt;
+            return book;
+        });
+    }
+    Call<vector<Book>> searchBooks(string text, string genre, int limit) {
+        return Call<vector<Book>>(*this, [=, this] { return library.searchBooks(text, genre, limit); });
+    }
+
+private:
+    void resume(coroutine_handle<> caller) {
+        if (resumeOn) {
+            resumeOn->submit([caller] { caller.resume(); });
+        } else {
+            caller.resume();
+        }
+    }
+
+    Library& library;
+    ThreadPool* resumeOn;
+    ThreadPool dbExecutor; // declared last so it drains before the rest goes away
+};
+#endif
+
+// ================================
+// JSON Helpers
+// ================================
+string jsonEscape(string_view text) {
+    string out;
+    out.reserve(text.size() + 2);
+    for (char c : text) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\b': out += "\\b"; break;
+            case '\f': out += "\\f"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buffer[8];
+                    snprintf(buffer, sizeof(buffer), "\\u%04x", static_cast<unsigned char>(c));
+                    out += buffer;
+                } else {
+                    out += c;
+                }
+        }
+    }
+    return out;
+}
+
+string bookToJson(const Book& book) {
+    return "{\"isbn\":\"" + jsonEscape(book.isbn) +
+           "\",\"title\":\"" + jsonEscape(book.title) +
+           "\",\"author\":\"" + jsonEscape(book.author) +
+           "\",\"genre\":\"" + jsonEscape(book.genre) +
+           "\",\"availableCopies\":" + to_string(book.availableCopies) +
+           ",\"borrowedCount\":" + to_string(book.borrowedCount) + "}";
+}
+
+// ================================
+// Latency Histogram
+// ================================
+// HdrHistogram-style log-linear histogram of nanosecond latencies. Values
+// below 256 get exact buckets; above that each power of two is split into
+// 128 sub-buckets, so any recorded value is reported within ~0.8%.
+class LatencyHistogram {
+public:
+    LatencyHistogram() : counts(kBucketCount, 0) {}
+
+    void record(uint64_t nanos);
+    void merge(const LatencyHistogram& other);
+    uint64_t count() const { return total; }
+    uint64_t max() const { return maxValue; }
+    double mean() const { return total ? static_cast<double>(sum) / total : 0.0; }
+    // Smallest recorded value v such that fraction q of samples are <= v.
+    uint64_t percentile(double q) const;
+    // Percentile table in the layout of HdrHistogram's text output.
+    void printDistribution(ostream& out, double unitNanos, const char* unitName) const;
+
+private:
+    static constexpr int kSubBucketBits = 7;
+    static constexpr uint64_t kSubBuckets = uint64_t(1) << kSubBucketBits; // 128
+    static constexpr int kMaxShift = 40;
+    static constexpr size_t kBucketCount = (kMaxShift + 2) * kSubBuckets;
+
+    static size_t indexFor(uint64_t value);
+    static uint64_t highestValueAt(size_t index);
+
+    vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t maxValue = 0;
+};
+
+size_t LatencyHistogram::indexFor(uint64_t value) {
+    if (value < 2 * kSubBuckets) return static_cast<size_t>(value);
+    int msb = highestBit64(value);
+    int shift = min(msb - kSubBucketBits, kMaxShift);
+    uint64_t sub = min(value >> shift, 2 * kSubBuckets - 1);
+    return static_cast<size_t>((shift + 1) * kSubBuckets + (sub - kSubBuckets));
+}
+
+uint64_t LatencyHistogram::highestValueAt(size_t index) {
+    if (index < 2 * kSubBuckets) return index;
+    uint64_t shift = index / kSubBuckets - 1;
+    uint64_t sub = index % kSubBuckets + kSubBuckets;
+    return ((sub + 1) << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t nanos) {
+    ++counts[indexFor(nanos)];
+    ++total;
+    sum += nanos;
+    maxValue = std::max(maxValue, nanos);
+}
+
+void LatencyHistogram::merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < kBucketCount; ++i) counts[i] += other.counts[i];
+    total += other.total;
+    sum += other.sum;
+    maxValue = std::max(maxValue, other.maxValue);
+}
+
+uint64_t LatencyHistogram::percentile(double q) const {
+    if (total == 0) return 0;
+    uint64_t rank = static_cast<uint64_t>(ceil(q * static_cast<double>(total)));
+    rank = std::max<uint64_t>(1, std::min(rank, total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kBucketCount; ++i) {
+        seen += counts[i];
+        if (seen >= rank) return std::min(highestValueAt(i), maxValue);
+    }
+    return maxValue;
+}
+
+void LatencyHistogram::printDistribution(ostream& out, double unitNanos, const char* unitName) const {
+    static const double quantiles[] = {0.0, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 0.9999, 1.0};
+    char line[128];
+    snprintf(line, sizeof(line), "%14s %12s %12s %14s\n", unitName, "Percentile", "TotalCount", "1/(1-Percentile)");
+    out << line;
+    for (double q : quantiles) {
+        uint64_t value = percentile(q);
+        uint64_t below = 0;
+        for (size_t i = 0; i <= indexFor(value) && i < kBucketCount; ++i) below += counts[i];
+        if (q < 1.0) {
+            snprintf(line, sizeof(line), "%14.3f %12.6f %12llu %14.2f\n", value / unitNanos, q,
+                     static_cast<unsigned long long>(below), 1.0 / (1.0 - q));
+        } else {
+            snprintf(line, sizeof(line), "%14.3f %12.6f %12llu %14s\n", value / unitNanos, q,
+                     static_cast<unsigned long long>(below), "inf");
+        }
+        out << line;
+    }
+    snprintf(line, sizeof(line), "#[Mean = %.3f, Max = %.3f, Total count = %llu]\n", mean() / unitNanos,
+             maxValue / unitNanos, static_cast<unsigned long long>(total));
+    out << line;
+}
+
+// ================================
+// Online Backup
+// ================================
+// Copies the live database with sqlite3_backup_step on a background
+// thread, pagesPerStep pages at a time with a pause between steps. Each
+// step holds the source connection only briefly, so checkouts keep being
+// served; the step latency histogram is the bound on how long one of
+// them can be held up. The main connection is the source: writes it makes
+// mid-backup are applied to the copy instead of restarting it. The copy
+// is written to destination.tmp and renamed when complete.
+struct BackupOptions {
+    int pagesPerStep = 256;
+    int sleepMs = 5;
+};
+
+struct BackupReport {
+    string destination;
+    bool running = false;
+    bool ok = false;
+    string error;
+    int totalPages = 0;
+    int remainingPages = 0;
+    int pageSize = 0;
+    uint64_t steps = 0;
+    uint64_t retries = 0; // steps that found the source busy or locked
+    double seconds = 0;
+    LatencyHistogram stepLatency;
+};
+
+class OnlineBackup {
+public:
+    ~OnlineBackup();
+    // Start copying source to destination. False if a backup is running.
+    bool start(sqlite3* source, const string& destination, const BackupOptions& options);
+    // Block until the running backup, if any, has finished.
+    void wait();
+    BackupReport report() const;
+
+private:
+    void run(sqlite3* source, string destination, BackupOptions options);
+
+    mutable mutex lock;
+    BackupReport current;
+    thread worker;
+};
+
+OnlineBackup& onlineBackup() {
+    static OnlineBackup instance;
+    return instance;
+}
+
+OnlineBackup::~OnlineBackup() {
+    wait();
+}
+
+bool OnlineBackup::start(sqlite3* source, const string& destination, const BackupOptions& options) {
+    lock_guard<mutex> guard(lock);
+    if (current.running) {
+        return false;
+    }
+    if (worker.joinable()) {
+        worker.join();
+    }
+    current = BackupReport();
+    current.destination = destination;
+    current.running = true;
+    worker = thread(&OnlineBackup::run, this, source, destination, options);
+    return true;
+}
+
+void OnlineBackup::wait() {
+    thread finished;
+    {
+        lock_guard<mutex> guard(lock);
+        finished = move(worker);
+    }
+    if (finished.joinable()) {
+        finished.join();
+    }
+}
+
+BackupReport OnlineBackup::report() const {
+    lock_guard<mutex> guard(lock);
+    return current;
+}
+
+void OnlineBackup::run(sqlite3* source, string destination, BackupOptions options) {
+    static Counter& pagesCopied = metrics().counter("library_backup_pages_total", "Pages copied by online backups.");
+    static Histogram& stepDuration =
+        metrics().histogram("library_backup_step_duration_seconds", "Time the source is held per backup step.");
+    static Gauge& running = metrics().gauge("library_backup_running", "1 while an online backup is in progress.");
+    static OperationMetrics instruments("onlineBackup");
+    OperationScope scope(instruments);
+    TraceSpan span("onlineBackup");
+    running.set(1);
+
+    auto start = chrono::steady_clock::now();
+    const string tempPath = destination + ".tmp";
+    remove(tempPath.c_str());
+    sqlite3* target = nullptr;
+    sqlite3_backup* backup = nullptr;
+    string error;
+    if (sqlite3_open(tempPath.c_str(), &target) != SQLITE_OK) {
+        error = sqlite3_errmsg(target);
+    } else if (!(backup = sqlite3_backup_init(target, "main", source, "main"))) {
+        error = sqlite3_errmsg(target);
+    }
+
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(source, "PRAGMA page_size;", -1, &stmt, nullptr) == SQLITE_OK) {
+        if (sqlite3_step(stmt) == SQLITE_ROW) {
+            lock_guard<mutex> guard(lock);
+            current.pageSize = sqlite3_column_int(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+    }
+
+    int rc = SQLITE_OK;
+    int previousRemaining = -1;
+    while (backup) {
+        auto stepStart = chrono::steady_clock::now();
+        rc = sqlite3_backup_step(backup, options.pagesPerStep);
+        uint64_t nanos = static_cast<uint64_t>(
+            chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - stepStart).count());
+        stepDuration.observe(nanos);
+
+        int remaining = sqlite3_backup_remaining(backup);
+        int total = sqlite3_backup_pagecount(backup);
+        {
+            lock_guard<mutex> guard(lock);
+            ++current.steps;
+            current.stepLatency.record(nanos);
+            current.totalPages = total;
+            current.remainingPages = remaining;
+            current.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            if (rc == SQLITE_BUSY || rc == SQLITE_LOCKED) ++current.retries;
+        }
+        int before = previousRemaining < 0 ? total : previousRemaining;
+        if (before > remaining) {
+            pagesCopied.inc(static_cast<uint64_t>(before - remaining));
+        }
+        previousRemaining = remaining;
+
+        if (rc == SQLITE_DONE) {
+            break;
+        }
+        if (rc != SQLITE_OK && rc != SQLITE_BUSY && rc != SQLITE_LOCKED) {
+            error = sqlite3_errstr(rc);
+            break;
+        }
+        this_thread::sleep_for(chrono::milliseconds(options.sleepMs));
+    }
+    if (backup && sqlite3_backup_finish(backup) != SQLITE_OK && error.empty()) {
+        error = sqlite3_errmsg(target);
+    }
+
+    sqlite3_close(target);
+    if (error.empty() && rename(tempPath.c_str(), destination.c_str()) != 0) {
+        error = "cannot rename " + tempPath + " to " + destination;
+    }
+    if (!error.empty()) {
+        remove(tempPath.c_str());
+        cerr << "Error backing up database to " << destination << ": " << error << endl;
+    } else {
+        scope.markOk();
+    }
+
+    running.set(0);
+    lock_guard<mutex> guard(lock);
+    current.running = false;
+    current.ok = error.empty();
+    current.error = error;
+    current.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+static void printBackupReport(ostream& out, const BackupReport& report) {
+    double megabytes = static_cast<double>(report.totalPages) * report.pageSize / (1 << 20);
+    out << "Backup to " << report.destination << (report.ok ? " completed" : " failed") << ": " << report.totalPages
+        << " pages (" << megabytes << " MB) in " << report.seconds << " s, "
+        << megabytes / max(report.seconds, 1e-9) << " MB/s\n";
+    out << "  " << report.steps << " steps, " << report.retries << " retried while the source was busy\n";
+    out << "  source held per step: p50 " << report.stepLatency.percentile(0.5) / 1e6 << " ms, p99 "
+        << report.stepLatency.percentile(0.99) / 1e6 << " ms, max " << report.stepLatency.max() / 1e6 << " ms\n";
+}
+
+static string backupReportJson(const BackupReport& report) {
+    return "{\"destination\":\"" + jsonEscape(report.destination) + "\",\"running\":" +
+           (report.running ? "true" : "false") + ",\"ok\":" + (report.ok ? "true" : "false") +
+           ",\"error\":\"" + jsonEscape(report.error) + "\",\"totalPages\":" + to_string(report.totalPages) +
+           ",\"remainingPages\":" + to_string(report.remainingPages) + ",\"pageSize\":" +
+           to_string(report.pageSize) + ",\"steps\":" + to_string(report.steps) + ",\"retries\":" +
+           to_string(report.retries) + ",\"seconds\":" + to_string(report.seconds) + ",\"stepP50Ms\":" +
+           to_string(report.stepLatency.percentile(0.5) / 1e6) + ",\"stepP99Ms\":" +
+           to_string(report.stepLatency.percentile(0.99) / 1e6) + ",\"stepMaxMs\":" +
+           to_string(report.stepLatency.max() / 1e6) + "}";
+}
+
+// ================================
+// HTTP Service
+// ================================
+// Routes (responses are JSON; parameters come from the query string or an
+// application/x-www-form-urlencoded body):
+//   GET  /books/{isbn}                 look up one book
+//   GET  /books?q=&genre=&limit=       search by title/author and genre
+//   GET  /popular?k=                   most-borrowed books
+//   GET  /metrics                      Prometheus text exposition
+//   GET  /queries                      per-statement SQLite timings
+//   GET  /trace                        Chrome trace-event JSON (if tracing)
+//   GET  /changes?after=&limit=        change feed entries after a sequence
+//   GET  /backup                       progress or result of the last backup
+//   POST /backup?pages=&sleepMs=       start an online backup to library.db.bak
+//   POST /users?id=&name=&type=        add a user
+//   GET  /books/{isbn}/branches        copies on the shelf at each branch
+//   POST /books/{isbn}/borrow?user=&branch=   borrow a copy (branch optional)
+//   POST /books/{isbn}/return?user=&branch=   return a copy (branch optional)
+//   POST /books/{isbn}/transfer?from=&to=&copies=
+//                                      move copies between branches; an
+//                                      empty from/to is the unassigned pool
+struct HttpRequest {
+    string method;
+    string path;
+    map<string, string> params;
+    bool keepAlive = true;
+};
+
+struct HttpResponse {
+    int status = 200;
+    string body;
+    string contentType = "application/json";
+};
+
+static string urlDecode(string_view text) {
+    string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] == '+') {
+            out += ' ';
+        } else if (text[i] == '%' && i + 2 < text.size() && isxdigit(static_cast<unsigned char>(text[i + 1])) &&
+                   isxdigit(static_cast<unsigned char>(text[i + 2]))) {
+            out += static_cast<char>(stoi(string(text.substr(i + 1, 2)), nullptr, 16));
+            i += 2;
+        } else {
+            out += text[i];
+        }
+    }
+    return out;
+}
+
+static void parseParams(string_view text, map<string, string>& params) {
+    while (!text.empty()) {
+        size_t amp = text.find('&');
+        string_view pair = text.substr(0, amp);
+        size_t eq = pair.find('=');
+        if (!pair.empty()) {
+            params[urlDecode(pair.substr(0, eq))] = eq == string_view::npos ? "" : urlDecode(pair.substr(eq + 1));
+        }
+        if (amp == string_view::npos) break;
+        text.remove_prefix(amp + 1);
+    }
+}
+
+static string paramOr(const HttpRequest& request, const string& name, const string& fallback) {
+    auto it = request.params.find(name);
+    return it == request.params.end() ? fallback : it->second;
+}
+
+static HttpResponse jsonError(int status, const string& message) {
+    return {status, "{\"error\":\"" + jsonEscape(message) + "\"}", "application/json"};
+}
+
+HttpResponse handleHttpRequest(Library& library, const HttpRequest& request) {
+    const string& path = request.path;
+
+    if (request.method == "GET" && path == "/books") {
+        int limit = 50;
+        try {
+            limit = stoi(paramOr(request, "limit", "50"));
+        } catch (const exception&) {
+            return jsonError(400, "limit must be an integer");
+        }
+        vector<Book> books = library.searchBooks(paramOr(request, "q", ""), paramOr(request, "genre", ""), limit);
+        string body = "{\"books\":[";
+        for (size_t i = 0; i < books.size(); ++i) {
+            if (i) body += ',';
+            body += bookToJson(books[i]);
+        }
+        return {200, body + "]}"};
+    }
+
+    if (request.method == "GET" && path == "/metrics") {
+        return {200, metrics().prometheusText(), "text/plain; version=0.0.4"};
+    }
+
+    if (request.method == "GET" && path == "/trace") {
+        return {200, tracer().chromeTraceJson()};
+    }
+
+    if (path == "/backup" && (request.method == "GET" || request.method == "POST")) {
+        if (request.method == "POST") {
+            BackupOptions options;
+            try {
+                options.pagesPerStep = stoi(paramOr(request, "pages", "256"));
+                options.sleepMs = stoi(paramOr(request, "sleepMs", "5"));
+            } catch (const exception&) {
+                return jsonError(400, "pages and sleepMs must be integers");
+            }
+            if (options.pagesPerStep == 0 || options.sleepMs < 0) {
+                return jsonError(400, "pages must be non-zero and sleepMs non-negative");
+            }
+            if (!onlineBackup().start(db, string(databasePath) + ".bak", options)) {
+                return jsonError(409, "a backup is already running");
+            }
+            return {202, backupReportJson(onlineBackup().report())};
+        }
+        return {200, backupReportJson(onlineBackup().report())};
+    }
+
+    if (request.method == "GET" && path == "/changes") {
+        uint64_t after = 0;
+        size_t limit = 1000;
+        try {
+            after = stoull(paramOr(request, "after", "0"));
+            limit = min<size_t>(stoul(paramOr(request, "limit", "1000")), 10000);
+        } catch (const exception&) {
+            return jsonError(400, "after and limit must be integers");
+        }
+        bool gap = false;
+        vector<ChangeEvent> changes = changeFeed().since(after, limit, gap);
+        uint64_t last = changes.empty() ? changeFeed().lastSequence() : changes.back().sequence;
+        string body = "{\"last\":" + to_string(last) + ",\"gap\":" + (gap ? "true" : "false") + ",\"changes\":[";
+        for (size_t i = 0; i < changes.size(); ++i) {
+            if (i) body += ',';
+            body += changes[i].json;
+        }
+        return {200, body + "]}"};
+    }
+
+    if (request.method == "GET" && path == "/queries") {
+        string body = "{\"statements\":[";
+        vector<QueryStats> stats = queryProfiler().snapshot();
+        for (size_t i = 0; i < stats.size(); ++i) {
+            if (i) body += ',';
+            body += "{\"sql\":\"" + jsonEscape(stats[i].sql) + "\",\"calls\":" + to_string(stats[i].calls) +
+                    ",\"totalMs\":" + to_string(stats[i].totalNanos / 1e6) +
+                    ",\"maxMs\":" + to_string(stats[i].maxNanos / 1e6) + "}";
+        }
+        return {200, body + "]}"};
+    }
+
+    if (request.method == "GET" && path == "/popular") {
+        size_t k = 10;
+        try {
+            k = static_cast<size_t>(stoul(paramOr(request, "k", "10")));
+        } catch (const exception&) {
+            return jsonError(400, "k must be an integer");
+        }
+        string body = "{\"books\":[";
+        bool first = true;
+        for (const auto& entry : library.topBorrowed(k)) {
+            if (!first) body += ',';
+            first = false;
+            body += "{\"isbn\":\"" + jsonEscape(entry.first) + "\",\"borrowedCount\":" + to_string(entry.second) + "}";
+        }
+        return {200, body + "]}"};
+    }
+
+    if (request.method == "POST" && path == "/users") {
+        string id = paramOr(request, "id", "");
+        if (id.empty()) {
+            return jsonError(400, "id is required");
+        }
+        if (!library.addUser(paramOr(request, "name", ""), id, paramOr(request, "type", ""))) {
+            return jsonError(409, "user already exists");
+        }
+        return {201, "{\"id\":\"" + jsonEscape(id) + "\"}"};
+    }
+
+    const string prefix = "/books/";
+    if (path.compare(0, prefix.size(), prefix) != 0 || path.size() == prefix.size()) {
+        return jsonError(404, "no such route");
+    }
+    string rest = path.substr(prefix.size());
+    size_t slash = rest.find('/');
+    string isbn = urlDecode(rest.substr(0, slash));
+    string action = slash == string::npos ? "" : rest.substr(slash + 1);
+
+    if (request.method == "GET" && action.empty()) {
+        Book book;
+        if (!library.findBook(isbn, book)) {
+            return jsonError(404, "book not found");
+        }
+        return {200, bookToJson(book)};
+    }
+
+    auto branchesJson = [&library, &isbn]() {
+        string body = "{\"isbn\":\"" + jsonEscape(isbn) + "\",\"branches\":[";
+        bool first = true;
+        for (const auto& entry : library.branchStock(isbn)) {
+            if (!first) body += ',';
+            first = false;
+            body += "{\"branch\":\"" + jsonEscape(entry.first) + "\",\"copies\":" + to_string(entry.second) + "}";
+        }
+        return body + "]}";
+    };
+
+    if (request.method == "GET" && action == "branches") {
+        return {200, branchesJson()};
+    }
+
+    if (request.method == "POST" && (action == "borrow" || action == "return")) {
+        string user = paramOr(request, "user", "");
+        string branch = paramOr(request, "branch", "");
+        if (user.empty()) {
+            return jsonError(400, "user is required");
+        }
+        CheckoutResult result = CheckoutResult::Ok;
+        bool ok = action == "borrow" ? library.borrowBook(user, isbn, branch, &result)
+                                     : library.returnBook(user, isbn, branch, &result);
+        if (!ok) {
+            switch (result) {
+            case CheckoutResult::NotFound: return jsonError(404, "book not found");
+            case CheckoutResult::Unavailable:
+                return jsonError(409, branch.empty() ? "no copies available" : "no copies available at " + branch);
+            case CheckoutResult::AtLimit: return jsonError(409, "borrowing limit reached");
+            case CheckoutResult::NoLoan: return jsonError(409, "no outstanding loan");
+            case CheckoutResult::Busy: return jsonError(503, "database is busy, try again");
+            default: return jsonError(500, "storage error");
+            }
+        }
+        Book book;
+        if (!library.findBook(isbn, book)) {
+            return jsonError(404, "book not found");
+        }
+        return {200, bookToJson(book)};
+    }
+
+    if (request.method == "POST" && action == "transfer") {
+        int copies = 0;
+        try {
+            copies = stoi(paramOr(request, "copies", "1"));
+        } catch (const exception&) {
+            return jsonError(400, "copies must be an integer");
+        }
+        string from = paramOr(request, "from", "");
+        string to = paramOr(request, "to", "");
+        if (copies <= 0 || from == to) {
+            return jsonError(400, "copies must be positive and from and to must differ");
+        }
+        if (!library.transferCopies(isbn, from, to, copies)) {
+            Book book;
+            return library.findBook(isbn, book) ? jsonError(409, "not enough copies at the source")
+                                                : jsonError(404, "book not found");
+        }
+        return {200, branchesJson()};
+    }
+
+    return jsonError(405, "method not allowed");
+}
+
+#ifdef LIBRARY_HAVE_EPOLL
+// Single-threaded epoll loop for all socket I/O; requests are parsed on
+// the loop and handed to a worker pool, which does the SQLite work and
+// passes the finished response back through an eventfd. Each connection
+// has at most one request in flight, so responses stay in order.
+class HttpServer {
+public:
+    HttpServer(Library& library, uint16_t port, size_t workers);
+    ~HttpServer();
+    bool run();
+    void stop();
+
+private:
+    struct Connection {
+        int fd = -1;
+        string in;
+        string out;
+        bool busy = false;
+        bool closeAfterWrite = false;
+        bool wantWrite = false;
+    };
+
+    struct Completion {
+        uint64_t id;
+        string response;
+        bool close;
+    };
+
+    static constexpr uint64_t kListenId = 0;
+    static constexpr uint64_t kWakeId = 1;
+    static constexpr size_t kMaxRequestBytes = 1 << 20;
+
+    void acceptClients();
+    void readClient(uint64_t id);
+    void writeClient(uint64_t id);
+    void dispatch(uint64_t id);
+    void drainCompletions();
+    void closeClient(uint64_t id);
+    void watch(uint64_t id, Connection& conn, bool wantWrite);
+    static string formatResponse(const HttpResponse& response, bool keepAlive);
+
+    Library& library;
+    uint16_t port;
+    int listenFd = -1;
+    int epollFd = -1;
+    int wakeFd = -1;
+    atomic<bool> stopping{false};
+    uint64_t nextId = 2;
+    unordered_map<uint64_t, Connection> connections;
+    mutex completionLock;
+    vector<Completion> completions;
+    ThreadPool pool;
+};
+
+HttpServer::HttpServer(Library& library, uint16_t port, size_t workers)
+    : library(library), port(port), pool(workers) {}
+
+HttpServer::~HttpServer() {
+    // Members are destroyed only after this body runs, so stop the workers
+    // here: a task still in flight writes to wakeFd and the completion list.
+    pool.shutdown();
+    for (auto& entry : connections) {
+        close(entry.second.fd);
+    }
+    if (listenFd >= 0) close(listenFd);
+    if (epollFd >= 0) close(epollFd);
+    if (wakeFd >= 0) close(wakeFd);
+}
+
+void HttpServer::stop() {
+    stopping = true;
+    uint64_t one = 1;
+    if (write(wakeFd, &one, sizeof(one)) < 0) {
+        // The loop also checks the flag on its next wakeup.
+    }
+}
+
+bool HttpServer::run() {
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (listenFd < 0 || epollFd < 0 || wakeFd < 0) {
+        cerr << "Error creating server sockets: " << strerror(errno) << endl;
+        return false;
+    }
+
+    int reuse = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || listen(listenFd, SOMAXCONN) < 0) {
+        cerr << "Error listening on port " << port << ": " << strerror(errno) << endl;
+        return false;
+    }
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = kListenId;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+    ev.data.u64 = kWakeId;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+
+    cout << "Listening on http://127.0.0.1:" << port << "\n";
+
+    epoll_event events[256];
+    while (!stopping) {
+        int n = epoll_wait(epollFd, events, 256, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            cerr << "Error waiting for events: " << strerror(errno) << endl;
+            return false;
+        }
+        for (int i = 0; i < n; ++i) {
+            uint64_t id = events[i].data.u64;
+            if (id == kListenId) {
+                acceptClients();
+            } else if (id == kWakeId) {
+                uint64_t count;
+                while (read(wakeFd, &count, sizeof(count)) > 0) {}
+                drainCompletions();
+            } else {
+                if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                    closeClient(id);
+                    continue;
+                }
+                if (events[i].events & EPOLLIN) readClient(id);
+                if ((events[i].events & EPOLLOUT) && connections.count(id)) writeClient(id);
+            }
+        }
+    }
+    return true;
+}
+
+void HttpServer::acceptClients() {
+    for (;;) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                cerr << "Error accepting connection: " << strerror(errno) << endl;
+            }
+            return;
+        }
+        int noDelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+        uint64_t id = nextId++;
+        Connection& conn = connections[id];
+        conn.fd = fd;
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = id;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+void HttpServer::watch(uint64_t id, Connection& conn, bool wantWrite) {
+    if (conn.wantWrite == wantWrite) return;
+    conn.wantWrite = wantWrite;
+    epoll_event ev{};
+    ev.events = wantWrite ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+    ev.data.u64 = id;
+    epoll_ctl(epollFd, EPOLL_CTL_MOD, conn.fd, &ev);
+}
+
+void HttpServer::readClient(uint64_t id) {
+    auto it = connections.find(id);
+    if (it == connections.end()) return;
+    Connection& conn = it->second;
+
+    char buffer[16384];
+    for (;;) {
+        ssize_t n = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if (n > 0) {
+            conn.in.append(buffer, static_cast<size_t>(n));
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            closeClient(id);
+            return;
+        }
+        if (errno == EINTR) continue;
+        break;
+    }
+    if (conn.in.size() > kMaxRequestBytes) {
+        closeClient(id);
+        return;
+    }
+    dispatch(id);
+}
+
+void HttpServer::writeClient(uint64_t id) {
+    auto it = connections.find(id);
+    if (it == connections.end()) return;
+    Connection& conn = it->second;
+
+    size_t sent = 0;
+    while (sent < conn.out.size()) {
+        ssize_t n = send(conn.fd, conn.out.data() + sent, conn.out.size() - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += static_cast<size_t>(n);
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            closeClient(id);
+            return;
+        }
+    }
+    conn.out.erase(0, sent);
+
+    if (!conn.out.empty()) {
+        watch(id, conn, true);
+    } else if (conn.closeAfterWrite) {
+        closeClient(id);
+    } else {
+        watch(id, conn, false);
+    }
+}
+
+// Parse the next complete request on the connection, if any, and hand it
+// to the worker pool.
+void HttpServer::dispatch(uint64_t id) {
+    auto it = connections.find(id);
+    if (it == connections.end()) return;
+    Connection& conn = it->second;
+    if (conn.busy || conn.closeAfterWrite) return;
+
+    size_t headerEnd = conn.in.find("\r\n\r\n");
+    if (headerEnd == string::npos) return;
+
+    HttpRequest request;
+    istringstream head(conn.in.substr(0, headerEnd));
+    string requestLine, target, version;
+    getline(head, requestLine);
+    istringstream(requestLine) >> request.method >> target >> version;
+    request.keepAlive = version != "HTTP/1.0";
+
+    size_t contentLength = 0;
+    string header;
+    bool malformed = request.method.empty() || target.empty();
+    while (getline(head, header)) {
+        if (!header.empty() && header.back() == '\r') header.pop_back();
+        size_t colon = header.find(':');
+        if (colon == string::npos) continue;
+        string name = header.substr(0, colon);
+        string value = header.substr(colon + 1);
+        value.erase(0, value.find_first_not_of(" \t"));
+        transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name == "content-length") {
+            try {
+                contentLength = static_cast<size_t>(stoul(value));
+            } catch (const exception&) {
+                malformed = true;
+            }
+        } else if (name == "connection") {
+            transform(value.begin(), value.end(), value.begin(), ::tolower);
+            if (value == "close") request.keepAlive = false;
+            if (value == "keep-alive") request.keepAlive = true;
+        }
+    }
+
+    if (malformed || contentLength > kMaxRequestBytes) {
+        conn.in.clear();
+        conn.out += formatResponse(jsonError(400, "malformed request"), false);
+        conn.closeAfterWrite = true;
+        writeClient(id);
+        return;
+    }
+    if (conn.in.size() < headerEnd + 4 + contentLength) return;
+
+    string body = conn.in.substr(headerEnd + 4, contentLength);
+    conn.in.erase(0, headerEnd + 4 + contentLength);
+
+    size_t query = target.find('?');
+    request.path = target.substr(0, query);
+    if (query != string::npos) parseParams(string_view(target).substr(query + 1), request.params);
+    parseParams(body, request.params);
+
+    conn.busy = true;
+    pool.submit([this, id, request]() {
+        HttpResponse response = handleHttpRequest(library, request);
+        Completion done{id, formatResponse(response, request.keepAlive), !request.keepAlive};
+        {
+            lock_guard<mutex> guard(completionLock);
+            completions.push_back(move(done));
+        }
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {
+            // eventfd only fails on counter overflow; the loop is awake anyway.
+        }
+    });
+}
+
+void HttpServer::drainCompletions() {
+    vector<Completion> ready;
+    {
+        lock_guard<mutex> guard(completionLock);
+        ready.swap(completions);
+    }
+    for (Completion& done : ready) {
+        auto it = connections.find(done.id);
+        if (it == connections.end()) continue; // client went away
+        Connection& conn = it->second;
+        conn.busy = false;
+        conn.out += done.response;
+        conn.closeAfterWrite = done.close;
+        writeClient(done.id);
+        dispatch(done.id); // pipelined request already buffered
+    }
+}
+
+void HttpServer::closeClient(uint64_t id) {
+    auto it = connections.find(id);
+    if (it == connections.end()) return;
+    epoll_ctl(epollFd, EPOLL_CTL_DEL, it->second.fd, nullptr);
+    close(it->second.fd);
+    connections.erase(it);
+}
+
+string HttpServer::formatResponse(const HttpResponse& response, bool keepAlive) {
+    const char* reason = "OK";
+    switch (response.status) {
+        case 201: reason = "Created"; break;
+        case 202: reason = "Accepted"; break;
+        case 400: reason = "Bad Request"; break;
+        case 404: reason = "Not Found"; break;
+        case 405: reason = "Method Not Allowed"; break;
+        case 409: reason = "Conflict"; break;
+        case 500: reason = "Internal Server Error"; break;
+        case 503: reason = "Service Unavailable"; break;
+    }
+    return "HTTP/1.1 " + to_string(response.status) + " " + reason +
+           "\r\nContent-Type: " + response.contentType + "\r\nContent-Length: " + to_string(response.body.size()) +
+           (keepAlive ? "\r\nConnection: keep-alive" : "\r\nConnection: close") +
+           "\r\n\r\n" + response.body;
+}
+
+static HttpServer* activeServer = nullptr;
+
+static void handleStopSignal(int) {
+    if (activeServer) activeServer->stop();
+}
+#endif
+
+int runServer(Library& library, uint16_t port, size_t workers) {
+#ifdef LIBRARY_HAVE_EPOLL
+    HttpServer server(library, port, workers);
+    activeServer = &server;
+    signal(SIGINT, handleStopSignal);
+    signal(SIGTERM, handleStopSignal);
+    bool ok = server.run();
+    activeServer = nullptr;
+    return ok ? 0 : 1;
+#else
+    (void)library;
+    (void)port;
+    (void)workers;
+    cerr << "Server mode requires Linux (epoll).\n";
+    return 1;
+#endif
+}
+
+// ================================
+// Load Generator
+// ================================
+// Replays a mixed lookup/search/borrow/return workload against the HTTP
+// service or straight against Library in this process. Requests are
+// issued open-loop: each one has an intended start time fixed by the
+// arrival rate, and latency is measured from that time rather than from
+// when the request actually went out, so a stalled server shows up as
+// queueing delay instead of silently lowering the offered load.
+struct LoadConfig {
+    string target = "inproc"; // "inproc" or "http"
+    string host = "127.0.0.1";
+    uint16_t port = 8080;
+    double rate = 1000.0;     // requests per second, all threads combined
+    double seconds = 10.0;
+    size_t threads = 4;
+    double lookupWeight = 70, searchWeight = 20, borrowWeight = 5, returnWeight = 5;
+    double zipfExponent = 0.99;
+};
+
+enum LoadOp { OpLookup, OpSearch, OpBorrow, OpReturn, OpCount };
+static const char* const kLoadOpNames[OpCount] = {"lookup", "search", "borrow", "return"};
+
+// Draws ranks 0..n-1 with P(rank k) proportional to 1 / (k + 1)^s.
+class ZipfSampler {
+public:
+    ZipfSampler(size_t n, double exponent) : cdf(n) {
+        double total = 0;
+        for (size_t k = 0; k < n; ++k) {
+            total += 1.0 / pow(static_cast<double>(k + 1), exponent);
+            cdf[k] = total;
+        }
+        for (double& c : cdf) c /= total;
+    }
+
+    template <typename Rng>
+    size_t operator()(Rng& rng) const {
+        double u = uniform_real_distribution<double>(0.0, 1.0)(rng);
+        size_t k = static_cast<size_t>(lower_bound(cdf.begin(), cdf.end(), u) - cdf.begin());
+        return min(k, cdf.size() - 1);
+    }
+
+private:
+    vector<double> cdf;
+};
+
+struct LoadResult {
+    LatencyHistogram latency[OpCount];
+    uint64_t errors[OpCount] = {};
+
+    void merge(const LoadResult& other) {
+        for (int op = 0; op < OpCount; ++op) {
+            latency[op].merge(other.latency[op]);
+            errors[op] += other.errors[op];
+        }
+    }
+};
+
+#ifdef LIBRARY_HAVE_EPOLL
+// Percent-encodes everything but RFC 3986 unreserved characters, so a
+// value is safe both as a path segment and as a query value.
+static string urlEncode(string_view text) {
+    static const char hex[] = "0123456789ABCDEF";
+    string out;
+    out.reserve(text.size());
+    for (char c : text) {
+        unsigned char byte = static_cast<unsigned char>(c);
+        if (isalnum(byte) || c == '-' || c == '_' || c == '.' || c == '~') {
+            out += c;
+        } else {
+            out += '%';
+            out += hex[byte >> 4];
+            out += hex[byte & 0xF];
+        }
+    }
+    return out;
+}
+
+// Minimal blocking keep-alive HTTP/1.1 client for the load generator.
+class HttpClient {
+public:
+    HttpClient(const string& host, uint16_t port) : host(host), port(port) {}
+    ~HttpClient() { disconnect(); }
+
+    // Returns the response status, or -1 on a transport error.
+    int request(const string& method, const string& target);
+
+private:
+    bool connectServer();
+    void disconnect() {
+        if (fd >= 0) close(fd);
+        fd = -1;
+    }
+
+    string host;
+    uint16_t port;
+    int fd = -1;
+    string buffer;
+};
+
+bool HttpClient::connectServer() {
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    int noDelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 ||
+        connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+        disconnect();
+        return false;
+    }
+    buffer.clear();
+    return true;
+}
+
+int HttpClient::request(const string& method, const string& target) {
+    if (fd < 0 && !connectServer()) return -1;
+
+    string message = method + " " + target + " HTTP/1.1\r\nHost: " + host + "\r\nContent-Length: 0\r\n\r\n";
+    size_t sent = 0;
+    while (sent < message.size()) {
+        ssize_t n = send(fd, message.data() + sent, message.size() - sent, MSG_NOSIGNAL);
+        if (n <= 0) {
+            disconnect();
+            return -1;
+        }
+        sent += static_cast<size_t>(n);
+    }
+
+    char chunk[16384];
+    for (;;) {
+        size_t headerEnd = buffer.find("\r\n\r\n");
+        if (headerEnd != string::npos) {
+            size_t lengthAt = buffer.find("Content-Length: ");
+            size_t length = lengthAt < headerEnd ? static_cast<size_t>(stoul(buffer.substr(lengthAt + 16))) : 0;
+            if (buffer.size() >= headerEnd + 4 + length) {
+                int status = atoi(buffer.c_str() + 9);
+                bool closing = buffer.find("Connection: close") < headerEnd;
+                buffer.erase(0, headerEnd + 4 + length);
+                if (closing) disconnect();
+                return status;
+            }
+        }
+        ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+        if (n <= 0) {
+            disconnect();
+            return -1;
+        }
+        buffer.append(chunk, static_cast<size_t>(n));
+    }
+}
+#endif
+
+static void runLoadThread(const LoadConfig& config, Library* library, const vector<pair<string, string>>& books,
+                          const ZipfSampler& zipf, size_t threadIndex, chrono::steady_clock::time_point start,
+                          LoadResult& result) {
+    using Clock = chrono::steady_clock;
+    mt19937_64 rng(0x5eed + threadIndex);
+    const double weights[OpCount] = {config.lookupWeight, config.searchWeight, config.borrowWeight, config.returnWeight};
+    discrete_distribution<int> pickOp(begin(weights), end(weights));
+
+    const auto interval = chrono::duration_cast<Clock::duration>(
+        chrono::duration<double>(static_cast<double>(config.threads) / config.rate));
+    const auto end = start + chrono::duration_cast<Clock::duration>(chrono::duration<double>(config.seconds));
+    // Stagger threads so their arrivals interleave instead of bunching.
+    auto intended = start + interval * static_cast<long>(threadIndex) / static_cast<long>(config.threads);
+
+    const string userID = "loadgen-" + to_string(threadIndex);
+    vector<string> loans;
+#ifdef LIBRARY_HAVE_EPOLL
+    unique_ptr<HttpClient> client;
+    if (!library) client.reset(new HttpClient(config.host, config.port));
+#endif
+
+    for (; intended < end; intended += interval) {
+        this_thread::sleep_until(intended);
+
+        int op = pickOp(rng);
+        if (op == OpReturn && loans.empty()) op = OpLookup;
+        const auto& book = books[zipf(rng)];
+        bool ok = false;
+
+        if (library) {
+            Book found;
+            switch (op) {
+                case OpLookup: ok = library->findBook(book.first, found); break;
+                case OpSearch: library->searchBooks(book.second, "", 20); ok = true; break;
+                case OpBorrow: ok = library->borrowBook(userID, book.first); break;
+                case OpReturn: ok = library->returnBook(userID, loans.back()); break;
+            }
+        }
+#ifdef LIBRARY_HAVE_EPOLL
+        else {
+            int status = -1;
+            switch (op) {
+                case OpLookup: status = client->request("GET", "/books/" + urlEncode(book.first)); break;
+                case OpSearch: status = client->request("GET", "/books?limit=20&q=" + urlEncode(book.second)); break;
+                case OpBorrow:
+                    status = client->request("POST", "/books/" + urlEncode(book.first) + "/borrow?user=" + urlEncode(userID));
+                    break;
+                case OpReturn:
+                    status = client->request("POST", "/books/" + urlEncode(loans.back()) + "/return?user=" + urlEncode(userID));
+                    break;
+            }
+            ok = status == 200;
+        }
+#endif
+
+        if (ok && op == OpBorrow) loans.push_back(book.first);
+        if (ok && op == OpReturn) loans.pop_back();
+        if (!ok) ++result.errors[op];
+        result.latency[op].record(static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(Clock::now() - intended).count()));
+    }
+}
+
+int runLoadGenerator(Library& library, const LoadConfig& config) {
+    // Sample keys from the catalog; rank 0 is the most popular title.
+    vector<pair<string, string>> books;
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(db, "SELECT ISBN, Title FROM Books;", -1, &stmt, nullptr) == SQLITE_OK) {
+        while (sqlite3_step(stmt) == SQLITE_ROW) {
+            books.emplace_back(columnString(stmt, 0), columnString(stmt, 1));
+        }
+        sqlite3_finalize(stmt);
+    }
+    if (books.empty()) {
+        cerr << "Error: the catalog is empty; import books before generating load.\n";
+        return 1;
+    }
+    shuffle(books.begin(), books.end(), mt19937_64(42));
+    ZipfSampler zipf(books.size(), config.zipfExponent);
+
+    bool inProcess = config.target == "inproc";
+#ifndef LIBRARY_HAVE_EPOLL
+    if (!inProcess) {
+        cerr << "HTTP load generation requires Linux.\n";
+        return 1;
+    }
+#endif
+
+    cout << "Offering " << config.rate << " req/s for " << config.seconds << " s from " << config.threads
+         << " threads against " << (inProcess ? "Library (in-process)" : "http://" + config.host + ":" + to_string(config.port))
+         << ", " << books.size() << " titles, zipf s=" << config.zipfExponent << "\n";
+
+    // Library operations log to stdout; keep the report readable.
+    if (inProcess) library.setQuiet(true);
+
+    vector<LoadResult> results(config.threads);
+    vector<thread> workers;
+    auto start = chrono::steady_clock::now() + chrono::milliseconds(50);
+    for (size_t i = 0; i < config.threads; ++i) {
+        workers.emplace_back(runLoadThread, cref(config), inProcess ? &library : nullptr, cref(books), cref(zipf), i, start,
+                             ref(results[i]));
+    }
+    for (thread& worker : workers) worker.join();
+    double elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    if (inProcess) library.setQuiet(false);
+
+    LoadResult total;
+    for (const LoadResult& r : results) total.merge(r);
+    LatencyHistogram all;
+    uint64_t requests = 0, errors = 0;
+
+    char line[160];
+    cout << "\n";
+    snprintf(line, sizeof(line), "%-8s %10s %8s %10s %10s %10s %10s %10s\n", "op", "count", "errors", "p50 us",
+             "p90 us", "p99 us", "p99.9 us", "max us");
+    cout << line;
+    for (int op = 0; op < OpCount; ++op) {
+        const LatencyHistogram& h = total.latency[op];
+        snprintf(line, sizeof(line), "%-8s %10llu %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", kLoadOpNames[op],
+                 static_cast<unsigned long long>(h.count()), static_cast<unsigned long long>(total.errors[op]),
+                 h.percentile(0.5) / 1e3, h.percentile(0.9) / 1e3, h.percentile(0.99) / 1e3,
+                 h.percentile(0.999) / 1e3, h.max() / 1e3);
+        cout << line;
+        all.merge(h);
+        requests += h.count();
+        errors += total.errors[op];
+    }
+    cout << "\nAchieved " << requests / elapsed << " req/s (offered " << config.rate << "), " << errors
+         << " errors\n\nLatency distribution, all operations:\n";
+    all.printDistribution(cout, 1e3, "Value(us)");
+
+    vector<WorkStealingPool::WorkerStats> pool = library.readPoolStats();
+    if (inProcess && !pool.empty()) {
+        cout << "\nRead pool:\n";
+        for (size_t i = 0; i < pool.size(); ++i) {
+            snprintf(line, sizeof(line), "  worker %2zu  executed %10llu  stolen %8llu  utilization %5.1f%%\n", i,
+                     static_cast<unsigned long long>(pool[i].executed),
+                     static_cast<unsigned long long>(pool[i].stolen), pool[i].utilization * 100.0);
+            cout << line;
+        }
+    }
+
+    if (inProcess) {
+        cout << "\nSQLite statements by total time:\n";
+        queryProfiler().report(cout, 10);
+    }
+    return 0;
+}
+
+static bool parseLoadArgs(int argc, char* argv[], LoadConfig& config) {
+    for (int i = 2; i < argc; ++i) {
+        string arg = argv[i];
+        size_t eq = arg.find('=');
+        if (arg.compare(0, 2, "--") != 0 || eq == string::npos) {
+            cerr << "Unrecognized argument: " << arg << endl;
+            return false;
+        }
+        string name = arg.substr(2, eq - 2);
+        string value = arg.substr(eq + 1);
+        try {
+            if (name == "target") config.target = value;
+            else if (name == "host") config.host = value;
+            else if (name == "port") config.port = static_cast<uint16_t>(stoi(value));
+            else if (name == "rate") config.rate = stod(value);
+            else if (name == "seconds") config.seconds = stod(value);
+            else if (name == "threads") config.threads = max<size_t>(1, stoul(value));
+            else if (name == "zipf") config.zipfExponent = stod(value);
+            else if (name == "mix") {
+                // lookup:search:borrow:return, e.g. 70:20:5:5
+                char sep;
+                istringstream mix(value);
+                if (!(mix >> config.lookupWeight >> sep >> config.searchWeight >> sep >> config.borrowWeight >> sep >>
+                      config.returnWeight)) {
+                    throw invalid_argument("mix");
+                }
+            } else {
+                cerr << "Unknown option: --" << name << endl;
+                return false;
+            }
+        } catch (const exception&) {
+            cerr << "Invalid value for --" << name << ": " << value << endl;
+            return false;
+        }
+    }
+    if (config.target != "inproc" && config.target != "http") {
+        cerr << "--target must be inproc or http\n";
+        return false;
+    }
+    return config.rate > 0 && config.seconds > 0;
+}
+
+// ================================
+// Columnar Export
+// ================================
+// Analytics dump of a query result, one column at a time. Rows are cut
+// into chunks of kColumnarChunkRows; within a chunk each column is stored
+// as its own blob, so a reader seeks straight to the columns it needs.
+//
+//   "LIBCOL1\0"
+//   chunk 0: column 0 blob, column 1 blob, ...
+//   chunk 1: ...
+//   footer: columns (name, type); per chunk: row count and, per column,
+//           offset, length, encoding, null count, min and max
+//   footer length (uint32), "LIBCOL1\0"
+//
+// Integers in the footer and blobs are LEB128 varints; signed values are
+// zigzag-encoded first. A blob starts with a null bitmap (bit set = NULL)
+// when the chunk has NULLs, followed by the non-NULL values in the
+// smaller of two encodings for its type.
+static constexpr char kColumnarMagic[8] = {'L', 'I', 'B', 'C', 'O', 'L', '1', '\0'};
+static constexpr size_t kColumnarChunkRows = 65536;
+
+enum ColumnarEncoding : uint8_t {
+    EncodingDelta = 1,      // int: zigzag deltas from the previous value
+    EncodingDeltaRle = 2,   // int: (delta, run length) pairs; constants and sequences
+    EncodingPlain = 3,      // text: length-prefixed values
+    EncodingDict = 4,       // text: dictionary, then (index, run length) pairs
+    EncodingDictPacked = 5, // text: dictionary, bit width, bit-packed indices
+};
+
+struct ColumnarColumn {
+    string name;
+    bool text;
+    // Read as SQLite "YYYY-MM-DD HH:MM:SS" text and stored as Unix seconds;
+    // anything else becomes NULL. Far cheaper than strftime('%s') per row.
+    bool timestamp = false;
+};
+
+struct ColumnarChunkColumn {
+    uint64_t offset = 0;
+    uint64_t length = 0;
+    uint8_t encoding = 0;
+    uint64_t nulls = 0;
+    // Over non-NULL values; meaningless when every row is NULL.
+    int64_t minInt = 0;
+    int64_t maxInt = 0;
+    string minText;
+    string maxText;
+};
+
+struct ColumnarChunk {
+    uint64_t rows = 0;
+    vector<ColumnarChunkColumn> columns;
+};
+
+static void putVarint(string& out, uint64_t value) {
+    while (value >= 0x80) {
+        out.push_back(static_cast<char>(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+}
+
+static bool getVarint(const char*& p, const char* end, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        uint8_t byte = static_cast<uint8_t>(*p++);
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+static uint64_t zigzag(int64_t value) {
+    return (static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+    return static_cast<int64_t>(value >> 1) ^ -static_cast<int64_t>(value & 1);
+}
+
+static void putString(string& out, const string& value) {
+    putVarint(out, value.size());
+    out += value;
+}
+
+static bool getString(const char*& p, const char* end, string& value) {
+    uint64_t size;
+    if (!getVarint(p, end, size) || size > static_cast<uint64_t>(end - p)) return false;
+    value.assign(p, static_cast<size_t>(size));
+    p += size;
+    return true;
+}
+
+static bool parseSqliteTimestamp(const char* text, size_t size, int64_t& seconds) {
+    static const char pattern[] = "dddd-dd-dd dd:dd:dd";
+    if (size != sizeof pattern - 1) return false;
+    for (size_t i = 0; i < size; ++i) {
+        if (pattern[i] == 'd' ? !isdigit(static_cast<unsigned char>(text[i])) : text[i] != pattern[i]) return false;
+    }
+    auto number = [text](size_t at, size_t digits) {
+        int value = 0;
+        for (size_t i = at; i < at + digits; ++i) value = value * 10 + (text[i] - '0');
+        return value;
+    };
+    int year = number(0, 4);
+    unsigned month = static_cast<unsigned>(number(5, 2));
+    unsigned day = static_cast<unsigned>(number(8, 2));
+    if (month < 1 || month > 12 || day < 1 || day > 31) return false;
+    // Days since 1970-01-01 in the proleptic Gregorian calendar.
+    year -= month <= 2;
+    int era = (year >= 0 ? year : year - 399) / 400;
+    unsigned yearOfEra = static_cast<unsigned>(year - era * 400);
+    unsigned dayOfYear = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    unsigned dayOfEra = yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+    int64_t days = static_cast<int64_t>(era) * 146097 + static_cast<int64_t>(dayOfEra) - 719468;
+    seconds = days * 86400 + number(11, 2) * 3600 + number(14, 2) * 60 + number(17, 2);
+    return true;
+}
+
+static uint8_t encodeInts(const vector<int64_t>& values, string& out) {
+    vector<uint64_t> deltas(values.size());
+    int64_t previous = 0;
+    for (size_t i = 0; i < values.size(); ++i) {
+        deltas[i] = zigzag(static_cast<int64_t>(static_cast<uint64_t>(values[i]) - static_cast<uint64_t>(previous)));
+        previous = values[i];
+    }
+    string plain;
+    for (uint64_t delta : deltas) putVarint(plain, delta);
+    string runs;
+    for (size_t i = 0; i < deltas.size() && runs.size() < plain.size();) {
+        size_t run = 1;
+        while (i + run < deltas.size() && deltas[i + run] == deltas[i]) ++run;
+        putVarint(runs, deltas[i]);
+        putVarint(runs, run);
+        i += run;
+    }
+    if (runs.size() < plain.size()) {
+        out += runs;
+        return EncodingDeltaRle;
+    }
+    out += plain;
+    return EncodingDelta;
+}
+
+static uint8_t encodeTexts(const vector<string>& values, string& out) {
+    string plain;
+    for (const string& value : values) putString(plain, value);
+
+    // Dictionary in first-seen order; give up once it cannot win.
+    unordered_map<string_view, uint32_t> codes;
+    string dictionary;
+    string indices;
+    bool useDictionary = true;
+    vector<uint32_t> coded;
+    coded.reserve(values.size());
+    for (const string& value : values) {
+        auto inserted = codes.emplace(value, static_cast<uint32_t>(codes.size()));
+        if (inserted.second) {
+            putString(dictionary, value);
+        }
+        coded.push_back(inserted.first->second);
+        // Mostly-distinct columns (ISBNs, titles) are spotted early.
+        if (coded.size() == 4096 && codes.size() * 10 > coded.size() * 9) {
+            useDictionary = false;
+            break;
+        }
+    }
+    if (useDictionary) {
+        for (size_t i = 0; i < coded.size();) {
+            size_t run = 1;
+            while (i + run < coded.size() && coded[i + run] == coded[i]) ++run;
+            putVarint(indices, coded[i]);
+            putVarint(indices, run);
+            i += run;
+        }
+        // Short runs pack better at a fixed bit width.
+        int width = codes.size() > 1 ? highestBit64(codes.size() - 1) + 1 : 1;
+        string packed(1, static_cast<char>(width));
+        packed.resize(1 + (coded.size() * width + 7) / 8, '\0');
+        for (size_t i = 0; i < coded.size(); ++i) {
+            for (int bit = 0; bit < width; ++bit) {
+                if ((coded[i] >> bit) & 1) {
+                    size_t position = i * width + bit;
+                    packed[1 + position / 8] = static_cast<char>(packed[1 + position / 8] | (1 << (position % 8)));
+                }
+            }
+        }
+        bool usePacked = packed.size() < indices.size();
+        string encoded;
+        putVarint(encoded, codes.size());
+        encoded += dictionary;
+        encoded += usePacked ? packed : indices;
+        if (encoded.size() < plain.size()) {
+            out += encoded;
+            return usePacked ? EncodingDictPacked : EncodingDict;
+        }
+    }
+    out += plain;
+    return EncodingPlain;
+}
+
+// Stream the result of sql into a columnar file. Column i of the result is
+// read as columns[i]; NULLs are kept. Memory is bounded by one chunk.
+bool exportColumnar(sqlite3* conn, const string& sql, const vector<ColumnarColumn>& columns, const string& path,
+                    uint64_t& rowsWritten) {
+    static OperationMetrics instruments("exportColumnar");
+    OperationScope scope(instruments);
+    TraceSpan span("exportColumnar");
+    rowsWritten = 0;
+
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(conn, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        cerr << "Error preparing export query: " << sqlite3_errmsg(conn) << endl;
+        return false;
+    }
+    const string tempPath = path + ".tmp";
+    ofstream out(tempPath, ios::binary | ios::trunc);
+    if (!out.is_open()) {
+        cerr << "Error: Could not open file " << tempPath << endl;
+        sqlite3_finalize(stmt);
+        return false;
+    }
+    out.write(kColumnarMagic, sizeof kColumnarMagic);
+    uint64_t offset = sizeof kColumnarMagic;
+
+    struct Pending {
+        vector<int64_t> ints;
+        vector<string> texts;
+        vector<uint8_t> nullBits;
+        uint64_t nulls = 0;
+    };
+    vector<Pending> pending(columns.size());
+    vector<ColumnarChunk> chunks;
+    size_t chunkRows = 0;
+    string blob;
+
+    auto flushChunk = [&]() {
+        if (chunkRows == 0) return;
+        TraceSpan chunkSpan("exportColumnar.chunk");
+        ColumnarChunk chunk;
+        chunk.rows = chunkRows;
+        for (size_t c = 0; c < columns.size(); ++c) {
+            Pending& column = pending[c];
+            ColumnarChunkColumn meta;
+            blob.clear();
+            if (column.nulls > 0) {
+                blob.append(reinterpret_cast<const char*>(column.nullBits.data()), (chunkRows + 7) / 8);
+            }
+            if (columns[c].text) {
+                meta.encoding = encodeTexts(column.texts, blob);
+                if (!column.texts.empty()) {
+                    auto bounds = minmax_element(column.texts.begin(), column.texts.end());
+                    meta.minText = *bounds.first;
+                    meta.maxText = *bounds.second;
+                }
+            } else {
+                meta.encoding = encodeInts(column.ints, blob);
+                if (!column.ints.empty()) {
+                    auto bounds = minmax_element(column.ints.begin(), column.ints.end());
+                    meta.minInt = *bounds.first;
+                    meta.maxInt = *bounds.second;
+                }
+            }
+            meta.offset = offset;
+            meta.length = blob.size();
+            meta.nulls = column.nulls;
+            out.write(blob.data(), static_cast<streamsize>(blob.size()));
+            offset += blob.size();
+            chunk.columns.push_back(move(meta));
+
+            column.ints.clear();
+            column.texts.clear();
+            column.nullBits.assign((kColumnarChunkRows + 7) / 8, 0);
+            column.nulls = 0;
+        }
+        chunks.push_back(move(chunk));
+        chunkRows = 0;
+    };
 
-void openDatabase() {
-    int rc = sqlite3_open("library.db", &db);
-    if (rc) {
-        cerr << "Error opening database: " << sqlite3_errmsg(db) << endl;
-        exit(1);
+    for (Pending& column : pending) column.nullBits.assign((kColumnarChunkRows + 7) / 8, 0);
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        for (size_t c = 0; c < columns.size(); ++c) {
+            Pending& column = pending[c];
+            int col = static_cast<int>(c);
+            if (sqlite3_column_type(stmt, col) == SQLITE_NULL) {
+                column.nullBits[chunkRows / 8] |= static_cast<uint8_t>(1u << (chunkRows % 8));
+                ++column.nulls;
+            } else if (columns[c].timestamp) {
+                int64_t seconds;
+                const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+                if (parseSqliteTimestamp(text, static_cast<size_t>(sqlite3_column_bytes(stmt, col)), seconds)) {
+                    column.ints.push_back(seconds);
+                } else {
+                    column.nullBits[chunkRows / 8] |= static_cast<uint8_t>(1u << (chunkRows % 8));
+                    ++column.nulls;
+                }
+            } else if (columns[c].text) {
+                const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
+                column.texts.emplace_back(text, static_cast<size_t>(sqlite3_column_bytes(stmt, col)));
+            } else {
+                column.ints.push_back(sqlite3_column_int64(stmt, col));
+            }
+        }
+        ++rowsWritten;
+        if (++chunkRows == kColumnarChunkRows) {
+            flushChunk();
+        }
     }
-    cout << "Database opened successfully.\n";
-}
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        cerr << "Error reading export query: " << sqlite3_errmsg(conn) << endl;
+        out.close();
+        remove(tempPath.c_str());
+        return false;
+    }
+    flushChunk();
 
-void closeDatabase() {
-    if (db) {
-        sqlite3_close(db);
-        db = nullptr;
-        cout << "Database closed successfully.\n";
+    string footer;
+    putVarint(footer, columns.size());
+    for (const ColumnarColumn& column : columns) {
+        putString(footer, column.name);
+        footer.push_back(column.text ? 1 : 0);
     }
+    putVarint(footer, chunks.size());
+    for (const ColumnarChunk& chunk : chunks) {
+        putVarint(footer, chunk.rows);
+        for (size_t c = 0; c < columns.size(); ++c) {
+            const ColumnarChunkColumn& meta = chunk.columns[c];
+            putVarint(footer, meta.offset);
+            putVarint(footer, meta.length);
+            footer.push_back(static_cast<char>(meta.encoding));
+            putVarint(footer, meta.nulls);
+            if (columns[c].text) {
+                putString(footer, meta.minText);
+                putString(footer, meta.maxText);
+            } else {
+                putVarint(footer, zigzag(meta.minInt));
+                putVarint(footer, zigzag(meta.maxInt));
+            }
+        }
+    }
+    uint32_t footerLength = static_cast<uint32_t>(footer.size());
+    out.write(footer.data(), static_cast<streamsize>(footer.size()));
+    out.write(reinterpret_cast<const char*>(&footerLength), sizeof footerLength);
+    out.write(kColumnarMagic, sizeof kColumnarMagic);
+    out.close();
+    if (!out || rename(tempPath.c_str(), path.c_str()) != 0) {
+        cerr << "Error writing " << path << endl;
+        remove(tempPath.c_str());
+        return false;
+    }
+    scope.markOk();
+    return true;
 }
 
-void createTables() {
-    const string createBooksTable = 
-        "CREATE TABLE IF NOT EXISTS Books ("
-        "ISBN TEXT PRIMARY KEY, "
-        "Title TEXT, "
-        "Author TEXT, "
-        "Genre TEXT, "
-        "AvailableCopies INTEGER, "
-        "BorrowedCount INTEGER DEFAULT 0);";
+// Reads the footer up front; column blobs are read only when asked for.
+class ColumnarReader {
+public:
+    bool open(const string& path);
+    const vector<ColumnarColumn>& columns() const { return columnList; }
+    const vector<ColumnarChunk>& chunks() const { return chunkList; }
+    int columnIndex(const string& name) const;
+    // Decode one column of one chunk. NULL rows hold 0 / "" and are
+    // flagged in nulls.
+    bool readInts(size_t chunk, size_t column, vector<int64_t>& values, vector<bool>& nulls);
+    bool readTexts(size_t chunk, size_t column, vector<string>& values, vector<bool>& nulls);
 
-    const string createUsersTable =
-        "CREATE TABLE IF NOT EXISTS Users ("
-        "UserID TEXT PRIMARY KEY, "
-        "Name TEXT, "
-        "UserType TEXT);";
+private:
+    // Loads the blob and consumes its null bitmap; p/end frame the values.
+    bool readBlob(size_t chunk, size_t column, vector<bool>& nulls, const char*& p, const char*& end);
 
-    const string createTransactionsTable =
-        "CREATE TABLE IF NOT EXISTS Transactions ("
-        "TransactionID INTEGER PRIMARY KEY AUTOINCREMENT, "
-        "UserID TEXT, "
-        "ISBN TEXT, "
-        "Action TEXT, "
-        "Timestamp DATETIME DEFAULT CURRENT_TIMESTAMP, "
-        "FOREIGN KEY(UserID) REFERENCES Users(UserID), "
-        "FOREIGN KEY(ISBN) REFERENCES Books(ISBN));";
+    ifstream file;
+    string path;
+    string blob;
+    vector<ColumnarColumn> columnList;
+    vector<ColumnarChunk> chunkList;
+};
 
-    char* errorMessage;
+bool ColumnarReader::open(const string& filePath) {
+    path = filePath;
+    file.open(path, ios::binary);
+    if (!file.is_open()) {
+        cerr << "Error: Could not open file " << path << endl;
+        return false;
+    }
+    char tail[sizeof(uint32_t) + sizeof kColumnarMagic];
+    file.seekg(0, ios::end);
+    streamoff size = file.tellg();
+    if (size < static_cast<streamoff>(sizeof kColumnarMagic + sizeof tail) || !file.seekg(size - sizeof tail) ||
+        !file.read(tail, sizeof tail) || memcmp(tail + sizeof(uint32_t), kColumnarMagic, sizeof kColumnarMagic) != 0) {
+        cerr << "Error: " << path << " is not a columnar export" << endl;
+        return false;
+    }
+    uint32_t footerLength;
+    memcpy(&footerLength, tail, sizeof footerLength);
+    if (footerLength > size - static_cast<streamoff>(sizeof kColumnarMagic + sizeof tail)) {
+        cerr << "Error: " << path << " has a corrupt footer" << endl;
+        return false;
+    }
+    string footer(footerLength, '\0');
+    file.seekg(size - static_cast<streamoff>(sizeof tail) - footerLength);
+    file.read(&footer[0], footerLength);
 
-    if (sqlite3_exec(db, createBooksTable.c_str(), nullptr, nullptr, &errorMessage) != SQLITE_OK) {
-        cerr << "Error creating Books table: " << errorMessage << endl;
-        sqlite3_free(errorMessage);
+    const char* p = footer.data();
+    const char* end = p + footer.size();
+    uint64_t count;
+    bool ok = getVarint(p, end, count) && count <= footer.size();
+    for (uint64_t c = 0; ok && c < count; ++c) {
+        ColumnarColumn column;
+        ok = getString(p, end, column.name) && p < end;
+        if (ok) column.text = *p++ != 0;
+        columnList.push_back(move(column));
+    }
+    ok = ok && getVarint(p, end, count) && count <= footer.size();
+    for (uint64_t k = 0; ok && k < count; ++k) {
+        ColumnarChunk chunk;
+        ok = getVarint(p, end, chunk.rows);
+        for (size_t c = 0; ok && c < columnList.size(); ++c) {
+            ColumnarChunkColumn meta;
+            ok = getVarint(p, end, meta.offset) && getVarint(p, end, meta.length) && p < end;
+            if (!ok) break;
+            meta.encoding = static_cast<uint8_t>(*p++);
+            ok = getVarint(p, end, meta.nulls);
+            if (columnList[c].text) {
+                ok = ok && getString(p, end, meta.minText) && getString(p, end, meta.maxText);
+            } else {
+                uint64_t minValue = 0;
+                uint64_t maxValue = 0;
+                ok = ok && getVarint(p, end, minValue) && getVarint(p, end, maxValue);
+                meta.minInt = unzigzag(minValue);
+                meta.maxInt = unzigzag(maxValue);
+            }
+            chunk.columns.push_back(move(meta));
+        }
+        chunkList.push_back(move(chunk));
+    }
+    if (!ok) {
+        cerr << "Error: " << path << " has a corrupt footer" << endl;
+        columnList.clear();
+        chunkList.clear();
     }
+    return ok;
+}
 
-    if (sqlite3_exec(db, createUsersTable.c_str(), nullptr, nullptr, &errorMessage) != SQLITE_OK) {
-        cerr << "Error creating Users table: " << errorMessage << endl;
-        sqlite3_free(errorMessage);
+int ColumnarReader::columnIndex(const string& name) const {
+    for (size_t c = 0; c < columnList.size(); ++c) {
+        if (columnList[c].name == name) return static_cast<int>(c);
     }
+    return -1;
+}
 
-    if (sqlite3_exec(db, createTransactionsTable.c_str(), nullptr, nullptr, &errorMessage) != SQLITE_OK) {
-        cerr << "Error creating Transactions table: " << errorMessage << endl;
-        sqlite3_free(errorMessage);
+bool ColumnarReader::readBlob(size_t chunk, size_t column, vector<bool>& nulls, const char*& p, const char*& end) {
+    const ColumnarChunk& info = chunkList[chunk];
+    const ColumnarChunkColumn& meta = info.columns[column];
+    blob.resize(static_cast<size_t>(meta.length));
+    file.clear();
+    if (!file.seekg(static_cast<streamoff>(meta.offset)) || !file.read(&blob[0], static_cast<streamsize>(blob.size()))) {
+        return false;
     }
+    p = blob.data();
+    end = p + blob.size();
+    nulls.assign(static_cast<size_t>(info.rows), false);
+    if (meta.nulls > 0) {
+        size_t bitmapBytes = static_cast<size_t>((info.rows + 7) / 8);
+        if (bitmapBytes > blob.size()) return false;
+        for (size_t row = 0; row < nulls.size(); ++row) {
+            nulls[row] = (static_cast<uint8_t>(p[row / 8]) >> (row % 8)) & 1;
+        }
+        p += bitmapBytes;
+    }
+    return true;
+}
 
-    cout << "Tables created successfully.\n";
+bool ColumnarReader::readInts(size_t chunk, size_t column, vector<int64_t>& values, vector<bool>& nulls) {
+    const char* p;
+    const char* end;
+    if (!readBlob(chunk, column, nulls, p, end)) return false;
+    values.assign(nulls.size(), 0);
+    uint8_t encoding = chunkList[chunk].columns[column].encoding;
+    size_t row = 0;
+    auto nextRow = [&]() {
+        while (row < nulls.size() && nulls[row]) ++row;
+        return row < nulls.size();
+    };
+    uint64_t raw;
+    if (encoding == EncodingDelta) {
+        int64_t previous = 0;
+        while (nextRow()) {
+            if (!getVarint(p, end, raw)) return false;
+            previous = static_cast<int64_t>(static_cast<uint64_t>(previous) + static_cast<uint64_t>(unzigzag(raw)));
+            values[row++] = previous;
+        }
+        return true;
+    }
+    if (encoding == EncodingDeltaRle) {
+        int64_t previous = 0;
+        uint64_t run;
+        while (p < end) {
+            if (!getVarint(p, end, raw) || !getVarint(p, end, run)) return false;
+            for (uint64_t i = 0; i < run; ++i) {
+                if (!nextRow()) return false;
+                previous = static_cast<int64_t>(static_cast<uint64_t>(previous) + static_cast<uint64_t>(unzigzag(raw)));
+                values[row++] = previous;
+            }
+        }
+        return !nextRow();
+    }
+    return false;
+}
+
+bool ColumnarReader::readTexts(size_t chunk, size_t column, vector<string>& values, vector<bool>& nulls) {
+    const char* p;
+    const char* end;
+    if (!readBlob(chunk, column, nulls, p, end)) return false;
+    values.assign(nulls.size(), string());
+    uint8_t encoding = chunkList[chunk].columns[column].encoding;
+    size_t row = 0;
+    auto nextRow = [&]() {
+        while (row < nulls.size() && nulls[row]) ++row;
+        return row < nulls.size();
+    };
+    if (encoding == EncodingPlain) {
+        while (nextRow()) {
+            if (!getString(p, end, values[row++])) return false;
+        }
+        return true;
+    }
+    if (encoding == EncodingDict || encoding == EncodingDictPacked) {
+        uint64_t size;
+        if (!getVarint(p, end, size) || size > blob.size()) return false;
+        vector<string> dictionary(static_cast<size_t>(size));
+        for (string& entry : dictionary) {
+            if (!getString(p, end, entry)) return false;
+        }
+        if (encoding == EncodingDictPacked) {
+            if (p == end) return false;
+            int width = *p++;
+            size_t position = 0;
+            while (nextRow()) {
+                uint64_t code = 0;
+                for (int bit = 0; bit < width; ++bit, ++position) {
+                    if (position / 8 >= static_cast<size_t>(end - p)) return false;
+                    code |= static_cast<uint64_t>((static_cast<uint8_t>(p[position / 8]) >> (position % 8)) & 1) << bit;
+                }
+                if (code >= dictionary.size()) return false;
+                values[row++] = dictionary[code];
+            }
+            return true;
+        }
+        uint64_t code;
+        uint64_t run;
+        while (p < end) {
+            if (!getVarint(p, end, code) || !getVarint(p, end, run) || code >= dictionary.size()) return false;
+            for (uint64_t i = 0; i < run; ++i) {
+                if (!nextRow()) return false;
+                values[row++] = dictionary[code];
+            }
+        }
+        return !nextRow();
+    }
+    return false;
+}
+
+// Export Books and Transactions to dir/books.lcol and dir/transactions.lcol
+// through a separate read-only connection, in one read transaction so the
+// two files are consistent with each other.
+int runColumnarExport(const string& dir) {
+    sqlite3* conn = nullptr;
+    if (sqlite3_open_v2(databasePath, &conn, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        cerr << "Error opening read connection: " << sqlite3_errmsg(conn) << endl;
+        sqlite3_close(conn);
+        return 1;
+    }
+    sqlite3_busy_timeout(conn, 5000);
+    queryProfiler().attach(conn);
+    sqlite3_exec(conn, "BEGIN;", nullptr, nullptr, nullptr);
+
+    const vector<ColumnarColumn> bookColumns = {
+        {"rowid", false}, {"ISBN", true}, {"Title", true}, {"Author", true},
+        {"Genre", true}, {"AvailableCopies", false}, {"BorrowedCount", false}};
+    const vector<ColumnarColumn> transactionColumns = {
+        {"TransactionID", false}, {"UserID", true}, {"ISBN", true}, {"Action", true}, {"Timestamp", false, true}};
+    const pair<string, string> exports[] = {
+        {"SELECT rowid, ISBN, Title, Author, Genre, AvailableCopies, BorrowedCount FROM Books ORDER BY rowid;",
+         dir + "/books.lcol"},
+        {"SELECT TransactionID, UserID, ISBN, Action, Timestamp FROM Transactions ORDER BY TransactionID;",
+         dir + "/transactions.lcol"}};
+
+    int status = 0;
+    for (int i = 0; i < 2; ++i) {
+        auto start = chrono::steady_clock::now();
+        uint64_t rows = 0;
+        if (!exportColumnar(conn, exports[i].first, i == 0 ? bookColumns : transactionColumns, exports[i].second, rows)) {
+            status = 1;
+            continue;
+        }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        ifstream written(exports[i].second, ios::binary | ios::ate);
+        double megabytes = static_cast<double>(written.tellg()) / (1 << 20);
+        cout << "Exported " << rows << " rows to " << exports[i].second << " (" << megabytes << " MB, "
+             << rows / max(seconds, 1e-9) << " rows/s)\n";
+    }
+    sqlite3_exec(conn, "COMMIT;", nullptr, nullptr, nullptr);
+    sqlite3_close(conn);
+    return status;
+}
+
+// Print each column's encodings, size and value range, from the footer only.
+int runColumnarStats(const string& path) {
+    ColumnarReader reader;
+    if (!reader.open(path)) {
+        return 1;
+    }
+    static const char* const encodingNames[] = {"?", "delta", "delta-rle", "plain", "dict", "dict-packed"};
+    uint64_t rows = 0;
+    for (const ColumnarChunk& chunk : reader.chunks()) rows += chunk.rows;
+    cout << path << ": " << rows << " rows in " << reader.chunks().size() << " chunk(s)\n";
+    for (size_t c = 0; c < reader.columns().size(); ++c) {
+        const ColumnarColumn& column = reader.columns()[c];
+        uint64_t bytes = 0;
+        uint64_t nulls = 0;
+        map<string, size_t> encodings;
+        for (const ColumnarChunk& chunk : reader.chunks()) {
+            const ColumnarChunkColumn& meta = chunk.columns[c];
+            bytes += meta.length;
+            nulls += meta.nulls;
+            ++encodings[encodingNames[meta.encoding <= EncodingDictPacked ? meta.encoding : 0]];
+        }
+        cout << "  " << column.name << (column.text ? " (text)" : " (int)") << ": " << bytes << " bytes, " << nulls
+             << " null(s), encodings";
+        for (const auto& entry : encodings) cout << " " << entry.first << "x" << entry.second;
+        if (!reader.chunks().empty()) {
+            const ColumnarChunkColumn& first = reader.chunks().front().columns[c];
+            if (column.text) {
+                cout << ", chunk 0 range [" << first.minText << ", " << first.maxText << "]";
+            } else {
+                cout << ", chunk 0 range [" << first.minInt << ", " << first.maxInt << "]";
+            }
+        }
+        cout << "\n";
+    }
+    return 0;
 }
 
 // ================================
-// Library Class
+// Streaming Export (CSV / NDJSON)
 // ================================
-class Library {
+// Writes a query result to a file descriptor row by row through a fixed
+// set of buffers, so memory stays constant however many rows there are.
+// With compression, filled buffers are handed to a background thread that
+// gzips them while the caller keeps stepping the query.
+enum class ExportFormat { Csv, Ndjson };
+
+class ExportWriter {
 public:
-    void addBook(const string& title, const string& author, const string& genre, const string& isbn, int copies);
-    void addUser(const string& name, const string& userID, const string& userType);
-    void borrowBook(const string& userID, const string& isbn);
-    void displayBooks();
-    void addBooksFromCSV(const string& filePath);
+    static constexpr size_t kBufferSize = 1 << 16;
+    static constexpr size_t kBuffers = 4; // in flight to the compressor
+
+    // gzipLevel 0 writes plain bytes; 1-9 are zlib levels.
+    ExportWriter(int fd, int gzipLevel);
+    ~ExportWriter();
+    ExportWriter(const ExportWriter&) = delete;
+    ExportWriter& operator=(const ExportWriter&) = delete;
+
+    void append(const char* data, size_t size);
+    void append(char c) {
+        if (used == kBufferSize) flush();
+        current[used++] = c;
+    }
+    void append(string_view text) { append(text.data(), text.size()); }
+    // Flush everything, end the gzip stream and stop the compressor.
+    // Returns false if any write or compression step failed.
+    bool finish();
+    uint64_t bytesWritten() const { return written; }
+
+private:
+    void flush();
+    bool writeAll(const char* data, size_t size);
+#ifdef LIBRARY_HAVE_ZLIB
+    void compressLoop();
+#endif
+
+    int fd;
+    int gzipLevel;
+    bool compress;
+    bool finished = false;
+    atomic<bool> failed{false};
+    uint64_t written = 0;
+    vector<vector<char>> buffers;
+    size_t currentIndex = 0;
+    char* current = nullptr;
+    size_t used = 0;
+
+    // Compression hand-off: indices of free and filled buffers.
+    mutex lock;
+    condition_variable changed;
+    vector<size_t> freeBuffers;
+    deque<pair<size_t, size_t>> filled; // buffer index, bytes used
+    bool closing = false;
+    thread compressor;
 };
 
-void Library::addBook(const string& title, const string& author, const string& genre, const string& isbn, int copies) {
-    // Check if the book already exists
-    const string checkSql = "SELECT COUNT(*) FROM Books WHERE ISBN = ?;";
-    sqlite3_stmt* checkStmt = nullptr;
+ExportWriter::ExportWriter(int fd, int gzipLevel)
+    : fd(fd), gzipLevel(gzipLevel), compress(gzipLevel > 0), buffers(compress ? kBuffers : 1, vector<char>(kBufferSize)) {
+    current = buffers[0].data();
+#ifdef LIBRARY_HAVE_ZLIB
+    if (compress) {
+        for (size_t i = 1; i < kBuffers; ++i) freeBuffers.push_back(i);
+        compressor = thread(&ExportWriter::compressLoop, this);
+    }
+#endif
+}
+
+ExportWriter::~ExportWriter() {
+    finish();
+}
+
+void ExportWriter::append(const char* data, size_t size) {
+    while (size > 0) {
+        if (used == kBufferSize) flush();
+        size_t take = min(size, kBufferSize - used);
+        memcpy(current + used, data, take);
+        used += take;
+        data += take;
+        size -= take;
+    }
+}
 
-    if (sqlite3_prepare_v2(db, checkSql.c_str(), -1, &checkStmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(checkStmt, 1, isbn.c_str(), -1, SQLITE_STATIC);
+bool ExportWriter::writeAll(const char* data, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            cerr << "Error writing export: " << strerror(errno) << endl;
+            failed = true;
+            return false;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+        written += static_cast<uint64_t>(n);
+    }
+    return true;
+}
 
-        if (sqlite3_step(checkStmt) == SQLITE_ROW) {
-            int count = sqlite3_column_int(checkStmt, 0);
-            sqlite3_finalize(checkStmt);
+void ExportWriter::flush() {
+    if (!compress) {
+        if (!failed) writeAll(current, used);
+        used = 0;
+        return;
+    }
+    unique_lock<mutex> guard(lock);
+    filled.emplace_back(currentIndex, used);
+    changed.notify_all();
+    changed.wait(guard, [this] { return !freeBuffers.empty(); });
+    currentIndex = freeBuffers.back();
+    freeBuffers.pop_back();
+    current = buffers[currentIndex].data();
+    used = 0;
+}
 
-            if (count > 0) {
-                cout << "Book with ISBN " << isbn << " already exists. Skipping insertion.\n";
+#ifdef LIBRARY_HAVE_ZLIB
+void ExportWriter::compressLoop() {
+    z_stream stream = {};
+    // windowBits 15 + 16 selects a gzip header and trailer.
+    if (deflateInit2(&stream, gzipLevel, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        cerr << "Error initializing gzip stream" << endl;
+        failed = true;
+    }
+    vector<char> out(kBufferSize);
+    auto deflateInto = [&](const char* data, size_t size, int mode) {
+        stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        stream.avail_in = static_cast<uInt>(size);
+        do {
+            stream.next_out = reinterpret_cast<Bytef*>(out.data());
+            stream.avail_out = static_cast<uInt>(out.size());
+            if (deflate(&stream, mode) == Z_STREAM_ERROR) {
+                failed = true;
                 return;
             }
-        } else {
-            cerr << "Error checking book existence: " << sqlite3_errmsg(db) << endl;
-            sqlite3_finalize(checkStmt);
-            return;
+            writeAll(out.data(), out.size() - stream.avail_out);
+        } while (stream.avail_out == 0);
+    };
+
+    unique_lock<mutex> guard(lock);
+    for (;;) {
+        changed.wait(guard, [this] { return !filled.empty() || closing; });
+        if (filled.empty()) break;
+        pair<size_t, size_t> job = filled.front();
+        filled.pop_front();
+        guard.unlock();
+        if (!failed) deflateInto(buffers[job.first].data(), job.second, Z_NO_FLUSH);
+        guard.lock();
+        freeBuffers.push_back(job.first);
+        changed.notify_all();
+    }
+    guard.unlock();
+    if (!failed) deflateInto(nullptr, 0, Z_FINISH);
+    deflateEnd(&stream);
+}
+#endif
+
+bool ExportWriter::finish() {
+    if (finished) return !failed;
+    finished = true;
+    if (used > 0 || !compress) flush();
+    if (compress) {
+        {
+            lock_guard<mutex> guard(lock);
+            closing = true;
         }
-    } else {
-        cerr << "Error preparing check statement: " << sqlite3_errmsg(db) << endl;
+        changed.notify_all();
+        if (compressor.joinable()) compressor.join();
+    }
+    return !failed;
+}
+
+static void appendCsvField(ExportWriter& out, const char* text, size_t size) {
+    bool quote = size > 0 && (isspace(static_cast<unsigned char>(text[0])) ||
+                              isspace(static_cast<unsigned char>(text[size - 1])));
+    for (size_t i = 0; i < size && !quote; ++i) {
+        char c = text[i];
+        quote = c == ',' || c == '"' || c == '\n' || c == '\r';
+    }
+    if (!quote) {
+        out.append(text, size);
         return;
     }
+    out.append('"');
+    size_t start = 0;
+    for (size_t i = 0; i < size; ++i) {
+        if (text[i] == '"') {
+            out.append(text + start, i + 1 - start);
+            out.append('"');
+            start = i + 1;
+        }
+    }
+    out.append(text + start, size - start);
+    out.append('"');
+}
+
+// Same escapes as jsonEscape, copied in runs straight into the buffer.
+static void appendJsonString(ExportWriter& out, const char* text, size_t size) {
+    out.append('"');
+    size_t start = 0;
+    for (size_t i = 0; i < size; ++i) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        out.append(text + start, i - start);
+        start = i + 1;
+        switch (c) {
+            case '"':  out.append("\\\"", 2); break;
+            case '\\': out.append("\\\\", 2); break;
+            case '\b': out.append("\\b", 2); break;
+            case '\f': out.append("\\f", 2); break;
+            case '\n': out.append("\\n", 2); break;
+            case '\r': out.append("\\r", 2); break;
+            case '\t': out.append("\\t", 2); break;
+            default: {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out.append(escaped, 6);
+            }
+        }
+    }
+    out.append(text + start, size - start);
+    out.append('"');
+}
 
-    // Insert the new book
-    const string insertSql = "INSERT INTO Books (ISBN, Title, Author, Genre, AvailableCopies) VALUES (?, ?, ?, ?, ?);";
-    sqlite3_stmt* insertStmt = nullptr;
+// Stream the result of sql to fd as CSV (with a header row) or NDJSON
+// (one object per row, keyed by column name). NULL is an empty CSV field
+// and JSON null. A non-zero gzipLevel gzips the stream on a background
+// thread and needs a build with -DLIBRARY_WITH_ZLIB -lz.
+bool exportQuery(sqlite3* conn, const string& sql, ExportFormat format, int fd, int gzipLevel, uint64_t& rows) {
+    static OperationMetrics instruments("exportQuery");
+    OperationScope scope(instruments);
+    TraceSpan span("exportQuery");
+    rows = 0;
+#ifndef LIBRARY_HAVE_ZLIB
+    if (gzipLevel > 0) {
+        cerr << "Error: compressed export needs a build with -DLIBRARY_WITH_ZLIB -lz" << endl;
+        return false;
+    }
+#endif
 
-    if (sqlite3_prepare_v2(db, insertSql.c_str(), -1, &insertStmt, nullptr) == SQLITE_OK) {
-        sqlite3_bind_text(insertStmt, 1, isbn.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(insertStmt, 2, title.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(insertStmt, 3, author.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_text(insertStmt, 4, genre.c_str(), -1, SQLITE_STATIC);
-        sqlite3_bind_int(insertStmt, 5, copies);
+    sqlite3_stmt* stmt = nullptr;
+    if (sqlite3_prepare_v2(conn, sql.c_str(), -1, &stmt, nullptr) != SQLITE_OK) {
+        cerr << "Error preparing export query: " << sqlite3_errmsg(conn) << endl;
+        return false;
+    }
+    int columns = sqlite3_column_count(stmt);
 
-        if (sqlite3_step(insertStmt) == SQLITE_DONE) {
-            cout << "Book added successfully.\n";
+    // Per-column text that precedes each value, built once.
+    vector<string> prefixes(static_cast<size_t>(columns));
+    ExportWriter out(fd, gzipLevel);
+    for (int c = 0; c < columns; ++c) {
+        const char* name = sqlite3_column_name(stmt, c);
+        if (format == ExportFormat::Csv) {
+            if (c > 0) out.append(',');
+            appendCsvField(out, name, strlen(name));
+            prefixes[c] = c > 0 ? "," : "";
         } else {
-            cerr << "Error adding book: " << sqlite3_errmsg(db) << endl;
+            prefixes[c] = string(c > 0 ? "," : "{") + "\"" + jsonEscape(name) + "\":";
         }
-        sqlite3_finalize(insertStmt);
+    }
+    if (format == ExportFormat::Csv) out.append('\n');
+
+    char number[32];
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        for (int c = 0; c < columns; ++c) {
+            out.append(prefixes[c]);
+            switch (sqlite3_column_type(stmt, c)) {
+                case SQLITE_INTEGER: {
+                    int length = snprintf(number, sizeof number, "%lld", static_cast<long long>(sqlite3_column_int64(stmt, c)));
+                    out.append(number, static_cast<size_t>(length));
+                    break;
+                }
+                case SQLITE_FLOAT: {
+                    int length = snprintf(number, sizeof number, "%.17g", sqlite3_column_double(stmt, c));
+                    out.append(number, static_cast<size_t>(length));
+                    break;
+                }
+                case SQLITE_NULL:
+                    if (format == ExportFormat::Ndjson) out.append("null", 4);
+                    break;
+                default: {
+                    const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, c));
+                    size_t size = static_cast<size_t>(sqlite3_column_bytes(stmt, c));
+                    if (format == ExportFormat::Csv) {
+                        appendCsvField(out, text, size);
+                    } else {
+                        appendJsonString(out, text, size);
+                    }
+                }
+            }
+        }
+        if (format == ExportFormat::Ndjson) out.append('}');
+        out.append('\n');
+        ++rows;
+    }
+    sqlite3_finalize(stmt);
+    bool ok = out.finish();
+    if (rc != SQLITE_DONE) {
+        cerr << "Error reading export query: " << sqlite3_errmsg(conn) << endl;
+        return false;
+    }
+    if (ok) scope.markOk();
+    return ok;
+}
+
+// export <books|transactions> [--format=csv|ndjson] [--gzip[=level]] [--output=path]
+// Writes to stdout unless --output is given; the summary goes to stderr.
+// --gzip defaults to level 1: at level 6 the compressor, not SQLite,
+// limits throughput.
+int runStreamExport(int argc, char* argv[]) {
+    string table = argc > 2 ? argv[2] : "";
+    ExportFormat format = ExportFormat::Csv;
+    int gzipLevel = 0;
+    string outputPath;
+    string sourcePath = databasePath;
+    for (int i = 3; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--format=csv") format = ExportFormat::Csv;
+        else if (arg == "--format=ndjson") format = ExportFormat::Ndjson;
+        else if (arg == "--gzip") gzipLevel = 1;
+        else if (arg.compare(0, 7, "--gzip=") == 0) gzipLevel = min(9, max(1, atoi(arg.c_str() + 7)));
+        else if (arg.compare(0, 9, "--output=") == 0) outputPath = arg.substr(9);
+        else if (arg.compare(0, 11, "--database=") == 0) sourcePath = arg.substr(11);
+        else {
+            cerr << "Unknown export option: " << arg << endl;
+            return 1;
+        }
+    }
+    string sql;
+    if (table == "books") {
+        sql = "SELECT ISBN, Title, Author, Genre, AvailableCopies, BorrowedCount FROM Books ORDER BY rowid;";
+    } else if (table == "transactions") {
+        sql = "SELECT TransactionID, UserID, ISBN, Action, Timestamp FROM Transactions ORDER BY TransactionID;";
     } else {
-        cerr << "Error preparing insert statement: " << sqlite3_errmsg(db) << endl;
+        cerr << "Usage: " << argv[0] << " export <books|transactions> [--format=csv|ndjson] [--gzip[=level]] [--output=path] [--database=path]" << endl;
+        return 1;
+    }
+
+    int fd = STDOUT_FILENO;
+    if (!outputPath.empty()) {
+        fd = ::open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            cerr << "Error: Could not open file " << outputPath << endl;
+            return 1;
+        }
+    }
+    sqlite3* conn = nullptr;
+    if (sqlite3_open_v2(sourcePath.c_str(), &conn, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK) {
+        cerr << "Error opening read connection: " << sqlite3_errmsg(conn) << endl;
+        sqlite3_close(conn);
+        if (fd != STDOUT_FILENO) ::close(fd);
+        return 1;
     }
+    sqlite3_busy_timeout(conn, 5000);
+    queryProfiler().attach(conn);
+
+    auto start = chrono::steady_clock::now();
+    uint64_t rows = 0;
+    bool ok = exportQuery(conn, sql, format, fd, gzipLevel, rows);
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    sqlite3_close(conn);
+    if (fd != STDOUT_FILENO) ::close(fd);
+    if (ok) {
+        cerr << "Exported " << rows << " " << table << " rows in " << seconds << " s (" << rows / max(seconds, 1e-9)
+             << " rows/s)\n";
+    }
+    return ok ? 0 : 1;
 }
 
+// ================================
+// Benchmarks
+// ================================
+// Compares "Genre = X AND AvailableCopies > 0 AND BorrowedCount >= N" as a
+// SQLite query against the snapshot filter kernels on a synthetic catalog.
+int runFilterBenchmark(size_t rows) {
+    const char* benchPath = "bench_library.db";
+    remove(benchPath);
 
-void Library::addBooksFromCSV(const string& filePath) {
-    ifstream file(filePath);
-    if (!file.is_open()) {
-        cerr << "Error: Could not open file " << filePath << endl;
-        return;
+    sqlite3* benchDb = nullptr;
+    if (sqlite3_open(benchPath, &benchDb) != SQLITE_OK) {
+        cerr << "Error opening benchmark database: " << sqlite3_errmsg(benchDb) << endl;
+        return 1;
     }
+    sqlite3_exec(benchDb,
+                 "PRAGMA journal_mode=OFF; PRAGMA synchronous=OFF;"
+                 "CREATE TABLE Books (ISBN TEXT PRIMARY KEY, Title TEXT, Author TEXT, Genre TEXT, "
+                 "AvailableCopies INTEGER, BorrowedCount INTEGER DEFAULT 0);",
+                 nullptr, nullptr, nullptr);
 
-    string line;
-    getline(file, line); // Skip the header line
+    cout << "Populating " << rows << " rows...\n";
+    sqlite3_stmt* insertStmt = nullptr;
+    sqlite3_prepare_v2(benchDb, "INSERT INTO Books VALUES (?, ?, ?, ?, ?, ?);", -1, &insertStmt, nullptr);
+    sqlite3_exec(benchDb, "BEGIN;", nullptr, nullptr, nullptr);
+    uint32_t seed = 12345;
+    auto nextRandom = [&seed]() { seed = seed * 1103515245u + 12345u; return seed >> 8; };
+    for (size_t i = 0; i < rows; ++i) {
+        string isbn = to_string(1000000000 + i);
+        string title = "BookTitle" + to_string(i);
+        string author = "Author" + to_string(i % 50000);
+        string genre = "Genre" + to_string(nextRandom() % 20);
+        sqlite3_bind_text(insertStmt, 1, isbn.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insertStmt, 2, title.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insertStmt, 3, author.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_text(insertStmt, 4, genre.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(insertStmt, 5, static_cast<int>(nextRandom() % 6));
+        sqlite3_bind_int(insertStmt, 6, static_cast<int>(nextRandom() % 1000));
+        sqlite3_step(insertStmt);
+        sqlite3_reset(insertStmt);
+    }
+    sqlite3_exec(benchDb, "COMMIT;", nullptr, nullptr, nullptr);
+    sqlite3_finalize(insertStmt);
 
-    while (getline(file, line)) {
-        stringstream ss(line);
-        string title, author, genre, isbn, copiesStr;
-        int copies;
+    const string genre = "Genre7";
+    const int minBorrowed = 500;
+    using Clock = chrono::steady_clock;
 
-        getline(ss, title, ',');
-        getline(ss, author, ',');
-        getline(ss, genre, ',');
-        getline(ss, isbn, ',');
-        getline(ss, copiesStr, ',');
+    auto sqlStart = Clock::now();
+    sqlite3_stmt* queryStmt = nullptr;
+    sqlite3_prepare_v2(benchDb,
+                       "SELECT COUNT(*) FROM Books WHERE Genre = ? AND AvailableCopies > 0 AND BorrowedCount >= ?;",
+                       -1, &queryStmt, nullptr);
+    sqlite3_bind_text(queryStmt, 1, genre.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_int(queryStmt, 2, minBorrowed);
+    int64_t sqlCount = 0;
+    if (sqlite3_step(queryStmt) == SQLITE_ROW) {
+        sqlCount = sqlite3_column_int64(queryStmt, 0);
+    }
+    sqlite3_finalize(queryStmt);
+    double sqlMs = chrono::duration<double, milli>(Clock::now() - sqlStart).count();
 
-        // Trim whitespace
-        title.erase(remove_if(title.begin(), title.end(), ::isspace), title.end());
-        author.erase(remove_if(author.begin(), author.end(), ::isspace), author.end());
-        genre.erase(remove_if(genre.begin(), genre.end(), ::isspace), genre.end());
-        isbn.erase(remove_if(isbn.begin(), isbn.end(), ::isspace), isbn.end());
+    auto loadStart = Clock::now();
+    CatalogSnapshot snapshot;
+    snapshot.load(benchDb);
+    double loadMs = chrono::duration<double, milli>(Clock::now() - loadStart).count();
 
-        try {
-            copies = stoi(copiesStr);
-            addBook(title, author, genre, isbn, copies);
-        } catch (const exception& e) {
-            cerr << "Error processing line: " << line << " (" << e.what() << ")\n";
-        }
+    const int iterations = 10;
+    size_t kernelCount = 0;
+    auto kernelStart = Clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        SelectionBitmap selected = filterColumn(snapshot.genreCodeData(), snapshot.size(), CompareOp::Equal, snapshot.genreCode(genre));
+        selected.intersect(filterColumn(snapshot.availableCopiesData(), snapshot.size(), CompareOp::Greater, 0));
+        selected.intersect(filterColumn(snapshot.borrowedCountData(), snapshot.size(), CompareOp::GreaterEqual, minBorrowed));
+        kernelCount = selected.count();
     }
+    double kernelMs = chrono::duration<double, milli>(Clock::now() - kernelStart).count() / iterations;
 
-    file.close();
-    cout << "Books added to the database from " << filePath << endl;
+    cout << "SQLite query:      " << sqlCount << " rows in " << sqlMs << " ms\n";
+    cout << "Snapshot build:    " << loadMs << " ms\n";
+    cout << "Filter kernels:    " << kernelCount << " rows in " << kernelMs << " ms"
+#ifdef LIBRARY_HAVE_AVX2
+         << (cpuHasAvx2() ? " (AVX2)" : " (scalar)")
+#else
+         << " (scalar)"
+#endif
+         << "\n";
+
+    sqlite3_close(benchDb);
+    remove(benchPath);
+    return static_cast<int64_t>(kernelCount) == sqlCount ? 0 : 1;
 }
 
-void Library::displayBooks() {
-    const string sql = "SELECT * FROM Books;";
-    sqlite3_stmt* stmt = nullptr;
+// Parse-only throughput of CsvReader against the comma split the importer
+// used before it understood quoting, over a generated file shaped like
+// large_library_dataset.csv. Nothing is written to the database.
+int runCsvBenchmark(size_t rows) {
+    const char* csvPath = "bench_books.csv";
+    {
+        ofstream out(csvPath, ios::trunc);
+        out << "ISBN,Title,Author,Genre,AvailableCopies,TimesBorrowed\n";
+        for (size_t i = 0; i < rows; ++i) {
+            out << 1000 + i << ",BookTitle" << i << ",Author" << i % 50000 << ",Genre" << i % 20 << ","
+                << i % 6 << "," << i % 1000 << "\n";
+        }
+    }
 
-    if (sqlite3_prepare_v2(db, sql.c_str(), -1, &stmt, nullptr) == SQLITE_OK) {
-        cout << "\n=== Available Books ===\n";
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-            string isbn = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
-            string title = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 1));
-            string author = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 2));
-            string genre = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 3));
-            int availableCopies = sqlite3_column_int(stmt, 4);
-            int borrowedCount = sqlite3_column_int(stmt, 5);
+    using Clock = chrono::steady_clock;
+    size_t naiveFields = 0;
+    size_t readerFields = 0;
+    double naiveSeconds = 1e30;
+    double readerSeconds = 1e30;
 
-            cout << "ISBN: " << isbn << ", Title: " << title
-                 << ", Author: " << author << ", Genre: " << genre
-                 << ", Available Copies: " << availableCopies
-                 << ", Times Borrowed: " << borrowedCount << endl;
+    for (int run = 0; run < 3; ++run) {
+        ifstream file(csvPath);
+        auto start = Clock::now();
+        string line;
+        size_t fieldsSeen = 0;
+        getline(file, line);
+        while (getline(file, line)) {
+            stringstream ss(line);
+            string field;
+            while (getline(ss, field, ',')) {
+                field.erase(remove_if(field.begin(), field.end(), ::isspace), field.end());
+                ++fieldsSeen;
+            }
         }
-        sqlite3_finalize(stmt);
-    } else {
-        cerr << "Error querying books: " << sqlite3_errmsg(db) << endl;
+        naiveSeconds = min(naiveSeconds, chrono::duration<double>(Clock::now() - start).count());
+        naiveFields = fieldsSeen;
+    }
+
+    for (int run = 0; run < 3; ++run) {
+        ifstream file(csvPath, ios::binary);
+        auto start = Clock::now();
+        CsvReader csv(file);
+        vector<string> fields;
+        size_t fieldsSeen = 0;
+        csv.next(fields);
+        while (csv.next(fields)) {
+            fieldsSeen += fields.size();
+        }
+        readerSeconds = min(readerSeconds, chrono::duration<double>(Clock::now() - start).count());
+        readerFields = fieldsSeen;
     }
+
+    ifstream sized(csvPath, ios::binary | ios::ate);
+    double megabytes = static_cast<double>(sized.tellg()) / (1 << 20);
+    sized.close();
+    remove(csvPath);
+
+    cout << "Rows: " << rows << " (" << megabytes << " MB)\n";
+    cout << "Naive comma split: " << megabytes / naiveSeconds << " MB/s\n";
+    cout << "CsvReader:         " << megabytes / readerSeconds << " MB/s ("
+         << 100.0 * naiveSeconds / readerSeconds << "% of naive throughput)\n";
+    return naiveFields == readerFields ? 0 : 1;
 }
 
 // ================================
 // Main Function
 // ================================
-int main() {
+// Writes the metrics registry to $LIBRARY_METRICS_FILE and the trace to
+// $LIBRARY_TRACE_FILE, when set, on exit from main.
+struct MetricsFileExport {
+    ~MetricsFileExport() {
+        if (const char* path = getenv("LIBRARY_METRICS_FILE")) {
+            metrics().writePrometheusFile(path);
+        }
+        if (const char* path = getenv("LIBRARY_TRACE_FILE")) {
+            tracer().writeChromeTrace(path);
+        }
+    }
+};
+
+// The test programs include this file with LIBRARY_NO_MAIN defined and
+// supply their own main.
+#ifndef LIBRARY_NO_MAIN
+int main(int argc, char* argv[]) {
+    MetricsFileExport metricsExport;
+    tracer().enable(getenv("LIBRARY_TRACE_FILE") != nullptr);
+
+    // Slow-query log: statements slower than LIBRARY_SLOW_QUERY_MS
+    // (default 100) go to LIBRARY_SLOW_QUERY_LOG (default slow_queries.log).
+    const char* slowMs = getenv("LIBRARY_SLOW_QUERY_MS");
+    const char* slowLog = getenv("LIBRARY_SLOW_QUERY_LOG");
+    queryProfiler().configure(slowMs ? strtoull(slowMs, nullptr, 10) : 100, slowLog ? slowLog : "slow_queries.log");
+
+    if (const char* changeLog = getenv("LIBRARY_CHANGE_LOG")) {
+        changeFeed().openLog(changeLog);
+    }
+
+    if (argc > 1 && string(argv[1]) == "bench-filter") {
+        size_t rows = argc > 2 ? static_cast<size_t>(stoull(argv[2])) : 10000000;
+        return runFilterBenchmark(rows);
+    }
+
+    if (argc > 1 && string(argv[1]) == "export") {
+        return runStreamExport(argc, argv);
+    }
+
+    if (argc > 1 && string(argv[1]) == "replicate") {
+#ifdef LIBRARY_HAVE_SESSION
+        return runReplica(argc, argv);
+#else
+        cerr << "Error: replication needs a build with -DLIBRARY_WITH_SESSION" << endl;
+        return 1;
+#endif
+    }
+
+    if (argc > 1 && string(argv[1]) == "backup") {
+        BackupOptions options;
+        string destination = string(databasePath) + ".bak";
+        for (int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg.compare(0, 8, "--pages=") == 0) options.pagesPerStep = atoi(arg.c_str() + 8);
+            else if (arg.compare(0, 11, "--sleep-ms=") == 0) options.sleepMs = atoi(arg.c_str() + 11);
+            else destination = arg;
+        }
+        if (options.pagesPerStep == 0 || options.sleepMs < 0) {
+            cerr << "Error: --pages must be non-zero and --sleep-ms non-negative" << endl;
+            return 1;
+        }
+        openDatabase();
+        onlineBackup().start(db, destination, options);
+        onlineBackup().wait();
+        BackupReport report = onlineBackup().report();
+        printBackupReport(cout, report);
+        closeDatabase();
+        return report.ok ? 0 : 1;
+    }
+
+    if (argc > 1 && string(argv[1]) == "export-columnar") {
+        return runColumnarExport(argc > 2 ? argv[2] : ".");
+    }
+
+    if (argc > 1 && string(argv[1]) == "columnar-stats") {
+        if (argc < 3) {
+            cerr << "Usage: " << argv[0] << " columnar-stats <file.lcol>" << endl;
+            return 1;
+        }
+        return runColumnarStats(argv[2]);
+    }
+
+    if (argc > 1 && string(argv[1]) == "bench-csv") {
+        size_t rows = argc > 2 ? static_cast<size_t>(stoull(argv[2])) : 1000000;
+        return runCsvBenchmark(rows);
+    }
+
+    if (argc > 1 && string(argv[1]) == "shard") {
+        size_t count = argc > 2 ? static_cast<size_t>(stoul(argv[2])) : 0;
+        if (count == 0) {
+            cerr << "Usage: " << argv[0] << " shard <count> [prefix]" << endl;
+            return 1;
+        }
+        openDatabase();
+        createTables();
+        closeDatabase();
+        return runShardSplit(argc > 3 ? argv[3] : shardPrefix, count);
+    }
+
     Library library;
+    // Loan limits by UserType (default student=5,staff=20).
+    if (const char* limits = getenv("LIBRARY_BORROW_LIMITS")) {
+        if (!library.setBorrowLimits(limits)) return 1;
+    }
+    // Sharding: serve Books and Transactions from $LIBRARY_SHARDS files
+    // written by `shard`. Call after createTables(), before warmStart().
+    auto enableShards = [&library]() {
+        const char* count = getenv("LIBRARY_SHARDS");
+        return !count || library.enableSharding(shardPrefix, static_cast<size_t>(atoi(count)));
+    };
+
+    if (argc > 1 && string(argv[1]) == "import") {
+        CsvImportOptions options;
+        string path = "large_library_dataset.csv";
+        for (int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--dry-run") options.validateOnly = true;
+            else if (arg == "--incremental") options.incremental = true;
+            else if (arg == "--tombstone") options.incremental = options.tombstoneMissing = true;
+            else path = arg;
+        }
+        if (!options.validateOnly) {
+            openDatabase();
+            createTables();
+            library.warmStart(catalogFilePath);
+        }
+        CsvImportReport report = library.addBooksFromCSV(path, options);
+        if (!options.validateOnly) {
+            library.saveCatalogFile(catalogFilePath);
+        }
+        closeDatabase();
+        return report.errors == 0 ? 0 : 1;
+    }
+
+    if (argc > 1 && string(argv[1]) == "import-users") {
+        UserImportOptions options;
+        string path;
+        for (int i = 2; i < argc; ++i) {
+            string arg = argv[i];
+            if (arg == "--dry-run") options.validateOnly = true;
+            else if (arg == "--on-duplicate=skip") options.onDuplicate = DuplicateUserPolicy::Skip;
+            else if (arg == "--on-duplicate=update") options.onDuplicate = DuplicateUserPolicy::Update;
+            else if (arg == "--on-duplicate=fail") options.onDuplicate = DuplicateUserPolicy::Fail;
+            else if (arg.compare(0, 2, "--") == 0) {
+                cerr << "Unrecognized argument: " << arg << endl;
+                return 1;
+            } else path = arg;
+        }
+        if (path.empty()) {
+            cerr << "Usage: " << argv[0] << " import-users [--dry-run] [--on-duplicate=skip|update|fail] <file.csv>" << endl;
+            return 1;
+        }
+        if (!options.validateOnly) {
+            openDatabase();
+            createTables();
+        }
+        CsvImportReport report = library.addUsersFromCSV(path, options);
+        if (!options.validateOnly) {
+            closeDatabase();
+        }
+        return report.errors == 0 ? 0 : 1;
+    }
+
+    if (argc > 1 && string(argv[1]) == "serve") {
+        uint16_t port = static_cast<uint16_t>(argc > 2 ? stoi(argv[2]) : 8080);
+        size_t workers = argc > 3 ? static_cast<size_t>(stoul(argv[3])) : max(2u, thread::hardware_concurrency());
+        openDatabase();
+        createTables();
+        if (!enableShards()) {
+            closeDatabase();
+            return 1;
+        }
+        library.warmStart(catalogFilePath);
+        library.enableReadPool(workers);
+        // Replication: ship changesets to $LIBRARY_REPLICATION_DIR every
+        // $LIBRARY_REPLICATION_INTERVAL_MS (default 500) for `replicate`.
+        if (const char* replicationDir = getenv("LIBRARY_REPLICATION_DIR")) {
+            const char* interval = getenv("LIBRARY_REPLICATION_INTERVAL_MS");
+            if (!library.enableReplication(replicationDir, interval ? max(1, atoi(interval)) : 500)) {
+                closeDatabase();
+                return 1;
+            }
+        }
+        int status = runServer(library, port, workers);
+        onlineBackup().wait();
+        library.saveCatalogFile(catalogFilePath);
+        library.stopReplication();
+        closeDatabase();
+        return status;
+    }
+
+    if (argc > 1 && string(argv[1]) == "loadgen") {
+        LoadConfig config;
+        if (!parseLoadArgs(argc, argv, config)) {
+            return 1;
+        }
+        openDatabase();
+        createTables();
+        if (!enableShards()) {
+            closeDatabase();
+            return 1;
+        }
+        library.warmStart(catalogFilePath);
+        if (config.target == "inproc") {
+            library.enableReadPool(config.threads);
+        }
+        int status = runLoadGenerator(library, config);
+        closeDatabase();
+        return status;
+    }
 
     // Open database connection
     openDatabase();
@@ -215,9 +8362,15 @@ int main() {
     // Create tables if they don't exist
     createTables();
 
+    // Load in-memory indexes from the catalog file, or the database if it is stale
+    library.warmStart(catalogFilePath);
+
     // Add books from the CSV file
     library.addBooksFromCSV("large_library_dataset.csv");
 
+    // Snapshot the catalog for the next start
+    library.saveCatalogFile(catalogFilePath);
+
     // Display all books
     library.displayBooks();
 
@@ -226,3 +8379,4 @@ int main() {
 
     return 0;
 }
+#endif
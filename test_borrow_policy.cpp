@@ -0,0 +1,188 @@
+#define LIBRARY_NO_MAIN
+#include "lib_m_sys.cpp"
+
+// Checks for the per-user borrowing limits: BorrowPolicy on its own, and
+// borrowBook/returnBook, and the result they report, against a scratch
+// database.
+
+const char* const testDatabasePath = "test_borrow_policy.db";
+const char* const testCatalogPath = "test_borrow_policy.snap";
+
+int failures = 0;
+
+void check(bool condition, const string& what) {
+    if (!condition) {
+        cerr << "FAILED: " << what << endl;
+        ++failures;
+    }
+}
+
+// Reserve up to attempts loans for userID; returns how many were granted
+// and leaves the limit reported by the last refusal in limit.
+int reserveMany(BorrowPolicy& policy, const string& userID, int attempts, int& limit) {
+    int granted = 0;
+    for (int i = 0; i < attempts; ++i) {
+        if (policy.reserve(userID, limit)) ++granted;
+    }
+    return granted;
+}
+
+// Test the student and staff limits a new policy starts with
+void testDefaultLimits() {
+    BorrowPolicy policy;
+    policy.setUserType("s1", "Student");
+    policy.setUserType("t1", "STAFF");
+
+    int limit = 0;
+    check(reserveMany(policy, "s1", 5, limit) == 5, "a student may borrow 5 books");
+    check(policy.atLimit("s1"), "a student with 5 loans is at the limit");
+    check(!policy.reserve("s1", limit) && limit == 5, "the 6th student loan is refused with limit 5");
+    check(reserveMany(policy, "t1", 20, limit) == 20, "staff may borrow 20 books");
+    check(!policy.reserve("t1", limit) && limit == 20, "the 21st staff loan is refused with limit 20");
+
+    policy.release("s1");
+    check(!policy.atLimit("s1"), "a return takes a student below the limit");
+    check(policy.reserve("s1", limit), "the returned slot can be borrowed again");
+
+    cout << "Default limit checks done.\n";
+}
+
+// Test limits parsed the way LIBRARY_BORROW_LIMITS is
+void testConfiguredLimits() {
+    map<string, int> limits;
+    check(BorrowPolicy::parseLimits("student=2,Staff=3,*=1", limits), "a valid limit spec parses");
+    check(limits.size() == 3 && limits["student"] == 2 && limits["Staff"] == 3 && limits["*"] == 1, "parsed limits");
+    for (const char* bad : {"student", "=3", "student=-1", "student=2x", "student=2,staff"}) {
+        map<string, int> ignored;
+        check(!BorrowPolicy::parseLimits(bad, ignored), string("rejects the limit spec ") + bad);
+    }
+
+    BorrowPolicy policy;
+    policy.setUserType("s1", "student");
+    policy.setUserType("t1", "staff");
+    policy.setUserType("v1", "visitor");
+    policy.setLimits(limits);
+
+    int limit = 0;
+    check(reserveMany(policy, "s1", 3, limit) == 2 && limit == 2, "students now stop at 2");
+    check(reserveMany(policy, "t1", 4, limit) == 3 && limit == 3, "staff type names match without regard to case");
+    check(reserveMany(policy, "v1", 2, limit) == 1 && limit == 1, "a type without an entry gets the * limit");
+
+    policy.setLimits({{"student", 0}});
+    check(!policy.reserve("s1", limit) && limit == 0, "a limit of 0 refuses every loan");
+    check(reserveMany(policy, "v1", 10, limit) == 10, "without a * entry other types are unlimited");
+
+    cout << "Configured limit checks done.\n";
+}
+
+// Test that borrowers missing from Users do not grow the policy's map
+void testUnknownUsers() {
+    BorrowPolicy policy;
+    policy.setUserType("s1", "student");
+
+    int limit = 0;
+    for (int i = 0; i < 1000; ++i) policy.reserve("ghost-" + to_string(i), limit);
+    check(policy.trackedUsers() == 1, "unlimited unknown users are not tracked");
+
+    policy.setLimits({{"student", 5}, {"*", 2}});
+    check(reserveMany(policy, "ghost", 3, limit) == 2 && limit == 2, "unknown users get the * limit");
+    check(policy.trackedUsers() == 2, "an unknown user with loans is tracked");
+    policy.release("ghost");
+    policy.release("ghost");
+    check(policy.trackedUsers() == 1, "an unknown user is dropped once the loans are back");
+    policy.release("ghost");
+    check(policy.trackedUsers() == 1, "a stray release does not add an entry");
+
+    cout << "Unknown user checks done.\n";
+}
+
+void removeTestFiles() {
+    for (const string& suffix : {"", "-wal", "-shm"}) remove((testDatabasePath + suffix).c_str());
+    remove(testCatalogPath);
+}
+
+// Test borrowBook and returnBook against the limits
+void testLibraryLimits() {
+    removeTestFiles();
+    if (sqlite3_open(testDatabasePath, &db) != SQLITE_OK) {
+        check(false, string("open ") + testDatabasePath);
+        return;
+    }
+    createTables();
+
+    {
+        Library library;
+        library.setQuiet(true);
+        check(library.setBorrowLimits("student=2,staff=3"), "Library accepts the limit spec");
+        check(!library.setBorrowLimits("student"), "Library rejects a bad limit spec");
+        library.addUser("Sam", "s1", "Student");
+        library.addBook("Dune", "Frank Herbert", "Science Fiction", "isbn-1", 10);
+        library.addBook("Emma", "Jane Austen", "Classics", "isbn-2", 10);
+        library.addBook("Ulysses", "James Joyce", "Classics", "isbn-3", 0);
+        library.warmStart(testCatalogPath);
+
+        CheckoutResult result = CheckoutResult::Ok;
+        check(library.borrowBook("s1", "isbn-1", "", &result) && result == CheckoutResult::Ok, "first borrow");
+        check(library.borrowBook("s1", "isbn-2"), "second borrow");
+        check(library.atBorrowLimit("s1"), "two loans reach the student limit");
+        check(!library.borrowBook("s1", "isbn-1", "", &result) && result == CheckoutResult::AtLimit,
+              "a borrow at the limit is refused");
+
+        check(library.returnBook("s1", "isbn-1", "", &result) && result == CheckoutResult::Ok, "return");
+        check(!library.atBorrowLimit("s1"), "a return takes the user below the limit");
+        check(!library.returnBook("s1", "isbn-1", "", &result) && result == CheckoutResult::NoLoan,
+              "a second return finds no loan");
+        check(!library.returnBook("s1", "no-such-isbn", "", &result) && result == CheckoutResult::NotFound,
+              "returning an unknown ISBN");
+
+        // A failed write must give the reserved slot back.
+        check(!library.borrowBook("s1", "no-such-isbn", "", &result) && result == CheckoutResult::NotFound,
+              "borrowing an unknown ISBN fails");
+        check(!library.borrowBook("s1", "isbn-3", "", &result) && result == CheckoutResult::Unavailable,
+              "borrowing a book with no copies fails");
+        sqlite3_exec(db, "ALTER TABLE Transactions RENAME TO TransactionsAside;", nullptr, nullptr, nullptr);
+        check(!library.borrowBook("s1", "isbn-1", "", &result) && result == CheckoutResult::StorageError,
+              "a borrow fails when its transaction cannot be logged");
+        sqlite3_exec(db, "ALTER TABLE TransactionsAside RENAME TO Transactions;", nullptr, nullptr, nullptr);
+        sqlite3* other = nullptr;
+        sqlite3_open(testDatabasePath, &other);
+        sqlite3_exec(other, "BEGIN IMMEDIATE;", nullptr, nullptr, nullptr);
+        check(!library.borrowBook("s1", "isbn-1", "", &result) && result == CheckoutResult::Busy,
+              "a borrow fails as busy while another connection writes");
+        sqlite3_exec(other, "ROLLBACK;", nullptr, nullptr, nullptr);
+        sqlite3_close(other);
+        check(!library.atBorrowLimit("s1"), "failed borrows do not hold a loan slot");
+        check(library.borrowBook("s1", "isbn-1"), "the slot is still free after the failures");
+        check(library.atBorrowLimit("s1"), "back at the limit");
+    }
+
+    {
+        // Loans already in Transactions count after a restart.
+        Library library;
+        library.setQuiet(true);
+        library.setBorrowLimits("student=2");
+        library.warmStart(testCatalogPath);
+        check(library.atBorrowLimit("s1"), "loans are reloaded from Transactions");
+        check(!library.borrowBook("s1", "isbn-2"), "the reloaded limit is enforced");
+    }
+
+    sqlite3_close(db);
+    db = nullptr;
+    removeTestFiles();
+    cout << "Library limit checks done.\n";
+}
+
+// Main function
+int main() {
+    testDefaultLimits();
+    testConfiguredLimits();
+    testUnknownUsers();
+    testLibraryLimits();
+
+    if (failures > 0) {
+        cerr << failures << " check(s) failed.\n";
+        return 1;
+    }
+    cout << "All borrowing policy checks passed.\n";
+    return 0;
+}
@@ -0,0 +1,113 @@
+#define LIBRARY_NO_MAIN
+#include "lib_m_sys.cpp"
+
+// Checks for the CSV import path: the RFC 4180 reader, header column
+// mapping and the content hash stored in Books.ContentHash.
+
+int failures = 0;
+
+void check(bool condition, const string& what) {
+    if (!condition) {
+        cerr << "FAILED: " << what << endl;
+        ++failures;
+    }
+}
+
+// Read every record of text with the given block size.
+vector<vector<string>> readAll(const string& text, size_t blockSize, vector<size_t>* lines = nullptr) {
+    istringstream in(text);
+    CsvReader reader(in, blockSize);
+    vector<vector<string>> records;
+    vector<string> fields;
+    while (reader.next(fields)) {
+        records.push_back(fields);
+        if (lines) lines->push_back(reader.line());
+    }
+    return records;
+}
+
+// Parse text with block sizes small enough to split quotes, doubled quotes
+// and CRLF pairs across refills, and once with the default block.
+void checkRecords(const string& name, const string& text, const vector<vector<string>>& expected) {
+    for (size_t blockSize : {size_t(1), size_t(2), size_t(3), size_t(7), size_t(1) << 20}) {
+        check(readAll(text, blockSize) == expected, name + " (block size " + to_string(blockSize) + ")");
+    }
+}
+
+// Test quoting, line endings and trimming in CsvReader
+void testCsvReader() {
+    checkRecords("quoted comma", "a,\"b,c\",d\n", {{"a", "b,c", "d"}});
+    checkRecords("doubled quote", "\"say \"\"hi\"\"\",x\n", {{"say \"hi\"", "x"}});
+    checkRecords("only a doubled quote", "\"\"\"\"\n", {{"\""}});
+    checkRecords("embedded newline", "\"line one\nline two\",z\nnext,row\n", {{"line one\nline two", "z"}, {"next", "row"}});
+    checkRecords("CRLF", "a,b\r\nc,d\r\n", {{"a", "b"}, {"c", "d"}});
+    checkRecords("CRLF after a quoted field", "\"q\",r\r\n\"s\"\r\n", {{"q", "r"}, {"s"}});
+    checkRecords("CRLF inside quotes is kept", "\"x\r\ny\",z\r\n", {{"x\r\ny", "z"}});
+    checkRecords("trimming at field edges only", "  a b  ,\tc d\t,e\n", {{"a b", "c d", "e"}});
+    checkRecords("quoted spaces are kept", "\" x \", y \n", {{" x ", "y"}});
+    checkRecords("empty fields", ",,\n", {{"", "", ""}});
+    checkRecords("blank line", "a\n\nb\n", {{"a"}, {""}, {"b"}});
+    checkRecords("no final newline", "a,b", {{"a", "b"}});
+    checkRecords("byte order mark", "\xEF\xBB\xBFISBN,Title\n", {{"ISBN", "Title"}});
+
+    vector<size_t> lines;
+    readAll("\"one\ntwo\nthree\",x\nsecond\n", 4, &lines);
+    check(lines == vector<size_t>({1, 4}), "line numbers count newlines inside quotes");
+
+    cout << "CsvReader checks done.\n";
+}
+
+// Test mapping header names to column positions
+void testHeaderMapping() {
+    vector<vector<string>> header = readAll(" Title , ISBN ,AUTHOR,genre,Copies,TimesBorrowed\r\n", 1 << 20);
+    BookCsvColumns books;
+    string missing;
+    check(books.map(header[0], missing), "book header with every column maps");
+    check(missing.empty(), "no book columns reported missing");
+    check(books.title == 0 && books.isbn == 1 && books.author == 2 && books.genre == 3, "book text columns");
+    check(books.availableCopies == 4 && books.borrowedCount == 5, "book count columns and their aliases");
+    check(books.width == 6, "book header width");
+
+    BookCsvColumns partial;
+    check(!partial.map({"ISBN", "Title", "Author", "Notes"}, missing), "book header without Genre is rejected");
+    check(missing == "Genre, AvailableCopies", "missing book columns are named in order: " + missing);
+    check(partial.borrowedCount == -1, "BorrowedCount is optional");
+
+    UserCsvColumns users;
+    check(users.map({"type", "Name", "ID"}, missing), "user header with aliases maps");
+    check(users.userType == 0 && users.name == 1 && users.userID == 2, "user columns");
+    check(!UserCsvColumns().map({"UserID", "Name"}, missing) && missing == "UserType", "user header without UserType");
+
+    cout << "Header mapping checks done.\n";
+}
+
+// Test that the content hash only depends on the parsed field values
+void testContentHash() {
+    int64_t hash = bookContentHash("Dune", "Frank Herbert", "Science Fiction", 5, 12);
+    check(hash == bookContentHash("Dune", "Frank Herbert", "Science Fiction", 5, 12), "hash is deterministic");
+    check(hash == bookContentHash("Dune", "Frank Herbert", "Science Fiction", parseCount("05", "AvailableCopies"), parseCount("12", "BorrowedCount")),
+          "counts hash as integers, so 05 equals 5");
+    // Stored hashes from earlier imports must keep matching.
+    check(hash == -5024648481043888319LL, "hash value is unchanged: " + to_string(hash));
+
+    check(hash != bookContentHash("Dune", "Frank Herbert", "Science Fiction", 6, 12), "copies change the hash");
+    check(hash != bookContentHash("Dune", "Frank Herbert", "Science Fiction", 5, 13), "borrowed count changes the hash");
+    check(hash != bookContentHash("Dune ", "Frank Herbert", "Science Fiction", 5, 12), "title changes the hash");
+    check(bookContentHash("ab", "c", "", 0, 0) != bookContentHash("a", "bc", "", 0, 0), "field boundaries are part of the hash");
+
+    cout << "Content hash checks done.\n";
+}
+
+// Main function
+int main() {
+    testCsvReader();
+    testHeaderMapping();
+    testContentHash();
+
+    if (failures > 0) {
+        cerr << failures << " check(s) failed.\n";
+        return 1;
+    }
+    cout << "All CSV checks passed.\n";
+    return 0;
+}
@@ -0,0 +1,218 @@
+#include <set>
+
+#define LIBRARY_NO_MAIN
+#include "lib_m_sys.cpp"
+
+// Checks for the in-memory indexes, each against a plain reference
+// structure driven by the same operations.
+
+int failures = 0;
+
+void check(bool condition, const string& what) {
+    if (!condition) {
+        cerr << "FAILED: " << what << endl;
+        ++failures;
+    }
+}
+
+// The ranking must list every book once, counts descending, each with the
+// count the reference holds for it.
+bool rankingMatches(const BorrowRanking& ranking, const map<string, int>& reference) {
+    vector<pair<string, int>> top = ranking.top(reference.size() + 1);
+    if (top.size() != reference.size()) return false;
+    set<string> seen;
+    for (size_t i = 0; i < top.size(); ++i) {
+        auto it = reference.find(top[i].first);
+        if (it == reference.end() || it->second != top[i].second || !seen.insert(top[i].first).second) return false;
+        if (i > 0 && top[i - 1].second < top[i].second) return false;
+    }
+    return true;
+}
+
+// Test top-K order in BorrowRanking as counts grow
+void testBorrowRanking() {
+    BorrowRanking ranking;
+    map<string, int> reference;
+    ranking.addAll({{"a", 3}, {"b", 1}, {"c", 3}, {"d", 0}});
+    ranking.add("e", 2);
+    ranking.add("a", 50); // already ranked: ignored
+    reference = {{"a", 3}, {"b", 1}, {"c", 3}, {"d", 0}, {"e", 2}};
+    check(rankingMatches(ranking, reference), "initial order");
+
+    for (int i = 0; i < 4; ++i) ranking.increment("d");
+    reference["d"] += 4;
+    vector<pair<string, int>> top = ranking.top(1);
+    check(top.size() == 1 && top[0] == make_pair(string("d"), 4), "a book climbs past every group to the top");
+    check(ranking.top(0).empty(), "top(0) is empty");
+
+    ranking.increment("unknown");
+    ranking.removeAll({"also-unknown"});
+    check(rankingMatches(ranking, reference), "unknown ISBNs leave the ranking alone");
+
+    // Many increments over few distinct counts exercise the group heads.
+    mt19937 random(26);
+    for (int i = 0; i < 100; ++i) {
+        string isbn = "isbn-" + to_string(i);
+        int count = static_cast<int>(random() % 5);
+        ranking.add(isbn, count);
+        reference[isbn] = count;
+    }
+    for (int i = 0; i < 20000; ++i) {
+        string isbn = "isbn-" + to_string(random() % 100);
+        ranking.increment(isbn);
+        ++reference[isbn];
+    }
+    check(rankingMatches(ranking, reference), "order after random increments");
+
+    ranking.removeAll({"a", "isbn-7", "isbn-42"});
+    for (const char* gone : {"a", "isbn-7", "isbn-42"}) reference.erase(gone);
+    ranking.increment("isbn-7");
+    ranking.increment("isbn-8");
+    ++reference["isbn-8"];
+    check(rankingMatches(ranking, reference), "order after removals");
+
+    cout << "BorrowRanking checks done.\n";
+}
+
+Book makeBook(const string& isbn, const string& title) {
+    Book book;
+    book.isbn = isbn;
+    book.title = title;
+    return book;
+}
+
+// ISBNs that land in the same BookCache shard (hashed as BookCache does,
+// over its 16 shards), so one shard's LRU order can be checked.
+vector<string> sameShardIsbns(size_t count) {
+    vector<string> isbns;
+    size_t shard = hash<string>()("lru-0") % 16;
+    for (int i = 0; isbns.size() < count; ++i) {
+        string isbn = "lru-" + to_string(i);
+        if (hash<string>()(isbn) % 16 == shard) isbns.push_back(isbn);
+    }
+    return isbns;
+}
+
+// Test BookCache eviction and ticketed puts
+void testBookCache() {
+    BookCache bounded(64);
+    for (int i = 0; i < 1000; ++i) bounded.put(makeBook("isbn-" + to_string(i), "t"));
+    CacheStats stats = bounded.stats();
+    check(stats.size == 64, "the cache holds its capacity: " + to_string(stats.size));
+    check(stats.evictions == 1000 - 64, "every insert past the capacity evicts one book");
+
+    // Two books per shard: using a book protects it from the next eviction.
+    BookCache lru(32);
+    vector<string> isbns = sameShardIsbns(3);
+    Book book;
+    lru.put(makeBook(isbns[0], "first"));
+    lru.put(makeBook(isbns[1], "second"));
+    check(lru.get(isbns[0], book), "the first book is cached");
+    lru.put(makeBook(isbns[2], "third"));
+    check(!lru.get(isbns[1], book), "the least recently used book is evicted");
+    check(lru.get(isbns[0], book) && lru.get(isbns[2], book), "recently used books stay");
+
+    // A reader that took its ticket before a writer's invalidation must
+    // not cache the row it read, nor replace a newer one.
+    BookCache cache;
+    uint64_t slowReader = cache.ticket("x");
+    cache.invalidate("x");
+    cache.put(makeBook("x", "old"), slowReader);
+    check(!cache.get("x", book), "a stale ticketed put is dropped");
+    cache.put(makeBook("x", "new"), cache.ticket("x"));
+    cache.put(makeBook("x", "old"), slowReader);
+    check(cache.get("x", book) && book.title == "new", "a stale ticketed put does not overwrite a newer row");
+    cache.invalidate("x");
+    check(!cache.get("x", book), "invalidate removes the book");
+
+    cout << "BookCache checks done.\n";
+}
+
+// The bitmap must hold exactly the reference's values.
+bool bitmapMatches(const RoaringBitmap& bitmap, const set<uint32_t>& reference, uint32_t range) {
+    if (bitmap.cardinality() != reference.size()) return false;
+    for (uint32_t value = 0; value < range; ++value) {
+        if (bitmap.contains(value) != (reference.count(value) > 0)) return false;
+    }
+    return true;
+}
+
+// Random values below range, each kept with the given probability.
+void fillRandom(RoaringBitmap& bitmap, set<uint32_t>& reference, uint32_t range, double density, mt19937& random) {
+    bernoulli_distribution keep(density);
+    for (uint32_t value = 0; value < range; ++value) {
+        if (keep(random)) {
+            bitmap.add(value);
+            reference.insert(value);
+        }
+    }
+}
+
+// Test RoaringBitmap containers and intersections against std::set
+void testRoaringBitmap() {
+    // A container is an array up to 4096 values and a bitmap beyond.
+    RoaringBitmap bitmap;
+    set<uint32_t> reference;
+    for (uint32_t i = 0; i < 4096; ++i) {
+        bitmap.add(i * 16);
+        reference.insert(i * 16);
+    }
+    bitmap.add(16); // already present
+    check(bitmap.bitmapContainers() == 0 && bitmap.cardinality() == 4096, "4096 values stay an array");
+    bitmap.add(1);
+    reference.insert(1);
+    check(bitmap.bitmapContainers() == 1 && bitmapMatches(bitmap, reference, 1 << 16), "the 4097th value switches to a bitmap");
+    bitmap.remove(32);
+    reference.erase(32);
+    check(bitmap.bitmapContainers() == 0 && bitmapMatches(bitmap, reference, 1 << 16), "back to 4096 values switches to an array");
+    bitmap.remove(3); // absent
+    check(bitmap.cardinality() == 4096, "removing an absent value changes nothing");
+
+    // Sparse and dense containers across several keys, intersected in
+    // every pairing of representations.
+    mt19937 random(30);
+    const uint32_t range = 4 << 16;
+    const double densities[] = {0.001, 0.05, 0.3, 0.9};
+    vector<RoaringBitmap> bitmaps(4);
+    vector<set<uint32_t>> references(4);
+    for (size_t i = 0; i < bitmaps.size(); ++i) {
+        fillRandom(bitmaps[i], references[i], range, densities[i], random);
+        check(bitmapMatches(bitmaps[i], references[i], range), "contents at density " + to_string(densities[i]));
+    }
+    check(bitmaps[0].bitmapContainers() == 0 && bitmaps[3].bitmapContainers() == 4, "sparse sets use arrays, dense ones bitmaps");
+    for (size_t i = 0; i < bitmaps.size(); ++i) {
+        for (size_t j = 0; j < bitmaps.size(); ++j) {
+            set<uint32_t> both;
+            set_intersection(references[i].begin(), references[i].end(), references[j].begin(), references[j].end(),
+                             inserter(both, both.end()));
+            string pair = to_string(densities[i]) + " and " + to_string(densities[j]);
+            check(bitmaps[i].andCardinality(bitmaps[j]) == both.size(), "intersection count of " + pair);
+            check(bitmapMatches(bitmaps[i].intersect(bitmaps[j]), both, range), "intersection of " + pair);
+        }
+    }
+
+    // Removing most values shrinks dense containers back to arrays.
+    for (uint32_t value = 0; value < range; ++value) {
+        if (value % 20 != 0) {
+            bitmaps[3].remove(value);
+            references[3].erase(value);
+        }
+    }
+    check(bitmaps[3].bitmapContainers() == 0 && bitmapMatches(bitmaps[3], references[3], range), "contents after removals");
+
+    cout << "RoaringBitmap checks done.\n";
+}
+
+// Main function
+int main() {
+    testBorrowRanking();
+    testBookCache();
+    testRoaringBitmap();
+
+    if (failures > 0) {
+        cerr << failures << " check(s) failed.\n";
+        return 1;
+    }
+    cout << "All index checks passed.\n";
+    return 0;
+}